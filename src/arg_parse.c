@@ -23,17 +23,18 @@
 
 #define _XOPEN_SOURCE           // strptime()
 
-#include "config.h"             // for PROJECT_NAME, PROJECT_VERSION
+#include "config.h"             // for PROJECT_NAME, PROJECT_VERSION, ...
 
 #include <assert.h>             // for assert
-#include <ctype.h>              // for isspace
+#include <ctype.h>              // for isspace, toupper
 #include <errno.h>              // for errno, ERANGE
+#include <inttypes.h>           // for PRIu64
 #include <limits.h>             // for INT_MIN, INT_MAX, LLONG_MAX, LLONG_MIN
 #include <stdbool.h>            // for false, true, bool
-#include <stdint.h>             // for SIZE_MAX
+#include <stdint.h>             // for SIZE_MAX, UINT64_MAX
 #include <stdio.h>              // for printf
 #include <stdlib.h>             // for strtoll, strtoull
-#include <string.h>             // for strcmp, strtok_r, strerror, strchr
+#include <string.h>             // for strcmp, strtok_r, strerror, strchr, ...
 #include <time.h>               // for NULL, gmtime_r, mktime, localtime_r
 
 #include <omp.h>                // for omp_set_num_threads
@@ -93,6 +94,25 @@ enum {  // command line options
     OPT_TIME_ZONE,      // set a time zone for all time-related functionality
     OPT_NO_TPUT,        // disable the TPUT algorithm for Top-N queries
     OPT_NO_BFINDEX,     // disable Bloom filter indexes
+    OPT_TREE_FANIN,     // enable the aggregation reduction tree
+    OPT_SHUFFLE,        // enable the hash-partitioned distributed aggregation
+    OPT_NO_COMPACT_XCHG,  // disable the compact encoding of exchanged records
+    OPT_COMPRESS_XCHG,  // enable the compression of exchanged messages
+    OPT_XCHG_LAYOUT,    // layout of the records in exchanged messages
+    OPT_XCHG_BUFF_SIZE,  // size of exchanged messages
+    OPT_XCHG_RING_SIZE,  // number of send buffers of each thread
+    OPT_XCHG_CREDITS,  // flow control window of each sending process
+    OPT_COMM_THREAD,  // send by a dedicated communication thread
+    OPT_XCHG_SHM,  // exchange through shared memory on the same node
+    OPT_PASSTHROUGH,  // write the raw blocks into an nfdump file
+    OPT_SLAVE_FORMAT,  // format the listed records on the slaves
+    OPT_OUTPUT_DIR,  // slaves write the listed records into the directory
+    OPT_MEM_BUDGET,     // memory budget of the aggregation memory
+    OPT_SPILL_DIR,      // scratch directory for spilled records
+    OPT_SAMPLE_SORT,    // enable the distributed sample sort
+    OPT_NO_SORT_PRUNE,  // disable the threshold-pruned sort with a limit
+    OPT_LATE_MAT,       // enable the late materialization of sorted records
+    OPT_TIME_ORDERED,   // enable the time-ordered listing
 
     OPT_HELP,  // print help
     OPT_VERSION,  // print version
@@ -146,6 +166,25 @@ static const struct option long_opts[] = {
     {"time-zone", required_argument, NULL, OPT_TIME_ZONE},
     {"no-tput", no_argument, NULL, OPT_NO_TPUT},
     {"no-bfindex", no_argument, NULL, OPT_NO_BFINDEX},
+    {"tree-fanin", required_argument, NULL, OPT_TREE_FANIN},
+    {"shuffle", no_argument, NULL, OPT_SHUFFLE},
+    {"no-compact-xchg", no_argument, NULL, OPT_NO_COMPACT_XCHG},
+    {"compress-xchg", no_argument, NULL, OPT_COMPRESS_XCHG},
+    {"xchg-layout", required_argument, NULL, OPT_XCHG_LAYOUT},
+    {"xchg-buff-size", required_argument, NULL, OPT_XCHG_BUFF_SIZE},
+    {"xchg-ring-size", required_argument, NULL, OPT_XCHG_RING_SIZE},
+    {"xchg-credits", required_argument, NULL, OPT_XCHG_CREDITS},
+    {"comm-thread", no_argument, NULL, OPT_COMM_THREAD},
+    {"xchg-shm", no_argument, NULL, OPT_XCHG_SHM},
+    {"passthrough", required_argument, NULL, OPT_PASSTHROUGH},
+    {"slave-format", no_argument, NULL, OPT_SLAVE_FORMAT},
+    {"output-dir", required_argument, NULL, OPT_OUTPUT_DIR},
+    {"mem-budget", required_argument, NULL, OPT_MEM_BUDGET},
+    {"spill-dir", required_argument, NULL, OPT_SPILL_DIR},
+    {"sample-sort", no_argument, NULL, OPT_SAMPLE_SORT},
+    {"no-sort-prune", no_argument, NULL, OPT_NO_SORT_PRUNE},
+    {"late-materialization", no_argument, NULL, OPT_LATE_MAT},
+    {"time-ordered", required_argument, NULL, OPT_TIME_ORDERED},
 
     // getting help
     {"help", no_argument, NULL, OPT_HELP},
@@ -387,6 +426,52 @@ str_to_uint(const char *const string, unsigned int *res)
     *res = tmp_res;
     return NULL;
 }
+
+/**
+ * @brief Convert a size with an optional binary unit suffix (K, M, G, or T)
+ *        from a string to an uint64_t.
+ *
+ * @param[in] string Non null string to convert.
+ * @param[out] res Pointer to a conversion destination variable.
+ *
+ * @return NULL on success, read-only error string on error.
+ */
+static const char *
+str_to_size(const char *const string, uint64_t *res)
+{
+    assert(string && res);
+
+    // split the number and the optional binary unit suffix
+    char num_str[MAX_STR_LEN];
+    const size_t len = strlen(string);
+    if (len >= sizeof (num_str)) {
+        return strerror(ERANGE);
+    }
+    strcpy(num_str, string);
+
+    unsigned shift = 0;
+    const char *const units = "KMGT";
+    const char *const unit = len == 0 ? NULL
+        : strchr(units, toupper((unsigned char)num_str[len - 1]));
+    if (unit) {
+        shift = 10 * (unit - units + 1);
+        num_str[len - 1] = '\0';
+    }
+
+    if (num_str[0] == '\0') {
+        return "missing number";
+    }
+    long unsigned int num = 0;
+    const char *const conversion_err = str_to_luint(num_str, &num);
+    if (conversion_err) {
+        return conversion_err;
+    } else if ((uint64_t)num > (UINT64_MAX >> shift)) {
+        return strerror(ERANGE);
+    }
+
+    *res = (uint64_t)num << shift;
+    return NULL;
+}
 /**  @} */  // str_to_int_group
 
 
@@ -1113,6 +1198,150 @@ set_num_threads(const char *const num_threads_str)
     return E_OK;
 }
 
+static error_code_t
+set_tree_fanin(struct cmdline_args *const args, const char *const fanin_str)
+{
+    long unsigned int fanin = 0;
+    const char *const conversion_err = str_to_luint(fanin_str, &fanin);
+    if (conversion_err) {
+        ERROR(E_ARG, "invalid reduction tree fan-in `%s': %s", fanin_str,
+              conversion_err);
+        return E_ARG;
+    } else if (fanin < 2) {
+        ERROR(E_ARG, "invalid reduction tree fan-in `%s': has to be at least 2",
+              fanin_str);
+        return E_ARG;
+    }
+
+    INFO("args: setting reduction tree fan-in to %lu", fanin);
+    args->tree_fanin = fanin;
+    return E_OK;
+}
+
+static error_code_t
+set_time_order_window(struct cmdline_args *const args,
+                      const char *const window_str)
+{
+    long unsigned int window = 0;
+    const char *const conversion_err = str_to_luint(window_str, &window);
+    if (conversion_err) {
+        ERROR(E_ARG, "invalid time order window `%s': %s", window_str,
+              conversion_err);
+        return E_ARG;
+    } else if (window < 1) {
+        ERROR(E_ARG, "invalid time order window `%s': has to be a positive number",
+              window_str);
+        return E_ARG;
+    }
+
+    INFO("args: setting time order window to %lu record(s)", window);
+    args->time_order_window = window;
+    return E_OK;
+}
+
+static error_code_t
+set_xchg_layout(struct cmdline_args *const args, const char *const layout_str)
+{
+    if (strcmp(layout_str, "prefixed") == 0) {
+        args->xchg_layout = XCHG_LAYOUT_PREFIXED;
+    } else if (strcmp(layout_str, "rows") == 0) {
+        args->xchg_layout = XCHG_LAYOUT_ROWS;
+    } else if (strcmp(layout_str, "columns") == 0) {
+        args->xchg_layout = XCHG_LAYOUT_COLUMNS;
+    } else {
+        ERROR(E_ARG, "unknown exchange layout `%s'", layout_str);
+        return E_ARG;
+    }
+
+    INFO("args: setting exchange layout to %s", layout_str);
+    return E_OK;
+}
+
+static error_code_t
+set_mem_budget(struct cmdline_args *const args, const char *const budget_str)
+{
+    uint64_t budget = 0;
+    const char *const conversion_err = str_to_size(budget_str, &budget);
+    if (conversion_err) {
+        ERROR(E_ARG, "invalid memory budget `%s': %s", budget_str,
+              conversion_err);
+        return E_ARG;
+    } else if (budget == 0) {
+        ERROR(E_ARG, "invalid memory budget `%s': has to be a positive number",
+              budget_str);
+        return E_ARG;
+    }
+
+    args->mem_budget = budget;
+    INFO("args: setting memory budget to %" PRIu64 " B", args->mem_budget);
+    return E_OK;
+}
+
+static error_code_t
+set_xchg_buff_size(struct cmdline_args *const args, const char *const size_str)
+{
+    uint64_t size = 0;
+    const char *const conversion_err = str_to_size(size_str, &size);
+    if (conversion_err) {
+        ERROR(E_ARG, "invalid exchange buffer size `%s': %s", size_str,
+              conversion_err);
+        return E_ARG;
+    } else if (size < XCHG_BUFF_SIZE_MIN || size > XCHG_BUFF_SIZE_MAX) {
+        ERROR(E_ARG, "invalid exchange buffer size `%s': has to be between %d B and %d B",
+              size_str, XCHG_BUFF_SIZE_MIN, XCHG_BUFF_SIZE_MAX);
+        return E_ARG;
+    }
+
+    args->xchg_buff_size = size;
+    INFO("args: setting exchange buffer size to %zu B", args->xchg_buff_size);
+    return E_OK;
+}
+
+static error_code_t
+set_xchg_ring_size(struct cmdline_args *const args, const char *const size_str)
+{
+    long unsigned int size = 0;
+    const char *const conversion_err = str_to_luint(size_str, &size);
+    if (conversion_err) {
+        ERROR(E_ARG, "invalid send ring size `%s': %s", size_str,
+              conversion_err);
+        return E_ARG;
+    } else if (size < XCHG_RING_SIZE_MIN || size > XCHG_RING_SIZE_MAX) {
+        ERROR(E_ARG, "invalid send ring size `%s': has to be between %d and %d",
+              size_str, XCHG_RING_SIZE_MIN, XCHG_RING_SIZE_MAX);
+        return E_ARG;
+    }
+
+    args->xchg_ring_size = size;
+    INFO("args: setting send ring size to %zu buffer(s)", args->xchg_ring_size);
+    return E_OK;
+}
+
+static error_code_t
+set_xchg_credits(struct cmdline_args *const args, const char *const credits_str)
+{
+    long unsigned int credits = 0;
+    const char *const conversion_err = str_to_luint(credits_str, &credits);
+    if (conversion_err) {
+        ERROR(E_ARG, "invalid exchange credits `%s': %s", credits_str,
+              conversion_err);
+        return E_ARG;
+    } else if (credits > XCHG_CREDITS_MAX) {
+        ERROR(E_ARG, "invalid exchange credits `%s': has to be at most %d",
+              credits_str, XCHG_CREDITS_MAX);
+        return E_ARG;
+    }
+
+    args->xchg_credits = credits;
+    if (args->xchg_credits) {
+        INFO("args: setting exchange credits to %zu message(s)",
+             args->xchg_credits);
+    } else {
+        INFO("args: disabling exchange flow control");
+    }
+    return E_OK;
+}
+
 /**
  * @brief Set time zone to initialize time conversion information for all
  *        time-related functionality.
@@ -1165,6 +1394,12 @@ arg_parse(struct cmdline_args *args, int argc, char *const argv[],
     // set default values for certain arguments
     args->use_tput = true;
     args->use_bfindex = true;
+    args->use_compact_xchg = true;
+    args->xchg_layout = XCHG_LAYOUT_PREFIXED;
+    args->xchg_buff_size = XCHG_BUFF_SIZE;
+    args->xchg_ring_size = XCHG_RING_SIZE_DEFAULT;
+    args->xchg_credits = XCHG_CREDITS_DEFAULT;
+    args->use_sort_prune = true;
     args->rec_limit = SIZE_MAX;  // SIZE_MAX means record limit is unset
 
     args->output_params.ellipsize = true;  // ellipsize long fields
@@ -1273,6 +1508,63 @@ arg_parse(struct cmdline_args *args, int argc, char *const argv[],
         case OPT_NO_BFINDEX:
             args->use_bfindex = false;
             break;
+        case OPT_TREE_FANIN:
+            ecode = set_tree_fanin(args, optarg);
+            break;
+        case OPT_SHUFFLE:
+            args->use_shuffle = true;
+            break;
+        case OPT_NO_COMPACT_XCHG:
+            args->use_compact_xchg = false;
+            break;
+        case OPT_COMPRESS_XCHG:
+            args->use_compress_xchg = true;
+            break;
+        case OPT_XCHG_LAYOUT:
+            ecode = set_xchg_layout(args, optarg);
+            break;
+        case OPT_XCHG_BUFF_SIZE:
+            ecode = set_xchg_buff_size(args, optarg);
+            break;
+        case OPT_XCHG_RING_SIZE:
+            ecode = set_xchg_ring_size(args, optarg);
+            break;
+        case OPT_XCHG_CREDITS:
+            ecode = set_xchg_credits(args, optarg);
+            break;
+        case OPT_COMM_THREAD:
+            args->use_comm_thread = true;
+            break;
+        case OPT_XCHG_SHM:
+            args->use_xchg_shm = true;
+            break;
+        case OPT_PASSTHROUGH:
+            args->passthrough_path = optarg;
+            break;
+        case OPT_SLAVE_FORMAT:
+            args->use_slave_format = true;
+            break;
+        case OPT_OUTPUT_DIR:
+            args->output_dir = optarg;
+            break;
+        case OPT_MEM_BUDGET:
+            ecode = set_mem_budget(args, optarg);
+            break;
+        case OPT_SPILL_DIR:
+            args->spill_dir = optarg;
+            break;
+        case OPT_SAMPLE_SORT:
+            args->use_sample_sort = true;
+            break;
+        case OPT_NO_SORT_PRUNE:
+            args->use_sort_prune = false;
+            break;
+        case OPT_LATE_MAT:
+            args->use_late_mat = true;
+            break;
+        case OPT_TIME_ORDERED:
+            ecode = set_time_order_window(args, optarg);
+            break;
 
         // getting help
         case OPT_HELP:
@@ -1324,6 +1616,14 @@ arg_parse(struct cmdline_args *args, int argc, char *const argv[],
     } else {  // listing mode
         DEBUG("args: using listing mode");
         args->working_mode = MODE_LIST;
+        if (args->time_order_window) {
+            // the streams are merged by the first timestamp as in sort mode
+            DEBUG("args: using time-ordered listing");
+            const bool ret = fields_set_sort_key(&args->fields, LNF_FLD_FIRST,
+                                                 LNF_SORT_ASC);
+            assert(ret);
+            (void)ret;  // to suppress -Wunused-variable with -DNDEBUG
+        }
     }
 
     // parse record limit argument option
@@ -1512,6 +1812,115 @@ arg_parse(struct cmdline_args *args, int argc, char *const argv[],
         }
     }
 
+    // the reduction tree and the shuffle are used only for aggregation and
+    // they replace TPUT
+    if (args->tree_fanin && args->use_shuffle) {
+        ERROR(E_ARG, "reduction tree and shuffle are mutually exclusive");
+        return E_ARG;
+    }
+    if (args->tree_fanin) {
+        if (args->working_mode != MODE_AGGR) {
+            INFO("disabling reduction tree, aggregation is not used");
+            args->tree_fanin = 0;
+        } else if (args->use_tput) {
+            INFO("disabling TPUT, reduction tree is used");
+            args->use_tput = false;
+        }
+    }
+    if (args->use_shuffle) {
+        if (args->working_mode != MODE_AGGR) {
+            INFO("disabling shuffle, aggregation is not used");
+            args->use_shuffle = false;
+        } else if (args->use_tput) {
+            INFO("disabling TPUT, shuffle is used");
+            args->use_tput = false;
+        }
+    }
+
+    // the memory budget is used only for aggregation, spilled records are
+    // merged on each process separately
+    if (args->mem_budget) {
+        if (args->working_mode != MODE_AGGR) {
+            INFO("disabling memory budget, aggregation is not used");
+            args->mem_budget = 0;
+        } else if (args->tree_fanin || args->use_shuffle) {
+            ERROR(E_ARG, "memory budget is mutually exclusive with "
+                  "reduction tree and shuffle");
+            return E_ARG;
+        } else if (args->use_tput) {
+            INFO("disabling TPUT, memory budget is used");
+            args->use_tput = false;
+        }
+    }
+
+    // the sample sort is used only for sorting without a record limit, the
+    // slaves send only the first records otherwise
+    if (args->use_sample_sort && (args->working_mode != MODE_SORT
+                                  || args->rec_limit)) {
+        INFO("disabling sample sort, not sorting without a record limit");
+        args->use_sample_sort = false;
+    }
+    // the threshold pruning is used only for sorting with a record limit
+    if (args->use_sort_prune && (args->working_mode != MODE_SORT
+                                 || !args->rec_limit)) {
+        args->use_sort_prune = false;
+    }
+    // the time-ordered listing is used only for listing (sorting and
+    // aggregation order by their own keys)
+    if (args->time_order_window && args->working_mode != MODE_LIST) {
+        INFO("disabling time-ordered listing, not in the listing mode");
+        args->time_order_window = 0;
+    }
+    // the late materialization is used only for sorting with a record limit,
+    // all records would be re-read otherwise
+    if (args->use_late_mat && (args->working_mode != MODE_SORT
+                               || !args->rec_limit)) {
+        INFO("disabling late materialization, not sorting with a record limit");
+        args->use_late_mat = false;
+    }
+#ifndef ENABLE_LZ4
+    if (args->use_compress_xchg) {
+        INFO("disabling compression of exchanged messages, built without LZ4");
+        args->use_compress_xchg = false;
+    }
+#endif  // ENABLE_LZ4
+    // the passed-through blocks are not decoded, so each record of each
+    // selected file is written
+    if (args->passthrough_path && (args->working_mode != MODE_LIST
+                                   || args->filter_str || args->rec_limit
+                                   || args->time_order_window)) {
+        ERROR(E_ARG, "passthrough is supported only in the listing mode "
+              "without a filter, a record limit, and the time order");
+        return E_ARG;
+    }
+    // the shards are written independently by the slave threads, so there is
+    // no global order and no global record limit
+    if (args->output_dir && (args->working_mode != MODE_LIST
+                             || args->time_order_window || args->rec_limit
+                             || args->passthrough_path
+                             || args->output_params.print_records
+                             != OUTPUT_ITEM_YES)) {
+        ERROR(E_ARG, "output directory is supported only for printing records "
+              "in the listing mode without a record limit, the time order, "
+              "and passthrough");
+        return E_ARG;
+    }
+    // the slaves format only the unordered listing, the formatted records
+    // cannot be merged
+    if (args->use_slave_format) {
+        if (args->working_mode != MODE_LIST || args->time_order_window
+                || args->passthrough_path || args->output_dir
+                || args->output_params.print_records != OUTPUT_ITEM_YES) {
+            INFO("disabling slave formatting, not printing an unordered "
+                 "listing");
+            args->use_slave_format = false;
+        } else if (args->xchg_layout != XCHG_LAYOUT_PREFIXED) {
+            INFO("using the prefixed exchange layout, records are formatted "
+                 "by the slaves");
+            args->xchg_layout = XCHG_LAYOUT_PREFIXED;
+        }
+    }
+
     const bool ret = fields_check(&args->fields);
     assert(ret);
     (void)ret;  // to suppress -Wunused-variable with -DNDEBUG
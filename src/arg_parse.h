@@ -30,6 +30,7 @@
 #include "fields.h"    // for struct fields
 #include "common.h"    // for error_code_t, field_info, progress...
 #include "output.h"    // for struct output_params
+#include "xchg.h"      // for enum xchg_layout
 
 
 /*
@@ -47,6 +48,25 @@ struct cmdline_args {
     uint64_t rec_limit;  // output record limit
     bool use_tput;  // enables the TPUT algorithm
     bool use_bfindex;    // enables the Bloom filter indexes
+    uint64_t tree_fanin;  // fan-in of the aggregation reduction tree, 0 is off
+    bool use_shuffle;  // enables the hash-partitioned distributed aggregation
+    bool use_compact_xchg;  // enables the compact encoding of exchanged records
+    bool use_compress_xchg;  // enables the compression of exchanged messages
+    enum xchg_layout xchg_layout;  // layout of the records in exchanged messages
+    size_t xchg_buff_size;  // size of exchanged messages in bytes
+    size_t xchg_ring_size;  // number of send buffers of each thread
+    size_t xchg_credits;  // flow control window, 0 means disabled
+    bool use_comm_thread;  // slaves send by a dedicated communication thread
+    bool use_xchg_shm;  // exchange through shared memory on the same node
+    char *passthrough_path;  // nfdump file for the raw blocks, NULL is off
+    bool use_slave_format;  // slaves format the listed records as text
+    char *output_dir;  // directory of the output shards, NULL is off
+    uint64_t mem_budget;  // memory budget of the aggregation in bytes, 0 is off
+    char *spill_dir;  // scratch directory for spilled records, NULL is default
+    bool use_sample_sort;  // enables the distributed sample sort
+    bool use_sort_prune;  // enables the threshold-pruned sort with a limit
+    bool use_late_mat;  // enables the late materialization of sorted records
+    uint64_t time_order_window;  // reorder window of time-ordered list, 0 is off
 
     progress_bar_type_t progress_bar_type;
     char *progress_bar_dest;
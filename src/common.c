@@ -26,14 +26,14 @@
 #include <assert.h>             // for assert
 #include <errno.h>              // for errno
 #include <stddef.h>             // for NULL, size_t
-#include <stdlib.h>             // for setenv, unsetenv, getenv
-#include <string.h>             // for strlen, strncpy
+#include <stdlib.h>             // for setenv, unsetenv, getenv, realloc, ...
+#include <string.h>             // for strlen, strncpy, memcpy
 #include <time.h>               // for nanosleep, timespec
 
 #include <mpi.h>                // for MPI_Comm
 
 #include "errwarn.h"            // for error/warning/info/debug messages, ...
-#include "fields.h"             // for struct fields
+#include "fields.h"             // for struct fields, sort_key_cmp, ...
 
 
 #define TM_YEAR_BASE 1900
@@ -44,6 +44,7 @@
  */
 MPI_Comm mpi_comm_main = MPI_COMM_NULL;
 MPI_Comm mpi_comm_progress = MPI_COMM_NULL;
+MPI_Comm mpi_comm_slaves = MPI_COMM_NULL;
 
 
 /**
@@ -131,7 +132,7 @@ mktime_utc(struct tm *tm)
  */
 /**
  * @brief Create MPI communicators mpi_comm_main and mpi_comm_progress as a
- *        duplicates of MPI_COMM_WORLD.
+ *        duplicates of MPI_COMM_WORLD and mpi_comm_slaves.
  *
  * From the MPI perspective it is incorrect to start multiple collective
  * communications on the same communicator in same time (more info in Section
@@ -142,12 +143,22 @@ mktime_utc(struct tm *tm)
  * MPI_Comm_dup() is collective on the input communicator, so it is
  * erroneous for a thread to attempt to duplicate a communicator that is
  * simultaneously involved in any other collective in any other thread.
+ *
+ * Communicator mpi_comm_slaves contains only the slaves, it is used for
+ * collective communication among the slaves without the master. On the master,
+ * it is MPI_COMM_NULL.
  */
 void
 mpi_comm_init(void)
 {
     MPI_Comm_dup(MPI_COMM_WORLD, &mpi_comm_main);
     MPI_Comm_dup(MPI_COMM_WORLD, &mpi_comm_progress);
+
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+    MPI_Comm_split(MPI_COMM_WORLD,
+                   world_rank == ROOT_PROC ? MPI_UNDEFINED : 0, world_rank,
+                   &mpi_comm_slaves);
 }
 
 /**
@@ -158,6 +169,9 @@ mpi_comm_free(void)
 {
     MPI_Comm_free(&mpi_comm_main);
     MPI_Comm_free(&mpi_comm_progress);
+    if (mpi_comm_slaves != MPI_COMM_NULL) {
+        MPI_Comm_free(&mpi_comm_slaves);
+    }
 }
 
 /**
@@ -201,28 +215,162 @@ mpi_wait_poll(MPI_Request *request, MPI_Status *status,
 
 
 /**
- * @defgroup libnf_mem Convenient wrappers operating with libnf memory.
+ * @defgroup top_n_heap Bounded binary heap of the n best sort keys.
+ *
+ * The heap keeps the n best sort keys offered so far, the worst of them at the
+ * root, so most keys are rejected after a single comparison with the root.
+ * Each key occupies a slot. The slots are allocated densely from zero and a
+ * slot keeps its index while its key moves in the heap, so the caller stores
+ * the payload of a key (e.g., the record) in its own array indexed by the slot.
  * @{
  */
+#define TOP_N_HEAP_SLOTS_INIT 1024  // initial number of slots, grows up to n
+
 /**
- * @brief Allocate a libnf hash table memory and configure for specified fields.
+ * @brief Return true if the key at the heap position a belongs after b.
+ */
+static inline bool
+top_n_worse(const struct top_n_heap *const th, const size_t a, const size_t b)
+{
+    return sort_key_cmp(th->sort_key, th->keys + th->heap[a] * th->key_size,
+                        th->keys + th->heap[b] * th->key_size) > 0;
+}
+
+static void
+top_n_swap(struct top_n_heap *const th, const size_t a, const size_t b)
+{
+    const size_t tmp = th->heap[a];
+    th->heap[a] = th->heap[b];
+    th->heap[b] = tmp;
+}
+
+static void
+top_n_sift_up(struct top_n_heap *const th, size_t i)
+{
+    while (i > 0 && top_n_worse(th, i, (i - 1) / 2)) {
+        top_n_swap(th, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+top_n_sift_down(struct top_n_heap *const th, size_t i)
+{
+    while (true) {
+        const size_t left = 2 * i + 1;
+        const size_t right = left + 1;
+        size_t worst = i;
+        if (left < th->cnt && top_n_worse(th, left, worst)) {
+            worst = left;
+        }
+        if (right < th->cnt && top_n_worse(th, right, worst)) {
+            worst = right;
+        }
+        if (worst == i) {
+            break;
+        }
+        top_n_swap(th, i, worst);
+        i = worst;
+    }
+}
+
+
+/**
+ * @brief Initialize an empty heap of at most n keys.
  *
- * The memory will be a hash table designated to perform aggregation based on
- * one or more aggregation keys. Sorting of the aggregated records is also
- * possible.
- * Destructor function libnf_mem_free() should be called to free the memory.
+ * @param[out] th The heap.
+ * @param[in] sort_key Sort key field and direction, has to outlive the heap.
+ * @param[in] n Maximum number of keys, greater than zero.
+ */
+void
+top_n_heap_init(struct top_n_heap *const th,
+                const struct sort_key *const sort_key, const size_t n)
+{
+    assert(th && sort_key && sort_key->field && n > 0);
+
+    *th = (struct top_n_heap){
+        .sort_key = sort_key,
+        .key_size = sort_key->field->size,
+        .capacity = n,
+    };
+}
+
+void
+top_n_heap_free(struct top_n_heap *const th)
+{
+    assert(th);
+
+    free(th->keys);
+    free(th->heap);
+}
+
+/**
+ * @brief Offer the key to the heap, HOT PATH!
  *
- * Note about alignment for sort key and output fields:
- *   - Use 32/128 alignment for addresses (alignment is a netmask), because we
- *     always want to have a full address.
- *   - Use zero alignment for all other fields. Otherwise, libnf would clear
- *     last bits of LNF_UINT64 type fields (to align timestamps...).
+ * If the heap is not full, the key gets a new slot, whose index is the number
+ * of keys before the call. Otherwise, a key better than the worst one replaces
+ * it and takes over its slot, other keys are rejected. The caller then stores
+ * (or overwrites) the payload of the returned slot.
  *
- * @param[in] lnf_mem Double pointer to the libnf memory data type.
- * @param[in] fields Pointer to the fields structure.
+ * @param[in,out] th The heap.
+ * @param[in] key The sort key value in the format returned by lnf_rec_fget().
+ *
+ * @return Slot of the key, or SIZE_MAX if the key was rejected.
  */
-void
-libnf_mem_init_ht(lnf_mem_t **const lnf_mem, const struct fields *const fields)
+size_t
+top_n_heap_offer(struct top_n_heap *const th, const void *const key)
+{
+    assert(th && key);
+
+    size_t i;  // heap position of the key
+    if (th->cnt < th->capacity) {  // not full yet, append the key
+        if (th->cnt == th->slots_size) {
+            th->slots_size = MIN(MAX(2 * th->slots_size,
+                                     TOP_N_HEAP_SLOTS_INIT), th->capacity);
+            th->heap = realloc(th->heap, th->slots_size * sizeof (*th->heap));
+            th->keys = realloc(th->keys, th->slots_size * th->key_size);
+            ABORT_IF(!th->heap || !th->keys, E_MEM,
+                     "top-N heap allocation failed");
+        }
+        i = th->cnt;
+        th->heap[i] = th->cnt++;
+    } else if (sort_key_cmp(th->sort_key, th->keys + th->heap[0] * th->key_size,
+                            key) > 0) {  // replace the worst key
+        i = 0;
+    } else {  // not better than the worst key
+        return SIZE_MAX;
+    }
+
+    const size_t slot = th->heap[i];
+    memcpy(th->keys + slot * th->key_size, key, th->key_size);
+    if (i == 0 && th->cnt == th->capacity) {
+        top_n_sift_down(th, 0);
+    } else {
+        top_n_sift_up(th, i);
+    }
+
+    return slot;
+}
+/**
+ * @}
+ */  // top_n_heap
+
+
+/**
+ * @defgroup libnf_mem Convenient wrappers operating with libnf memory.
+ * @{
+ */
+/**
+ * @brief Allocate a libnf hash table memory, sorted or unsorted.
+ *
+ * See libnf_mem_init_ht(). Without sorting, the sort key field is added
+ * without the sort direction, so the raw records of both variants are the
+ * same.
+ */
+static void
+libnf_mem_init_ht_internal(lnf_mem_t **const lnf_mem,
+                           const struct fields *const fields,
+                           const bool sorted)
 {
     assert(lnf_mem && fields);
     assert(fields->aggr_keys_cnt > 0);
@@ -242,7 +390,7 @@ libnf_mem_init_ht(lnf_mem_t **const lnf_mem, const struct fields *const fields)
         {
             // sort key is one of aggregation keys, merge the flags
             sort_key_is_one_of_aggregation_keys = true;
-            flags |= fields->sort_key.direction;
+            flags |= sorted ? fields->sort_key.direction : 0;
         }
 
         lnf_ret = lnf_mem_fadd(*lnf_mem, fields->aggr_keys[i].field->id, flags,
@@ -262,7 +410,8 @@ libnf_mem_init_ht(lnf_mem_t **const lnf_mem, const struct fields *const fields)
             alignment = 0;
             ipv6_alignment = 0;
         }
-        const int flags = fields->sort_key.direction | fields->sort_key.aggr_func;
+        const int flags = (sorted ? fields->sort_key.direction : 0)
+            | fields->sort_key.aggr_func;
         lnf_ret = lnf_mem_fadd(*lnf_mem, fields->sort_key.field->id,
                                flags, alignment, ipv6_alignment);
         ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_fadd() sort key");
@@ -295,6 +444,46 @@ libnf_mem_init_ht(lnf_mem_t **const lnf_mem, const struct fields *const fields)
     }
 }
 
+/**
+ * @brief Allocate a libnf hash table memory and configure for specified fields.
+ *
+ * The memory will be a hash table designated to perform aggregation based on
+ * one or more aggregation keys. Sorting of the aggregated records is also
+ * possible.
+ * Destructor function libnf_mem_free() should be called to free the memory.
+ *
+ * Note about alignment for sort key and output fields:
+ *   - Use 32/128 alignment for addresses (alignment is a netmask), because we
+ *     always want to have a full address.
+ *   - Use zero alignment for all other fields. Otherwise, libnf would clear
+ *     last bits of LNF_UINT64 type fields (to align timestamps...).
+ *
+ * @param[in] lnf_mem Double pointer to the libnf memory data type.
+ * @param[in] fields Pointer to the fields structure.
+ */
+void
+libnf_mem_init_ht(lnf_mem_t **const lnf_mem, const struct fields *const fields)
+{
+    libnf_mem_init_ht_internal(lnf_mem, fields, true);
+}
+
+/**
+ * @brief Allocate a libnf hash table memory which is never sorted.
+ *
+ * Same as libnf_mem_init_ht(), but the records are not sorted on access even
+ * if there is a sort key, so iterating through them is cheap. Raw records are
+ * interchangeable with the sorted memory, see libnf_mem_top_n().
+ *
+ * @param[in] lnf_mem Double pointer to the libnf memory data type.
+ * @param[in] fields Pointer to the fields structure.
+ */
+void
+libnf_mem_init_ht_unsorted(lnf_mem_t **const lnf_mem,
+                           const struct fields *const fields)
+{
+    libnf_mem_init_ht_internal(lnf_mem, fields, false);
+}
+
 /**
  * @brief Allocate a libnf linked list memory and configure for specified fields.
  *
@@ -362,6 +551,41 @@ libnf_mem_free(lnf_mem_t *const lnf_mem)
     lnf_mem_free(lnf_mem);
 }
 
+/**
+ * @brief Merge all records from the source libnf memory into the destination.
+ *
+ * Records are transferred in the raw format, exactly the same way as records
+ * received from the network are. If the destination memory is a hash table,
+ * records with the same aggregation key are aggregated. The source memory is
+ * not modified.
+ *
+ * @param[in,out] dst Pointer to the destination libnf memory.
+ * @param[in] src Pointer to the source libnf memory.
+ */
+void
+libnf_mem_merge(lnf_mem_t *const dst, lnf_mem_t *const src)
+{
+    assert(dst && src && dst != src);
+
+    // initialize the cursor to point to the first record in the memory
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(src, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+
+    char rec_buff[LNF_MAX_RAW_LEN];
+    while (cursor) {
+        int rec_len;
+        lnf_ret = lnf_mem_read_raw_c(src, cursor, rec_buff, &rec_len,
+                                     sizeof (rec_buff));
+        assert(lnf_ret == LNF_OK);
+        lnf_ret = lnf_mem_write_raw(dst, rec_buff, rec_len);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write_raw()");
+
+        lnf_ret = lnf_mem_next_c(src, &cursor);
+        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    }
+}
+
 /**
  * @brief Calculate number of records in the libnf memory.
  *
@@ -440,6 +664,85 @@ libnf_mem_sort(lnf_mem_t *const lnf_mem)
     assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
     (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
 }
+
+/**
+ * @brief Select the first n records by the sort key without sorting.
+ *
+ * The records of the (unsorted) source memory are passed through a binary
+ * heap of the n best records (see @ref top_n_heap), so most records are
+ * rejected after reading only their sort key. The selected raw records
+ * are written into the destination memory. The work is O(records * log n)
+ * instead of sorting all records. The heap holds n records, so n should be
+ * at most LIBNF_TOP_N_LIMIT_MAX, larger limits are better served by sorting.
+ *
+ * @param[in] src Source libnf hash table memory, see
+ *                libnf_mem_init_ht_unsorted(). Will not be modified.
+ * @param[out] dst Destination libnf hash table memory with the same fields.
+ * @param[in] fields Pointer to the fields structure with a sort key.
+ * @param[in] n Number of records to select, greater than zero.
+ *
+ * @return Number of selected records.
+ */
+uint64_t
+libnf_mem_top_n(lnf_mem_t *const src, lnf_mem_t *const dst,
+                const struct fields *const fields, const uint64_t n)
+{
+    assert(src && dst && fields && fields->sort_key.field && n > 0);
+
+    // all records of a hash table have the same length
+    const size_t rec_len = libnf_mem_rec_len(src);
+    if (rec_len == 0) {
+        return 0;  // the memory is empty
+    }
+
+    struct top_n_heap th;
+    top_n_heap_init(&th, &fields->sort_key, n);
+    uint8_t *recs = NULL;  // raw record of each heap slot
+    size_t recs_size = 0;  // number of allocated records
+
+    lnf_rec_t *lnf_rec;
+    int lnf_ret = lnf_rec_init(&lnf_rec);
+    ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_init()");
+
+    lnf_mem_cursor_t *cursor;
+    lnf_ret = lnf_mem_first_c(src, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    for (; cursor; lnf_ret = lnf_mem_next_c(src, &cursor)) {
+        lnf_ret = lnf_mem_read_c(src, cursor, lnf_rec);
+        assert(lnf_ret == LNF_OK);
+        uint8_t key[th.key_size];
+        lnf_rec_fget(lnf_rec, fields->sort_key.field->id, key);
+
+        const size_t slot = top_n_heap_offer(&th, key);
+        if (slot == SIZE_MAX) {
+            continue;  // not better than the worst record
+        }
+        if (recs_size < th.slots_size) {
+            recs_size = th.slots_size;
+            recs = realloc(recs, recs_size * rec_len);
+            ABORT_IF(!recs, E_MEM, "top-N records allocation failed");
+        }
+
+        int len;
+        lnf_ret = lnf_mem_read_raw_c(src, cursor,
+                                     (char *)recs + slot * rec_len, &len,
+                                     rec_len);
+        assert(lnf_ret == LNF_OK && (size_t)len == rec_len);
+    }
+
+    for (size_t i = 0; i < th.cnt; ++i) {
+        lnf_ret = lnf_mem_write_raw(dst, (char *)recs + i * rec_len, rec_len);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write_raw()");
+    }
+    const size_t selected_cnt = th.cnt;
+
+    free(recs);
+    top_n_heap_free(&th);
+    lnf_rec_free(lnf_rec);
+
+    return selected_cnt;
+}
+
 /**
  * @}
  */  // libnf_mem
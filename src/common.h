@@ -35,7 +35,18 @@
 
 #define ROOT_PROC 0  // MPI root processor rank
 #define MAX_STR_LEN 1024  // maximum length of a general string
-#define XCHG_BUFF_SIZE (1024 * 1024)  // 1 KiB
+#define XCHG_BUFF_SIZE (1024 * 1024)  // default size of exchanged messages, 1 MiB
+#define XCHG_BUFF_SIZE_MIN (64 * 1024)  // 64 KiB
+#define XCHG_BUFF_SIZE_MAX (256 * 1024 * 1024)  // 256 MiB
+
+// sort pruning threshold: validity flag and the sort key (at most lnf_ip_t)
+#define SORT_PRUNE_THRESHOLD_SIZE (1 + sizeof (lnf_ip_t))
+
+// libnf_mem_top_n() keeps n records, sort the whole memory for larger limits
+#define LIBNF_TOP_N_LIMIT_MAX (64 * 1024)
+
+#define FNV1A_64_OFFSET_BASIS 14695981039346656037ull  // 64-bit FNV-1a hash
+#define FNV1A_64_PRIME 1099511628211ull
 
 #define FLOW_FILE_ROTATION_INTERVAL 300 //seconds
 #define FLOW_FILE_PATH_FORMAT "%Y/%m/%d"
@@ -49,10 +60,12 @@
 struct tm;
 struct timespec;
 struct fields;
+struct sort_key;
 
 // exported global variables
 extern MPI_Comm mpi_comm_main;
 extern MPI_Comm mpi_comm_progress;
+extern MPI_Comm mpi_comm_slaves;
 
 typedef uint32_t xchg_rec_size_t;
 
@@ -86,7 +99,6 @@ typedef enum { //working modes
 enum {  // MPI point-to-point communication tags
     TAG_UNSET,
     TAG_LIST,
-    TAG_SORT,
     TAG_AGGR,
     TAG_TPUT1,
     TAG_TPUT2,
@@ -94,6 +106,11 @@ enum {  // MPI point-to-point communication tags
 
     TAG_STATS,     // messages contains statistics
     TAG_PROGRESS,  // messages containg progress info
+    TAG_CANCEL,    // empty message, the master needs no more records
+    TAG_CREDIT,    // message contains number of returned exchange credits
+
+    TAG_SORT_STREAM,  // sorted stream of a slave thread, the thread number is
+                      // added to the tag, so it has to be the last tag
 };
 
 typedef enum { //progress bar type
@@ -139,6 +156,17 @@ struct metadata_summ {
         uint64_t bytes_icmp;
         uint64_t bytes_other;
 };
+
+// bounded binary heap of the n best sort keys, see top_n_heap_offer()
+struct top_n_heap {
+        const struct sort_key *sort_key;  // sort key field and direction
+        size_t key_size;
+        size_t capacity;  // maximum number of keys (n)
+        size_t cnt;  // number of keys (and used slots) in the heap
+        size_t slots_size;  // number of allocated slots
+        size_t *heap;  // slot indexes, the worst key at [0]
+        uint8_t *keys;  // sort key of each slot
+};
 /**
  * @}
  */ //common_struct
@@ -261,10 +289,26 @@ mpi_wait_poll(MPI_Request *request, MPI_Status *status,
               const struct timespec poll_interval);
 
 
+// top_n_heap
+void
+top_n_heap_init(struct top_n_heap *const th,
+                const struct sort_key *const sort_key, const size_t n);
+
+void
+top_n_heap_free(struct top_n_heap *const th);
+
+size_t
+top_n_heap_offer(struct top_n_heap *const th, const void *const key);
+
+
 // libnf_mem
 void
 libnf_mem_init_ht(lnf_mem_t **const lnf_mem, const struct fields *const fields);
 
+void
+libnf_mem_init_ht_unsorted(lnf_mem_t **const lnf_mem,
+                           const struct fields *const fields);
+
 void
 libnf_mem_init_list(lnf_mem_t **const lnf_mem,
                     const struct fields *const fields);
@@ -272,6 +316,9 @@ libnf_mem_init_list(lnf_mem_t **const lnf_mem,
 void
 libnf_mem_free(lnf_mem_t *const lnf_mem);
 
+void
+libnf_mem_merge(lnf_mem_t *const dst, lnf_mem_t *const src);
+
 uint64_t
 libnf_mem_rec_cnt(lnf_mem_t *const lnf_mem);
 
@@ -281,6 +328,10 @@ libnf_mem_rec_len(lnf_mem_t *const lnf_mem);
 void
 libnf_mem_sort(lnf_mem_t *const lnf_mem);
 
+uint64_t
+libnf_mem_top_n(lnf_mem_t *const src, lnf_mem_t *const dst,
+                const struct fields *const fields, const uint64_t n);
+
 const char *
 libnf_sort_dir_to_str(const int sort_dir);
 
@@ -25,9 +25,10 @@
 #include "fields.h"
 
 #include <assert.h>   // for assert
+#include <inttypes.h> // for fixed-width integer types
 #include <stdbool.h>  // for false, true, bool
 #include <stddef.h>   // for size_t
-#include <string.h>   // for strlen
+#include <string.h>   // for strlen, memcmp
 
 #include <libnf.h>
 
@@ -254,6 +255,69 @@ field_get_sort_dir(const int id)
     return direction;
 }
 
+/**
+ * @brief Compare two values of the given libnf field.
+ *
+ * Values are in the format returned by lnf_rec_fget(). Numbers are compared
+ * numerically, everything else (addresses, MAC addresses, ...) byte by byte.
+ *
+ * @param[in] id ID of the libnf field.
+ * @param[in] a Pointer to the first value.
+ * @param[in] b Pointer to the second value.
+ *
+ * @return An integer less than, equal to, or greater than zero if a is found,
+ *         respectively, to be less than, to match, or be greater than b.
+ */
+int
+field_cmp(const int id, const void *const a, const void *const b)
+{
+    assert(a && b);
+
+#define FIELD_CMP_NUM(type) \
+    ((*(const type *)a > *(const type *)b) \
+     - (*(const type *)a < *(const type *)b))
+
+    switch (field_get_type(id)) {
+    case LNF_UINT8:
+        return FIELD_CMP_NUM(uint8_t);
+    case LNF_UINT16:
+        return FIELD_CMP_NUM(uint16_t);
+    case LNF_UINT32:
+        return FIELD_CMP_NUM(uint32_t);
+    case LNF_UINT64:
+        return FIELD_CMP_NUM(uint64_t);
+    case LNF_DOUBLE:
+        return FIELD_CMP_NUM(double);
+    default:
+        return memcmp(a, b, field_get_size(id));
+    }
+
+#undef FIELD_CMP_NUM
+}
+
+/**
+ * @brief Compare two values of the sort key in the output order.
+ *
+ * Same as field_cmp() on the sort key field, but the result is reversed for
+ * the descending direction.
+ *
+ * @param[in] sort_key The sort key.
+ * @param[in] a Pointer to the first value.
+ * @param[in] b Pointer to the second value.
+ *
+ * @return An integer less than, equal to, or greater than zero if a belongs,
+ *         respectively, before, to the same position as, or after b.
+ */
+int
+sort_key_cmp(const struct sort_key *const sort_key, const void *const a,
+             const void *const b)
+{
+    assert(sort_key && sort_key->field);
+
+    const int cmp = field_cmp(sort_key->field->id, a, b);
+    return (sort_key->direction == LNF_SORT_DESC) ? -cmp : cmp;
+}
+
 
 /**
  * @brief Parse a libnf field text representation.
@@ -435,6 +499,7 @@ fields_add_aggr_key(struct fields *const fields, const int id,
     fields->aggr_keys[fields->aggr_keys_cnt].alignment = alignment;
     fields->aggr_keys[fields->aggr_keys_cnt].ipv6_alignment = ipv6_alignment;
     fields->aggr_keys_cnt++;
+    fields->aggr_keys_sizes_sum += new_field->size;
 
     return true;
 }
@@ -540,6 +605,7 @@ fields_check(const struct fields *const fields)
     if (fields->aggr_keys_cnt > AGGR_KEYS_MAX) {
         return false;
     }
+    size_t aggr_keys_size_sum = 0;
     for (size_t i = 0; i < fields->aggr_keys_cnt; ++i) {
         const struct aggr_key ak = fields->aggr_keys[i];
         if(ak.field == NULL
@@ -549,6 +615,10 @@ fields_check(const struct fields *const fields)
         {
             return false;
         }
+        aggr_keys_size_sum += ak.field->size;
+    }
+    if (aggr_keys_size_sum != fields->aggr_keys_sizes_sum) {
+        return false;
     }
 
     const struct sort_key sk = fields->sort_key;
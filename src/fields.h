@@ -95,6 +95,7 @@ struct fields {
 
     struct aggr_key aggr_keys[AGGR_KEYS_MAX];
     size_t aggr_keys_cnt;
+    size_t aggr_keys_sizes_sum;
 
     struct sort_key sort_key;
 
@@ -121,6 +122,13 @@ field_get_aggr_func(const int id);
 int
 field_get_sort_dir(const int id);
 
+int
+field_cmp(const int id, const void *const a, const void *const b);
+
+int
+sort_key_cmp(const struct sort_key *const sort_key, const void *const a,
+             const void *const b);
+
 bool
 field_parse(const char str[], int *const id, int *const alignment,
             int *const ipv6_alignment);
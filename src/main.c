@@ -52,14 +52,12 @@ int
 main(int argc, char *argv[])
 {
     /*
-     * Initialize MPI and check supported thread level. MPI_THREAD_MULTIPLE is
-     * required. MPICH supports it, but Open MPI < 3.0 does not support it by
-     * default.
+     * Initialize MPI, the supported thread level is checked after parsing the
+     * arguments. MPICH supports MPI_THREAD_MULTIPLE, but Open MPI < 3.0 does
+     * not support it by default.
      */
     int thread_provided;
     MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &thread_provided);
-    ABORT_IF(thread_provided != MPI_THREAD_MULTIPLE, E_MPI,
-             "an insufficient level of thread support, MPI_THREAD_MULTIPLE is required.");
 
     // determine the calling processes rank and the total number of proecesses
     int world_rank;
@@ -82,6 +80,17 @@ main(int argc, char *argv[])
     }
     ABORT_IF(ecode != E_OK, ecode, "parsing arguments failed");
 
+    // MPI_THREAD_MULTIPLE is required, unless the communication thread
+    // (--comm-thread) makes all MPI calls of the slaves and the master
+    // receives the progress reports by its main thread
+    if (args.use_comm_thread) {
+        ABORT_IF(thread_provided < MPI_THREAD_FUNNELED, E_MPI,
+                 "an insufficient level of thread support, MPI_THREAD_FUNNELED is required.");
+    } else {
+        ABORT_IF(thread_provided != MPI_THREAD_MULTIPLE, E_MPI,
+                 "an insufficient level of thread support, MPI_THREAD_MULTIPLE is required.");
+    }
+
     // duplicate MPI_COMM_WORLD and create mpi_comm_main and mpi_comm_progress
     mpi_comm_init();
     DEBUG("created MPI communicators mpi_comm_main and mpi_comm_progress");
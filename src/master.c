@@ -29,18 +29,26 @@
 #include <math.h>               // for ceil
 #include <stdbool.h>            // for false, bool, true
 #include <stdio.h>              // for fprintf, fclose, fflush, fopen, rewind
-#include <stdlib.h>             // for free, calloc, malloc
-#include <string.h>             // for strcmp, strerror, size_t, NULL
+#include <stdlib.h>             // for free, calloc, malloc, qsort, realloc
+#include <string.h>             // for strcmp, strerror, memcpy, size_t, NULL
 #include <time.h>               // for timespec
 
 #include <libnf.h>              // for LNF_OK, lnf_mem_t, lnf_mem_first_c
 #include <mpi.h>                // for MPI_Bcast, MPI_Irecv, MPI_Reduce, MPI...
+#include <omp.h>                // for omp_get_max_threads, ...
 
 #include "arg_parse.h"          // for cmdline_args
 #include "common.h"             // for libnf_mem_free, libnf_mem_init_*, ...
 #include "errwarn.h"            // for error/warning/info/debug messages, ...
 #include "fields.h"             // for fields, sort_key, ...
+#include "nfblock.h"            // for nfblock_out_open, nfblock_out_rec, ...
 #include "output.h"             // for print_batch, output_setup, ...
+#include "spill.h"              // for spill_init, spill_account, ...
+#include "xchg.h"               // for xchg_recv_loop, ...
+
+
+#define SHARD_MANIFEST_NAME "manifest.csv"  // in the output directory
+#define SORT_PRUNE_KEYS_INIT 1024  // initial number of prefix keys, grows
 
 
 /*
@@ -53,34 +61,41 @@ static const struct cmdline_args *args;
  * Data types declarations.
  */
 struct master_ctx {  // thread-shared context
-    uint8_t *rec_buff[2];  // two record buffers for IO/communication overlap
     uint64_t slave_threads_cnt;  // number threads on all slaves
+    int *rank_threads_cnt;  // number of threads of each rank (0 for master)
+    uint64_t slave_cnt;  // number of slaves (each sends one merged stream)
+    int merge_threads_cnt;  // number of threads for the partitioned merge
 };
 
-typedef error_code_t (*recv_callback_t)(uint8_t *data, xchg_rec_size_t data_len,
-                                        void *user);
-
+// context of the multi-threaded partitioned merge
+struct merge_ctx {
+    size_t parts_cnt;       // number of partitions (and merge threads)
+    size_t key_size;        // size of the aggregation key of a raw record
+    lnf_mem_t **lnf_mems;   // disjoint hash table for each partition
+    uint8_t **stage;        // staging buffer for each partition
+    size_t stage_size;      // size of each staging buffer (a message size)
+    size_t *stage_off;      // used bytes of each staging buffer
+};
 
 /*
  * Static functions.
  */
 static struct master_ctx *
-master_ctx_init(const uint64_t slave_threads_cnt)
+master_ctx_init(int *const rank_threads_cnt, const uint64_t slave_cnt,
+                const int merge_threads_cnt)
 {
-    assert(slave_threads_cnt > 0);
+    assert(rank_threads_cnt && slave_cnt > 0 && merge_threads_cnt > 0);
 
     struct master_ctx *const m_ctx = calloc(1, sizeof (*m_ctx));
     ABORT_IF(!m_ctx, E_MEM, "master context structure allocation failed");
 
-    m_ctx->slave_threads_cnt = slave_threads_cnt;
-
-    // allocate the record buffers
-    for (uint8_t i = 0; i < 2; ++i) {
-        m_ctx->rec_buff[i] =
-            malloc(XCHG_BUFF_SIZE * sizeof (*m_ctx->rec_buff[i]));
-        ABORT_IF(!m_ctx->rec_buff[i], E_MEM,
-                 "master record buffer allocation failed");
+    m_ctx->rank_threads_cnt = rank_threads_cnt;
+    for (uint64_t rank = 1; rank <= slave_cnt; ++rank) {
+        assert(rank_threads_cnt[rank] > 0);
+        m_ctx->slave_threads_cnt += rank_threads_cnt[rank];
     }
+    m_ctx->slave_cnt = slave_cnt;
+    m_ctx->merge_threads_cnt = merge_threads_cnt;
 
     return m_ctx;
 }
@@ -90,34 +105,164 @@ master_ctx_free(struct master_ctx *const m_ctx)
 {
     assert(m_ctx);
 
-    for (uint8_t i = 0; i < 2; ++i) {
-        free(m_ctx->rec_buff[i]);
-    }
+    free(m_ctx->rank_threads_cnt);
     free(m_ctx);
 }
 
 
-static error_code_t
-mem_write_raw_callback(uint8_t *data, xchg_rec_size_t data_len, void *user)
+/**
+ * @brief Return true if the aggregated records are selected by the top-N
+ *        selection instead of sorting.
+ *
+ * With a record limit and a sort key, only the first rec_limit records are
+ * printed. The records are then received into an unsorted hash table and
+ * only the selected records are sorted (see libnf_mem_top_n()). Limits over
+ * LIBNF_TOP_N_LIMIT_MAX use the sorted hash table, the heap would be larger.
+ */
+static bool
+top_n_enabled(void)
+{
+    return args->rec_limit && args->rec_limit <= LIBNF_TOP_N_LIMIT_MAX
+        && args->fields.sort_key.field;
+}
+
+/**
+ * @brief Replace the unsorted memory by a sorted memory with its first
+ *        rec_limit records.
+ */
+static void
+mem_top_n(lnf_mem_t **const lnf_mem)
+{
+    assert(lnf_mem && *lnf_mem && top_n_enabled());
+
+    lnf_mem_t *top_mem;
+    libnf_mem_init_ht(&top_mem, &args->fields);
+    const uint64_t selected = libnf_mem_top_n(*lnf_mem, top_mem, &args->fields,
+                                              args->rec_limit);
+    DEBUG("top-N: selected %" PRIu64 " record(s)", selected);
+    (void)selected;  // to suppress -Wunused-variable with -DNDEBUG
+
+    libnf_mem_free(*lnf_mem);
+    *lnf_mem = top_mem;
+}
+
+
+/**
+ * @defgroup master_merge Multi-threaded partitioned merge of received records.
+ *
+ * Received records are split by a hash of their aggregation key into
+ * partitions. Each partition has its own hash table, so the hash tables are
+ * disjoint and can be filled in parallel, each by its own thread. Records are
+ * first staged in per-partition buffers by the receiving thread. Once a
+ * staging buffer is full, all staging buffers are flushed into the hash tables
+ * by the merge threads at once. The partitions are finally printed by
+ * print_batch_merge(), which merges them on the sort key. With a record limit,
+ * the first rec_limit records of each partition are selected in parallel
+ * first (see top_n_enabled()).
+ *
+ * The libnf raw record starts with the aggregation key, which is a
+ * concatenation of all aggregation key fields (see libnf's lnf_mem_write_raw()).
+ *
+ * @{
+ */
+static void
+merge_ctx_init(struct merge_ctx *const merge, const size_t parts_cnt)
+{
+    assert(merge && parts_cnt > 0);
+
+    merge->parts_cnt = parts_cnt;
+    merge->key_size = args->fields.aggr_keys_sizes_sum;
+    merge->stage_size = xchg_get_buff_size();
+    merge->lnf_mems = calloc(parts_cnt, sizeof (*merge->lnf_mems));
+    merge->stage = calloc(parts_cnt, sizeof (*merge->stage));
+    merge->stage_off = calloc(parts_cnt, sizeof (*merge->stage_off));
+    ABORT_IF(!merge->lnf_mems || !merge->stage || !merge->stage_off, E_MEM,
+             "merge context allocation failed");
+
+    for (size_t i = 0; i < parts_cnt; ++i) {
+        if (top_n_enabled()) {
+            libnf_mem_init_ht_unsorted(merge->lnf_mems + i, &args->fields);
+        } else {
+            libnf_mem_init_ht(merge->lnf_mems + i, &args->fields);
+        }
+        merge->stage[i] = malloc(merge->stage_size);
+        ABORT_IF(!merge->stage[i], E_MEM, "merge staging buffer allocation failed");
+    }
+}
+
+static void
+merge_ctx_free(struct merge_ctx *const merge)
 {
-    int lnf_ret = lnf_mem_write_raw((lnf_mem_t *)user, (char *)data, data_len);
-    if (lnf_ret != LNF_OK) {
-        ERROR(E_LNF, "lnf_mem_write_raw()");
-        return E_LNF;
+    assert(merge);
+
+    for (size_t i = 0; i < merge->parts_cnt; ++i) {
+        libnf_mem_free(merge->lnf_mems[i]);
+        free(merge->stage[i]);
     }
+    free(merge->stage_off);
+    free(merge->stage);
+    free(merge->lnf_mems);
+}
 
-    return E_OK;
+/**
+ * @brief Write all staged records into the hash tables, in parallel.
+ *
+ * Partition i is always processed by thread i, so each hash table is owned by
+ * exactly one merge thread.
+ */
+static void
+merge_flush(struct merge_ctx *const merge)
+{
+    assert(merge);
+
+    #pragma omp parallel for num_threads(merge->parts_cnt) schedule(static, 1)
+    for (size_t i = 0; i < merge->parts_cnt; ++i) {
+        uint8_t *rec_ptr = merge->stage[i];
+        const uint8_t *const stage_end = rec_ptr + merge->stage_off[i];
+        while (rec_ptr < stage_end) {
+            xchg_rec_size_t rec_size;
+            memcpy(&rec_size, rec_ptr, sizeof (rec_size));  // may be unaligned
+            rec_ptr += sizeof (rec_size);
+            const int lnf_ret = lnf_mem_write_raw(merge->lnf_mems[i],
+                                                  (char *)rec_ptr, rec_size);
+            ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write_raw()");
+            rec_ptr += rec_size;
+        }
+        merge->stage_off[i] = 0;
+    }
 }
 
 static error_code_t
-print_stream_next_callback(uint8_t *data, xchg_rec_size_t data_len, void *user)
+merge_stage_callback(uint8_t *data, xchg_rec_size_t data_len, void *user)
 {
-        (void)data_len;  // unused
-        (void)user;  // unused
+    struct merge_ctx *const merge = user;
+    assert(data_len >= merge->key_size);
+
+    // compute the partition from the aggregation key (64-bit FNV-1a)
+    uint64_t hash = FNV1A_64_OFFSET_BASIS;
+    for (size_t i = 0; i < merge->key_size; ++i) {
+        hash ^= data[i];
+        hash *= FNV1A_64_PRIME;
+    }
+    const size_t part = hash % merge->parts_cnt;
 
-        print_stream_next(data);
-        return E_OK;
+    // flush all staging buffers if this one is full
+    if (merge->stage_off[part] + sizeof (data_len) + data_len
+            > merge->stage_size)
+    {
+        merge_flush(merge);
+    }
+
+    uint8_t *const stage_ptr = merge->stage[part] + merge->stage_off[part];
+    memcpy(stage_ptr, &data_len, sizeof (data_len));  // may be unaligned
+    memcpy(stage_ptr + sizeof (data_len), data, data_len);
+    merge->stage_off[part] += sizeof (data_len) + data_len;
+
+    return E_OK;
 }
+/**
+ * @}
+ */  // master_merge
 
 
 /**
@@ -218,63 +363,66 @@ progress_bar_print(const struct progress_bar_ctx *const pb_ctx)
 }
 
 /**
- * @brief TODO
- *
- * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ * @brief Initialize the progress bar, gather the number of files of each
+ *        slave and print the progress bar for the first time.
  */
 static void
-progress_bar_thread(progress_bar_type_t type, char *dest)
+progress_bar_init(struct progress_bar_ctx *const pb_ctx,
+                  progress_bar_type_t type, char *dest)
 {
-    DEBUG("launching master's progress bar thread");
-
-    ////////////////////////////////////////////////////////////////////////////
-    // initialization
-    struct progress_bar_ctx pb_ctx = { .type = PROGRESS_BAR_UNSET };
-    pb_ctx.type = type;
+    *pb_ctx = (struct progress_bar_ctx){ .type = type };
     int comm_size;
     MPI_Comm_size(mpi_comm_progress, &comm_size);
     assert(comm_size > 0);
-    pb_ctx.sources_cnt = comm_size - 1;  // sources are only slaves
+    pb_ctx->sources_cnt = comm_size - 1;  // sources are only slaves
 
     // allocate memory to keep a context
-    pb_ctx.files_cnt = calloc(pb_ctx.sources_cnt, sizeof (*pb_ctx.files_cnt));
-    pb_ctx.files_cnt_goal = calloc(pb_ctx.sources_cnt, sizeof (*pb_ctx.files_cnt_goal));
-    ABORT_IF(!pb_ctx.files_cnt || !pb_ctx.files_cnt_goal, E_MEM,
+    pb_ctx->files_cnt = calloc(pb_ctx->sources_cnt,
+                               sizeof (*pb_ctx->files_cnt));
+    pb_ctx->files_cnt_goal = calloc(pb_ctx->sources_cnt,
+                                    sizeof (*pb_ctx->files_cnt_goal));
+    ABORT_IF(!pb_ctx->files_cnt || !pb_ctx->files_cnt_goal, E_MEM,
              "progress bar memory allocation failed");
 
     if (!dest || strcmp(dest, "stderr") == 0) {
-        pb_ctx.out_stream = stderr;  // stderr is the default output stream
+        pb_ctx->out_stream = stderr;  // stderr is the default output stream
     } else if (strcmp(dest, "stdout") == 0) {
-        pb_ctx.out_stream = stdout;
+        pb_ctx->out_stream = stdout;
     } else {  // destination is a file
-        pb_ctx.out_stream = fopen(dest, "w");
-        if (!pb_ctx.out_stream) {
+        pb_ctx->out_stream = fopen(dest, "w");
+        if (!pb_ctx->out_stream) {
             WARNING(E_ARG, "invalid progress bar destination `%s\': %s", dest,
                     strerror(errno));
-            pb_ctx.type = PROGRESS_BAR_NONE;  // disable progress bar
+            pb_ctx->type = PROGRESS_BAR_NONE;  // disable progress bar
         }
     }
 
     // gather the number of files to be processed by each source (goals)
     uint64_t tmp_zero = 0;  // sendbuf for MPI_Gather
-    uint64_t files_cnt_goal_sum_tmp[pb_ctx.sources_cnt + 1];  // recvbuf
+    uint64_t files_cnt_goal_sum_tmp[pb_ctx->sources_cnt + 1];  // recvbuf
     MPI_Gather(&tmp_zero, 1, MPI_UINT64_T, files_cnt_goal_sum_tmp, 1,
                MPI_UINT64_T, ROOT_PROC, mpi_comm_progress);
 
     // compute a sum of number of files to be processed (goals sum)
-    for (uint64_t i = 0; i < pb_ctx.sources_cnt; ++i) {
-        pb_ctx.files_cnt_goal[i] = files_cnt_goal_sum_tmp[i + 1];
-        pb_ctx.files_cnt_goal_sum += pb_ctx.files_cnt_goal[i];
+    for (uint64_t i = 0; i < pb_ctx->sources_cnt; ++i) {
+        pb_ctx->files_cnt_goal[i] = files_cnt_goal_sum_tmp[i + 1];
+        pb_ctx->files_cnt_goal_sum += pb_ctx->files_cnt_goal[i];
     }
 
     // print the progress bar for the first time
-    if (pb_ctx.type != PROGRESS_BAR_NONE) {
-        progress_bar_print(&pb_ctx);
+    if (pb_ctx->type != PROGRESS_BAR_NONE) {
+        progress_bar_print(pb_ctx);
     }
+}
 
-    ////////////////////////////////////////////////////////////////////////////
-    // receiving and printing loop
-    for (size_t i = 0; i < pb_ctx.files_cnt_goal_sum; ++i) {
+/**
+ * @brief Receive the progress reports of all files and print the progress
+ *        bar after each of them.
+ */
+static void
+progress_bar_recv(struct progress_bar_ctx *const pb_ctx)
+{
+    for (size_t i = 0; i < pb_ctx->files_cnt_goal_sum; ++i) {
         // start receiving the message
         MPI_Request request;
         MPI_Irecv(NULL, 0, MPI_BYTE, MPI_ANY_SOURCE, TAG_PROGRESS,
@@ -288,31 +436,29 @@ progress_bar_thread(progress_bar_type_t type, char *dest)
         assert(status.MPI_TAG == TAG_PROGRESS);
 
         const uint64_t source = status.MPI_SOURCE - 1;  // first source is n. 1
-        pb_ctx.files_cnt[source]++;
-        pb_ctx.files_cnt_sum++;
+        pb_ctx->files_cnt[source]++;
+        pb_ctx->files_cnt_sum++;
 
-        if (pb_ctx.type != PROGRESS_BAR_NONE) {
-            progress_bar_print(&pb_ctx);
+        if (pb_ctx->type != PROGRESS_BAR_NONE) {
+            progress_bar_print(pb_ctx);
         }
     }
+}
 
-    ////////////////////////////////////////////////////////////////////////////
-    // destruction
-    free(pb_ctx.files_cnt);
-    free(pb_ctx.files_cnt_goal);
+static void
+progress_bar_free(struct progress_bar_ctx *const pb_ctx)
+{
+    free(pb_ctx->files_cnt);
+    free(pb_ctx->files_cnt_goal);
 
     // close the output stream only if it's a file
-    if (pb_ctx.out_stream && pb_ctx.out_stream != stdout
-            && pb_ctx.out_stream != stderr
-            && fclose(pb_ctx.out_stream) == EOF)
+    if (pb_ctx->out_stream && pb_ctx->out_stream != stdout
+            && pb_ctx->out_stream != stderr
+            && fclose(pb_ctx->out_stream) == EOF)
     {
         WARNING(E_INTERNAL, "progress bar: %s", strerror(errno));
     }
 }
-/**
- * @}
- */  // progress_bar_master
-
 
 /**
  * @brief TODO
@@ -320,90 +466,18 @@ progress_bar_thread(progress_bar_type_t type, char *dest)
  * This function is not thread-safe without MPI_THREAD_MULTIPLE.
  */
 static void
-recv_loop(struct master_ctx *const m_ctx, const uint64_t source_cnt,
-          const uint64_t rec_limit, const int mpi_tag,
-          const recv_callback_t recv_callback, void *const callback_data)
-{
-    assert(m_ctx && source_cnt > 0 && recv_callback);
-
-    // start a first nonblocking receive from any source
-    bool buff_idx = 0;
-    MPI_Request request;
-    MPI_Irecv(m_ctx->rec_buff[buff_idx], XCHG_BUFF_SIZE, MPI_BYTE,
-              MPI_ANY_SOURCE, mpi_tag, mpi_comm_main, &request);
-
-
-    // receiving loop
-    size_t rec_cntr = 0;  // processed records counter
-    size_t msg_cntr = 0;  // received messages counter
-    bool limit_exceeded = false;
-    size_t active_sources = source_cnt;
-    struct timespec polling_interval = { 0u, 1000000ul }; // start with 1 ms
-    DEBUG("recv_loop: receiving from %zu source(s)", active_sources);
-    while (active_sources) {
-        // wait for a message from any source
-        MPI_Status status;
-        mpi_wait_poll(&request, &status, polling_interval);
-        polling_interval.tv_nsec = 0;  // switch to busy wait after first message
-        assert(status.MPI_TAG == mpi_tag);
-
-        // determine actual size of received message
-        int msg_size;
-        MPI_Get_count(&status, MPI_BYTE, &msg_size);
-        assert(msg_size >= 0);
-
-        if (msg_size == 0) {  // empty message is a terminator
-            if (--active_sources) {
-                DEBUG("recv_loop: received termination, %zu source(s) remaining",
-                      active_sources);
-                // start receiving next message into the same buffer
-                MPI_Irecv(m_ctx->rec_buff[buff_idx], XCHG_BUFF_SIZE, MPI_BYTE,
-                          MPI_ANY_SOURCE, mpi_tag, mpi_comm_main, &request);
-            } else {
-                DEBUG("recv_loop: received termination, no sources remaining");
-            }
-            continue;
-        }
-        msg_cntr++;  // do not include terminators in the counter
-
-        // rec_ptr is a pointer to record in the record buffer
-        uint8_t *rec_ptr = m_ctx->rec_buff[buff_idx];
-        // msg_end is a pointer to the end of the last record
-        const uint8_t *const msg_end = rec_ptr + msg_size;
-
-        // toggle buffers and start receiving next message into the free buffer
-        buff_idx = !buff_idx;
-        MPI_Irecv(m_ctx->rec_buff[buff_idx], XCHG_BUFF_SIZE, MPI_BYTE,
-                  MPI_ANY_SOURCE, mpi_tag, mpi_comm_main, &request);
-
-        if (limit_exceeded) {
-            continue;  // do not process further, but continue receiving
-        }
-
-        /*
-         * Call the callback function for each record in the received message.
-         * Each record is prefixed with a 4 bytes long record size.
-         */
-        while (rec_ptr < msg_end) {
-            const xchg_rec_size_t rec_size = *(xchg_rec_size_t *)(rec_ptr);
-
-            rec_ptr += sizeof (rec_size);  // shift the pointer to the record
-            const error_code_t ecode = recv_callback(rec_ptr, rec_size,
-                                                     callback_data);
-            ABORT_IF(ecode != E_OK, ecode, "recv_callback() failed");
-
-            rec_ptr += rec_size; // shift the pointer to the next record
-            if (++rec_cntr == rec_limit) {
-                limit_exceeded = true;
-                break;
-            }
-        }
-    }
+progress_bar_thread(progress_bar_type_t type, char *dest)
+{
+    DEBUG("launching master's progress bar thread");
 
-    assert(request == MPI_REQUEST_NULL);
-    DEBUG("recv_loop: received %zu message(s) with tag %d containing %zu records",
-          msg_cntr, mpi_tag, rec_cntr);
+    struct progress_bar_ctx pb_ctx;
+    progress_bar_init(&pb_ctx, type, dest);
+    progress_bar_recv(&pb_ctx);
+    progress_bar_free(&pb_ctx);
 }
+/**
+ * @}
+ */  // progress_bar_master
 
 
 /**
@@ -506,8 +580,8 @@ tput_phase_1(struct master_ctx *const m_ctx, lnf_mem_t *const lnf_mem)
 
     // receive the top N items from each source and aggregate (aggregation will
     // calculate the partial sums)
-    recv_loop(m_ctx, m_ctx->slave_threads_cnt, 0, TAG_TPUT1,
-              mem_write_raw_callback, lnf_mem);
+    xchg_recv_loop(m_ctx->slave_cnt, 0, TAG_TPUT1, xchg_mem_write_raw_callback,
+                   lnf_mem);
 
     const uint64_t bottom = tput_phase_1_find_bottom(lnf_mem);
 
@@ -518,7 +592,7 @@ tput_phase_1(struct master_ctx *const m_ctx, lnf_mem_t *const lnf_mem)
 /**
  * @brief Master's TPUT phase 2: prune away ineligible objects.
  *
- * The master now sets a threshold = (phase 1 bottom / source_cnt), and sends it
+ * The master now sets a threshold = (phase 1 bottom / slave_cnt), and sends it
  * to all sources.
  * The master the receives all records (from all sources) satisfying the
  * threshold. At the end of this round-trip, the master has seen records in the
@@ -542,13 +616,13 @@ tput_phase_2(struct master_ctx *const m_ctx, lnf_mem_t **const lnf_mem,
     libnf_mem_init_ht(lnf_mem, &args->fields);
 
     // calculate threshold from the phase 1 bottom and broadcast it
-    uint64_t threshold = ceil((double)phase_1_bottom / m_ctx->slave_threads_cnt);
+    uint64_t threshold = ceil((double)phase_1_bottom / m_ctx->slave_cnt);
     MPI_Bcast(&threshold, 1, MPI_UINT64_T, ROOT_PROC, mpi_comm_main);
     DEBUG("master TPUT phase 2: broadcasted threshold = %" PRIu64, threshold);
 
     // receive all records satisfying the threshold
-    recv_loop(m_ctx, m_ctx->slave_threads_cnt, 0, TAG_TPUT2,
-              mem_write_raw_callback, *lnf_mem);
+    xchg_recv_loop(m_ctx->slave_cnt, 0, TAG_TPUT2, xchg_mem_write_raw_callback,
+                   *lnf_mem);
 
     DEBUG("master TPUT phase 2: done");
 }
@@ -611,8 +685,8 @@ tput_phase_3(struct master_ctx *const m_ctx, lnf_mem_t **const lnf_mem)
     libnf_mem_init_ht(lnf_mem, &args->fields);
 
     // receive the filnal top N records from the slaves
-    recv_loop(m_ctx, m_ctx->slave_threads_cnt, 0, TAG_TPUT3,
-              mem_write_raw_callback, *lnf_mem);
+    xchg_recv_loop(m_ctx->slave_cnt, 0, TAG_TPUT3, xchg_mem_write_raw_callback,
+                   *lnf_mem);
     DEBUG("master TPUT phase 3: done");
 }
 /**
@@ -621,42 +695,688 @@ tput_phase_3(struct master_ctx *const m_ctx, lnf_mem_t **const lnf_mem)
 
 
 /**
- * @brief TODO
+ * @defgroup master_list_cancel Cancellation of the listing by the record limit.
+ *
+ * Each slave receives exactly one empty TAG_CANCEL message during the
+ * listing. It is sent as soon as the record limit is reached, so the slaves
+ * stop reading their flow files, or after all records are received
+ * otherwise.
+ *
+ * @{
+ */
+struct list_recv_ctx {
+    const struct master_ctx *m_ctx;
+    uint64_t rec_cntr;  // number of printed records
+    MPI_Request *cancel_requests;  // one per slave, NULL if not sent yet
+};
+
+/**
+ * @brief Send the cancellation to all slaves.
+ */
+static void
+list_cancel(struct list_recv_ctx *const lr_ctx)
+{
+    assert(lr_ctx && !lr_ctx->cancel_requests);
+
+    const uint64_t slave_cnt = lr_ctx->m_ctx->slave_cnt;
+    lr_ctx->cancel_requests = malloc(slave_cnt
+                                     * sizeof (*lr_ctx->cancel_requests));
+    ABORT_IF(!lr_ctx->cancel_requests, E_MEM,
+             "cancel requests allocation failed");
+    for (uint64_t i = 0; i < slave_cnt; ++i) {
+        MPI_Isend(NULL, 0, MPI_BYTE, i + 1, TAG_CANCEL, mpi_comm_main,
+                  lr_ctx->cancel_requests + i);
+    }
+}
+
+/**
+ * @brief Receive callback printing the record, cancel at the record limit.
+ *
+ * With --slave-format, the record is already formatted by the slave.
+ */
+static error_code_t
+list_recv_callback(uint8_t *data, xchg_rec_size_t data_len, void *user)
+{
+    struct list_recv_ctx *const lr_ctx = user;
+
+    if (args->use_slave_format) {
+        fwrite(data, 1, data_len, stdout);
+    } else {
+        print_stream_next(data);
+    }
+    if (++lr_ctx->rec_cntr == args->rec_limit) {
+        DEBUG("record limit reached, cancelling the slaves");
+        list_cancel(lr_ctx);
+    }
+    return E_OK;
+}
+/**
+ * @}
+ */  // master_list_cancel
+
+/**
+ * @brief Receive records from all slave threads and print them.
+ *
+ * Slaves are cancelled when the record limit is reached (see @ref
+ * master_list_cancel).
  */
 static void
 list_main(struct master_ctx *const m_ctx)
 {
     assert(m_ctx);
 
+    struct list_recv_ctx lr_ctx = { .m_ctx = m_ctx };
+
     print_stream_names();
-    recv_loop(m_ctx, m_ctx->slave_threads_cnt, args->rec_limit, TAG_LIST,
-              print_stream_next_callback, NULL);
+    xchg_recv_loop(m_ctx->slave_threads_cnt, args->rec_limit, TAG_LIST,
+                   list_recv_callback, &lr_ctx);
+
+    if (!lr_ctx.cancel_requests) {  // the limit was not reached
+        list_cancel(&lr_ctx);
+    }
+    MPI_Waitall(m_ctx->slave_cnt, lr_ctx.cancel_requests, MPI_STATUSES_IGNORE);
+    free(lr_ctx.cancel_requests);
 }
 
 /**
- * @brief TODO
+ * @brief Gather the record counts of the output shards, write the manifest.
+ *
+ * The slave threads write their records directly into the shards in the
+ * output directory (see @ref slave_shards). The manifest lists the file name
+ * and the record count of each non-empty shard, one per line in CSV.
+ */
+static void
+shard_main(struct master_ctx *const m_ctx)
+{
+    assert(m_ctx);
+
+    int *const displs = calloc(m_ctx->slave_cnt + 1, sizeof (*displs));
+    uint64_t *const rec_cnts = calloc(m_ctx->slave_threads_cnt,
+                                      sizeof (*rec_cnts));
+    ABORT_IF(!displs || !rec_cnts, E_MEM,
+             "shard record counts allocation failed");
+    for (uint64_t rank = 2; rank <= m_ctx->slave_cnt; ++rank) {
+        displs[rank] = displs[rank - 1] + m_ctx->rank_threads_cnt[rank - 1];
+    }
+    MPI_Gatherv(NULL, 0, MPI_UINT64_T, rec_cnts, m_ctx->rank_threads_cnt,
+                displs, MPI_UINT64_T, ROOT_PROC, mpi_comm_main);
+
+    output_dir_create(args->output_dir);
+    char path[MAX_STR_LEN];
+    const int ret = snprintf(path, sizeof (path), "%s/%s", args->output_dir,
+                             SHARD_MANIFEST_NAME);
+    ABORT_IF(ret < 0 || (size_t)ret >= sizeof (path), E_ARG,
+             "output directory path `%s' is too long", args->output_dir);
+    FILE *const manifest = fopen(path, "w");
+    ABORT_IF(!manifest, E_ARG, "`%s': unable to create the manifest: %s", path,
+             strerror(errno));
+
+    uint64_t shard_cnt = 0;
+    uint64_t rec_cnt = 0;
+    fprintf(manifest, "shard,records\n");
+    for (uint64_t rank = 1; rank <= m_ctx->slave_cnt; ++rank) {
+        for (int thread = 0; thread < m_ctx->rank_threads_cnt[rank];
+                ++thread) {
+            const uint64_t shard_rec_cnt = rec_cnts[displs[rank] + thread];
+            if (shard_rec_cnt == 0) {
+                continue;  // no record matched, the shard was not created
+            }
+            char name[MAX_STR_LEN];
+            output_shard_name(name, sizeof (name), rank, thread);
+            fprintf(manifest, "%s,%" PRIu64 "\n", name, shard_rec_cnt);
+            shard_cnt++;
+            rec_cnt += shard_rec_cnt;
+        }
+    }
+    ABORT_IF(fclose(manifest) != 0, E_INTERNAL, "`%s': write failed: %s",
+             path, strerror(errno));
+    INFO("wrote %" PRIu64 " record(s) into %" PRIu64 " shard(s) in `%s'",
+         rec_cnt, shard_cnt, args->output_dir);
+
+    free(displs);
+    free(rec_cnts);
+}
+
+/**
+ * @brief Receive callback appending the block record to the output file.
+ */
+static error_code_t
+passthrough_recv_callback(uint8_t *data, xchg_rec_size_t data_len, void *user)
+{
+    nfblock_out_rec(user, data, data_len);
+    return E_OK;
+}
+
+/**
+ * @brief Receive the raw blocks from all slave threads and write them.
+ *
+ * The records are not decoded, the blocks are concatenated into one nfdump
+ * file, each input file contiguous and in the block order (see @ref
+ * nfblock.c). There is no record limit, so the slaves are not cancelled.
+ */
+static void
+passthrough_main(struct master_ctx *const m_ctx)
+{
+    assert(m_ctx);
+
+    struct nfblock_out out;
+    nfblock_out_open(&out, args->passthrough_path);
+    xchg_recv_loop(m_ctx->slave_threads_cnt, 0, TAG_LIST,
+                   passthrough_recv_callback, &out);
+    nfblock_out_close(&out);
+}
+
+/**
+ * @defgroup master_sort_merge Streaming k-way merge of sorted streams.
+ *
+ * Each slave thread sends its records sorted by the sort key as a separate
+ * stream with its own tag (TAG_SORT_STREAM + thread number), in the same
+ * format as in the list mode. The master receives from each stream separately
+ * into its own pair of buffers of XCHG_STREAM_BUFF_SIZE bytes and merges the
+ * streams using a loser tree. A record is printed as soon as it is the
+ * smallest of the current records of all streams, so the first record is
+ * printed right after each stream delivers its first message and the memory
+ * is bounded by the buffers. After rec_limit records are printed, the
+ * remaining records are only received and discarded.
+ *
+ * The time-ordered listing (see @ref slave_time_order) uses the same merge,
+ * the streams are ordered by the first timestamp.
+ *
+ * With the sample sort (see @ref slave_sample_sort), each slave sends one
+ * stream of its disjoint key range, so the merge only concatenates them.
+ *
+ * With a record limit N, the streams are pruned by a threshold, in the spirit
+ * of the TPUT phases. The first message of each stream is a short prefix of
+ * its records (see send_sorted_stream()). If the prefixes contain at least N
+ * records, the N-th record of the prefixes in the output order is a valid
+ * threshold: there are N records not after it, so no record after it can be
+ * printed. The threshold is broadcast and the slaves send only the records
+ * not after it. The master input thus drops from streams * N records towards
+ * N records.
+ *
+ * @{
+ */
+struct sort_stream {
+    int rank;  // rank of the source slave
+    int tag;   // tag of the stream
+    uint8_t *buff[2];  // two message buffers for IO/communication overlap
+    bool buff_idx;  // index of the buffer being consumed
+    MPI_Request request;  // receive into the other buffer
+    uint8_t *rec_ptr;  // next record in the consumed buffer
+    const uint8_t *msg_end;  // end of the consumed message
+    const uint8_t *rec;  // current record, NULL if the stream is finished
+    uint8_t scratch[XCHG_COMPACT_REC_LEN_MAX];  // for the decoded records
+};
+
+struct sort_merge {
+    size_t streams_cnt;
+    struct sort_stream *streams;
+    size_t *tree;  // loser tree, tree[0] is the winner (the smallest record)
+    size_t key_offset;  // offset of the sort key in the record
+    const struct sort_key *sort_key;  // sort key field and direction
+};
+
+
+/**
+ * @brief Return true if the current record of stream a precedes the current
+ *        record of stream b. Finished streams are after all records.
+ */
+static bool
+sort_merge_less(const struct sort_merge *const sm, const size_t a,
+                const size_t b)
+{
+    const uint8_t *const rec_a = sm->streams[a].rec;
+    const uint8_t *const rec_b = sm->streams[b].rec;
+    if (!rec_a || !rec_b) {
+        return rec_a != NULL || (!rec_b && a < b);
+    }
+
+    const int cmp = sort_key_cmp(sm->sort_key, rec_a + sm->key_offset,
+                                 rec_b + sm->key_offset);
+    return cmp < 0 || (cmp == 0 && a < b);  // ties are broken by stream index
+}
+
+/**
+ * @brief Move the stream to its next record, receive a next message if needed.
+ */
+static void
+sort_stream_next(struct sort_stream *const ss)
+{
+    assert(ss && ss->rec);
+
+    if (ss->rec_ptr == ss->msg_end) {  // the message is consumed
+        MPI_Status status;
+        MPI_Wait(&ss->request, &status);
+        int msg_size;
+        MPI_Get_count(&status, MPI_BYTE, &msg_size);
+        if (msg_size == 0) {  // empty message is a terminator
+            ss->rec = NULL;
+            return;
+        }
+
+        // consume the received buffer, receive into the consumed one
+        ss->buff_idx = !ss->buff_idx;
+        ss->rec_ptr = ss->buff[ss->buff_idx];
+        ss->msg_end = ss->rec_ptr + msg_size;
+        MPI_Irecv(ss->buff[!ss->buff_idx], XCHG_STREAM_BUFF_SIZE, MPI_BYTE,
+                  ss->rank, ss->tag, mpi_comm_main, &ss->request);
+    }
+
+    xchg_rec_size_t rec_size;
+    ss->rec = xchg_rec_get(&ss->rec_ptr, ss->scratch, &rec_size);
+    assert(rec_size == args->fields.all_sizes_sum);
+}
+
+/**
+ * @brief Compare two sort key values in the output order (for qsort()).
+ */
+static int
+sort_key_qsort_cmp(const void *const a, const void *const b)
+{
+    return sort_key_cmp(&args->fields.sort_key, a, b);
+}
+
+/**
+ * @brief Receive the prefixes of all streams, broadcast the threshold.
+ *
+ * The prefixes stay in the buffers and are merged as the beginning of the
+ * streams.
+ */
+static void
+sort_merge_prune(struct sort_merge *const sm)
+{
+    assert(sm);
+
+    const size_t key_size = args->fields.sort_key.field->size;
+    uint8_t *keys = NULL;
+    size_t keys_cnt = 0;
+    size_t keys_size = 0;  // allocated number of keys
+
+    for (size_t i = 0; i < sm->streams_cnt; ++i) {
+        struct sort_stream *const ss = sm->streams + i;
+
+        // the prefix is exactly one message, consume it as the first message
+        MPI_Status status;
+        MPI_Wait(&ss->request, &status);
+        int msg_size;
+        MPI_Get_count(&status, MPI_BYTE, &msg_size);
+        ss->buff_idx = 1;
+        ss->rec_ptr = ss->buff[1];
+        ss->msg_end = ss->rec_ptr + msg_size;
+        MPI_Irecv(ss->buff[0], XCHG_STREAM_BUFF_SIZE, MPI_BYTE, ss->rank,
+                  ss->tag, mpi_comm_main, &ss->request);
+
+        // collect the sort keys of the prefix
+        uint8_t *rec_ptr = ss->rec_ptr;
+        while (rec_ptr < ss->msg_end) {
+            xchg_rec_size_t rec_size;
+            const uint8_t *const rec = xchg_rec_get(&rec_ptr, ss->scratch,
+                                                    &rec_size);
+            if (keys_cnt == keys_size) {
+                keys_size = keys_size ? 2 * keys_size
+                                      : MIN(args->rec_limit,
+                                            SORT_PRUNE_KEYS_INIT);
+                keys = realloc(keys, keys_size * key_size);
+                ABORT_IF(!keys, E_MEM, "sort keys allocation failed");
+            }
+            memcpy(keys + keys_cnt++ * key_size, rec + sm->key_offset,
+                   key_size);
+        }
+    }
+
+    // the N-th key of the prefixes is the threshold
+    uint8_t threshold[SORT_PRUNE_THRESHOLD_SIZE] = { 0 };
+    if (keys_cnt >= args->rec_limit) {
+        qsort(keys, keys_cnt, key_size, sort_key_qsort_cmp);
+        threshold[0] = 1;  // the threshold is valid
+        memcpy(threshold + 1, keys + (args->rec_limit - 1) * key_size,
+               key_size);
+    }
+    free(keys);
+    DEBUG("sort pruning: %zu record(s) in the prefixes, threshold %s", keys_cnt,
+          threshold[0] ? "established" : "not established");
+
+    MPI_Bcast(threshold, sizeof (threshold), MPI_BYTE, ROOT_PROC,
+              mpi_comm_main);
+}
+
+/**
+ * @brief Build the loser tree bottom-up, return the winner of the subtree.
+ */
+static size_t
+sort_merge_build(struct sort_merge *const sm, const size_t node)
+{
+    if (node >= sm->streams_cnt) {  // leaf
+        return node - sm->streams_cnt;
+    }
+
+    const size_t left = sort_merge_build(sm, 2 * node);
+    const size_t right = sort_merge_build(sm, 2 * node + 1);
+    if (sort_merge_less(sm, left, right)) {
+        sm->tree[node] = right;
+        return left;
+    } else {
+        sm->tree[node] = left;
+        return right;
+    }
+}
+
+/**
+ * @brief Replay the matches of the winner's leaf after its stream moved.
+ */
+static void
+sort_merge_replay(struct sort_merge *const sm)
+{
+    size_t winner = sm->tree[0];
+    for (size_t node = (winner + sm->streams_cnt) / 2; node > 0; node /= 2) {
+        if (sort_merge_less(sm, sm->tree[node], winner)) {
+            const size_t loser = winner;
+            winner = sm->tree[node];
+            sm->tree[node] = loser;
+        }
+    }
+    sm->tree[0] = winner;
+}
+
+static void
+sort_merge_init(struct sort_merge *const sm,
+                const struct master_ctx *const m_ctx)
+{
+    assert(sm && m_ctx);
+
+    // find the sort key in the record
+    sm->sort_key = &args->fields.sort_key;
+    for (size_t i = 0; args->fields.all[i].id != sm->sort_key->field->id; ++i) {
+        assert(i + 1 < args->fields.all_cnt);
+        sm->key_offset += args->fields.all[i].size;
+    }
+
+    // start receiving from all streams, with the sample sort, each slave
+    // sends only one stream
+    sm->streams_cnt = args->use_sample_sort
+        ? m_ctx->slave_cnt : m_ctx->slave_threads_cnt;
+    sm->streams = calloc(sm->streams_cnt, sizeof (*sm->streams));
+    sm->tree = calloc(sm->streams_cnt, sizeof (*sm->tree));
+    ABORT_IF(!sm->streams || !sm->tree, E_MEM,
+             "sort merge context allocation failed");
+
+    size_t stream_idx = 0;
+    for (uint64_t rank = 1; rank <= m_ctx->slave_cnt; ++rank) {
+        const int threads_cnt =
+            args->use_sample_sort ? 1 : m_ctx->rank_threads_cnt[rank];
+        for (int thread = 0; thread < threads_cnt; ++thread) {
+            struct sort_stream *const ss = sm->streams + stream_idx++;
+            ss->rank = rank;
+            ss->tag = TAG_SORT_STREAM + thread;
+            for (size_t i = 0; i < 2; ++i) {
+                ss->buff[i] = malloc(XCHG_STREAM_BUFF_SIZE);
+                ABORT_IF(!ss->buff[i], E_MEM,
+                         "sort stream buffer allocation failed");
+            }
+            MPI_Irecv(ss->buff[!ss->buff_idx], XCHG_STREAM_BUFF_SIZE,
+                      MPI_BYTE, ss->rank, ss->tag, mpi_comm_main,
+                      &ss->request);
+            // pretend an empty message was consumed
+            ss->rec_ptr = ss->buff[ss->buff_idx];
+            ss->msg_end = ss->rec_ptr;
+            ss->rec = ss->rec_ptr;
+        }
+    }
+    assert(stream_idx == sm->streams_cnt);
+
+    if (args->use_sort_prune) {
+        sort_merge_prune(sm);
+    }
+
+    // fetch the first record of each stream and build the tree
+    for (size_t i = 0; i < sm->streams_cnt; ++i) {
+        sort_stream_next(sm->streams + i);
+    }
+    sm->tree[0] = sort_merge_build(sm, 1);
+}
+
+static void
+sort_merge_free(struct sort_merge *const sm)
+{
+    assert(sm);
+
+    for (size_t i = 0; i < sm->streams_cnt; ++i) {
+        assert(!sm->streams[i].rec);  // all streams have to be finished
+        free(sm->streams[i].buff[0]);
+        free(sm->streams[i].buff[1]);
+    }
+    free(sm->tree);
+    free(sm->streams);
+}
+
+/**
+ * @brief Merge the sorted streams of all slave threads, print the records.
  */
 static void
 sort_main(struct master_ctx *const m_ctx)
 {
     assert(m_ctx);
 
-    // initialize the libnf sorting memory and set its parameters
-    lnf_mem_t *lnf_mem;
-    libnf_mem_init_list(&lnf_mem, &args->fields);
+    struct sort_merge sm = { 0 };
+    sort_merge_init(&sm, m_ctx);
+
+    print_stream_names();
+    uint64_t rec_cntr = 0;
+    struct sort_stream *winner;
+    while ((winner = sm.streams + sm.tree[0])->rec) {
+        if (!args->rec_limit || rec_cntr < args->rec_limit) {
+            print_stream_next(winner->rec);
+            rec_cntr++;
+        }  // else only drain the streams
+        sort_stream_next(winner);
+        sort_merge_replay(&sm);
+    }
+    DEBUG("sort merge: printed %" PRIu64 " record(s) from %zu stream(s)",
+          rec_cntr, sm.streams_cnt);
 
-    // fill the libnf linked list memory with records received from the slaves
-    recv_loop(m_ctx, m_ctx->slave_threads_cnt, 0, TAG_SORT,
-              mem_write_raw_callback, lnf_mem);
+    sort_merge_free(&sm);
+}
+/**
+ * @}
+ */  // master_sort_merge
 
-    // sort record in the libnf memory (not needed)
-    DEBUG("sorting records in master's libnf memory...");
-    libnf_mem_sort(lnf_mem);
-    DEBUG("sorting records in master's libnf memory done");
+/**
+ * @brief Number of sources of the aggregation stream.
+ *
+ * Each slave sends one stream of its merged hash table. In the tree mode,
+ * only the children of the master send.
+ */
+static uint64_t
+aggr_source_cnt(const struct master_ctx *const m_ctx)
+{
+    return args->tree_fanin
+        ? xchg_tree_children_cnt(ROOT_PROC, args->tree_fanin,
+                                 m_ctx->slave_cnt + 1)
+        : m_ctx->slave_cnt;
+}
 
-    // print all records in the libnf linked list memory
-    print_batch(lnf_mem, args->rec_limit);
-    libnf_mem_free(lnf_mem);
+/**
+ * @brief Sort the libnf memories in parallel before they are printed.
+ *
+ * libnf sorts a memory single-threaded on the first access by a cursor.
+ * print_batch_merge() would access the memories one after another, so each
+ * memory is sorted by its own thread in advance and printing then only merges
+ * the sorted memories. Memories without a sort key are left untouched.
+ *
+ * @param[in] lnf_mems Array of the libnf memories.
+ * @param[in] lnf_mems_cnt Number of the libnf memories.
+ * @param[in] threads_cnt Maximal number of the sorting threads.
+ */
+static void
+sort_mems_parallel(lnf_mem_t *const lnf_mems[], const size_t lnf_mems_cnt,
+                   const int threads_cnt)
+{
+    assert(lnf_mems && threads_cnt > 0);
+
+    if (!args->fields.sort_key.field || lnf_mems_cnt < 2) {
+        return;  // nothing to sort or nothing to parallelize
+    }
+
+    DEBUG("sorting %zu memories using %d thread(s)...", lnf_mems_cnt,
+          threads_cnt);
+    #pragma omp parallel for num_threads(threads_cnt) schedule(dynamic, 1)
+    for (size_t i = 0; i < lnf_mems_cnt; ++i) {
+        libnf_mem_sort(lnf_mems[i]);
+    }
+    DEBUG("sorting memories done");
+}
+
+/**
+ * @brief Receive and aggregate records using the partitioned merge, print
+ *        them.
+ *
+ * See @ref master_merge.
+ */
+static void
+aggr_merge_parallel(struct master_ctx *const m_ctx)
+{
+    assert(m_ctx && m_ctx->merge_threads_cnt > 1);
+
+    struct merge_ctx merge;
+    merge_ctx_init(&merge, m_ctx->merge_threads_cnt);
+    DEBUG("merging received records in %zu partitions", merge.parts_cnt);
+
+    xchg_recv_loop(aggr_source_cnt(m_ctx), 0, TAG_AGGR, merge_stage_callback,
+                   &merge);
+    merge_flush(&merge);
+    if (top_n_enabled()) {
+        // only the first rec_limit records of each partition can be printed
+        #pragma omp parallel for num_threads(merge.parts_cnt) schedule(static, 1)
+        for (size_t i = 0; i < merge.parts_cnt; ++i) {
+            mem_top_n(merge.lnf_mems + i);
+        }
+    }
+    sort_mems_parallel(merge.lnf_mems, merge.parts_cnt, merge.parts_cnt);
+
+    // print all records from the partitions merged on the sort key
+    print_batch_merge(merge.lnf_mems, merge.parts_cnt, args->rec_limit);
+
+    merge_ctx_free(&merge);
+}
+
+// context of the memory-bounded receive-side aggregation
+struct spill_recv_ctx {
+    lnf_mem_t *lnf_mem;  // the libnf hash table memory, may be replaced
+    struct spill *spill;  // its spill
+};
+
+static error_code_t
+spill_recv_callback(uint8_t *data, xchg_rec_size_t data_len, void *user)
+{
+    struct spill_recv_ctx *const sr_ctx = user;
+
+    const error_code_t ecode = xchg_mem_write_raw_callback(data, data_len,
+                                                           sr_ctx->lnf_mem);
+    if (ecode == E_OK) {
+        spill_account(sr_ctx->spill, &sr_ctx->lnf_mem);
+    }
+    return ecode;
+}
+
+// context of the final merge of the spilled runs
+struct spill_merge_ctx {
+    struct spill *spill;
+    lnf_mem_t *lnf_mems[SPILL_PARTS_CNT];  // current chunk of each run
+    uint64_t chunk_recs;  // maximum number of records in a chunk
+};
+
+/**
+ * @brief Replace the exhausted chunk of the run by its next chunk.
+ */
+static bool
+spill_refill_callback(size_t idx, void *user)
+{
+    struct spill_merge_ctx *const sm_ctx = user;
+
+    libnf_mem_free(sm_ctx->lnf_mems[idx]);
+    libnf_mem_init_ht(&sm_ctx->lnf_mems[idx], &args->fields);
+    return spill_load_chunk(sm_ctx->spill, idx, sm_ctx->lnf_mems[idx],
+                            sm_ctx->chunk_recs) > 0;
+}
+
+/**
+ * @brief Receive and aggregate records within the memory budget, print them.
+ *
+ * If the received records do not fit into the budget, the hash table is
+ * spilled to disk and the partitions are aggregated one at a time (see
+ * spill.c). Each aggregated (and sorted) partition is stored back as a run,
+ * only its first rec_limit records with a record limit, as partitions have
+ * disjoint keys. The runs are then read in chunks and merged on the sort key
+ * while printing, so only one partition or one chunk of each run is in the
+ * memory at a time.
+ */
+static void
+aggr_spill(struct master_ctx *const m_ctx)
+{
+    assert(m_ctx && args->mem_budget);
+
+    struct spill_recv_ctx sr_ctx = {
+        .spill = spill_init(args->spill_dir, &args->fields, args->mem_budget),
+    };
+    if (top_n_enabled()) {
+        libnf_mem_init_ht_unsorted(&sr_ctx.lnf_mem, &args->fields);
+    } else {
+        libnf_mem_init_ht(&sr_ctx.lnf_mem, &args->fields);
+    }
+
+    xchg_recv_loop(aggr_source_cnt(m_ctx), 0, TAG_AGGR, spill_recv_callback,
+                   &sr_ctx);
+
+    if (!spill_used(sr_ctx.spill)) {  // everything fits into the memory
+        if (top_n_enabled()) {
+            mem_top_n(&sr_ctx.lnf_mem);
+        }
+        print_batch(sr_ctx.lnf_mem, args->rec_limit);
+        libnf_mem_free(sr_ctx.lnf_mem);
+        spill_free(sr_ctx.spill);
+        return;
+    }
+
+    spill_mem(sr_ctx.spill, sr_ctx.lnf_mem);
+    libnf_mem_free(sr_ctx.lnf_mem);
+
+    // aggregate the partitions one by one, replace each of them by its run
+    for (size_t part = 0; part < SPILL_PARTS_CNT; ++part) {
+        lnf_mem_t *part_mem;
+        if (top_n_enabled()) {
+            // keep only the first rec_limit records, selected without sorting
+            libnf_mem_init_ht_unsorted(&part_mem, &args->fields);
+            spill_load_part(sr_ctx.spill, part, part_mem);
+            mem_top_n(&part_mem);
+        } else {
+            libnf_mem_init_ht(&part_mem, &args->fields);
+            spill_load_part(sr_ctx.spill, part, part_mem);
+        }
+        spill_store_part(sr_ctx.spill, part, part_mem, args->rec_limit);
+        libnf_mem_free(part_mem);
+    }
+
+    // merge the runs on the sort key, read them chunk by chunk
+    struct spill_merge_ctx sm_ctx = {
+        .spill = sr_ctx.spill,
+        .chunk_recs = spill_chunk_recs(sr_ctx.spill),
+    };
+    DEBUG("spill: merging %d runs in chunks of %" PRIu64 " record(s)",
+          SPILL_PARTS_CNT, sm_ctx.chunk_recs);
+    for (size_t part = 0; part < SPILL_PARTS_CNT; ++part) {
+        libnf_mem_init_ht(&sm_ctx.lnf_mems[part], &args->fields);
+        spill_load_chunk(sm_ctx.spill, part, sm_ctx.lnf_mems[part],
+                         sm_ctx.chunk_recs);
+    }
+    sort_mems_parallel(sm_ctx.lnf_mems, SPILL_PARTS_CNT,
+                       m_ctx->merge_threads_cnt);
+    print_batch_merge_refill(sm_ctx.lnf_mems, SPILL_PARTS_CNT, args->rec_limit,
+                             spill_refill_callback, &sm_ctx);
+
+    for (size_t part = 0; part < SPILL_PARTS_CNT; ++part) {
+        libnf_mem_free(sm_ctx.lnf_mems[part]);
+    }
+    spill_free(sr_ctx.spill);
 }
 
 /**
@@ -667,9 +1387,27 @@ aggr_main(struct master_ctx *const m_ctx)
 {
     assert(m_ctx);
 
-    // initialize aggregation memory and set its parameters
+    if (args->mem_budget) {
+        // bound the memory of the receive-side hash table
+        aggr_spill(m_ctx);
+        return;
+    }
+
+    if (!args->use_tput && m_ctx->merge_threads_cnt > 1) {
+        // use multiple threads to merge the received records
+        aggr_merge_parallel(m_ctx);
+        return;
+    }
+
+    // initialize aggregation memory and set its parameters, TPUT needs the
+    // sorted memory
+    const bool top_n = !args->use_tput && top_n_enabled();
     lnf_mem_t *lnf_mem;
-    libnf_mem_init_ht(&lnf_mem, &args->fields);
+    if (top_n) {
+        libnf_mem_init_ht_unsorted(&lnf_mem, &args->fields);
+    } else {
+        libnf_mem_init_ht(&lnf_mem, &args->fields);
+    }
 
     if (args->use_tput) {
         // use the TPUT Top-N algorithm
@@ -677,9 +1415,13 @@ aggr_main(struct master_ctx *const m_ctx)
         tput_phase_2(m_ctx, &lnf_mem, phase_1_bottom);
         tput_phase_3(m_ctx, &lnf_mem);
     } else {
-        // fill the libnf hash table memory with records received from the slaves
-        recv_loop(m_ctx, m_ctx->slave_threads_cnt, 0, TAG_AGGR,
-                  mem_write_raw_callback, lnf_mem);
+        // fill the libnf hash table memory with records received from the
+        // slaves
+        xchg_recv_loop(aggr_source_cnt(m_ctx), 0, TAG_AGGR,
+                       xchg_mem_write_raw_callback, lnf_mem);
+    }
+    if (top_n) {
+        mem_top_n(&lnf_mem);
     }
 
     // print all records the lnf hash table memory
@@ -692,27 +1434,47 @@ aggr_main(struct master_ctx *const m_ctx)
  * @brief TODO
  */
 static void
-master_main_thread(void)
+master_main_thread(const int merge_threads_cnt)
 {
     DEBUG("launching master's main thread");
 
-    // get a sum of number of threads used on all slaves
-    int slave_threads_cnt = 0;
-    MPI_Reduce(MPI_IN_PLACE, &slave_threads_cnt, 1, MPI_INT, MPI_SUM, ROOT_PROC,
-               mpi_comm_main);
-    assert(slave_threads_cnt > 0);
+    // get a number of slaves
+    int world_size;
+    MPI_Comm_size(mpi_comm_main, &world_size);
+    assert(world_size > 1);
+
+    // get a number of threads used on each slave
+    int *const rank_threads_cnt = calloc(world_size,
+                                         sizeof (*rank_threads_cnt));
+    ABORT_IF(!rank_threads_cnt, E_MEM, "thread counts allocation failed");
+    const int master_threads_cnt = 0;  // master does not send any streams
+    MPI_Gather(&master_threads_cnt, 1, MPI_INT, rank_threads_cnt, 1, MPI_INT,
+               ROOT_PROC, mpi_comm_main);
+    if (args->use_xchg_shm) {
+        xchg_shm_init(0);  // the master only reads the slots of the slaves
+    }
 
     // initialize a master_ctx structure
     struct master_ctx *const m_ctx =
-        master_ctx_init((uint64_t)slave_threads_cnt);
-    DEBUG("using %d slave thread(s) in total", m_ctx->slave_threads_cnt);
+        master_ctx_init(rank_threads_cnt, (uint64_t)world_size - 1,
+                        merge_threads_cnt);
+    DEBUG("using %" PRIu64 " slave thread(s) on %" PRIu64 " slave(s) in total",
+          m_ctx->slave_threads_cnt, m_ctx->slave_cnt);
 
     output_init(args->output_params, &args->fields);
 
     // send, receive, process according to the specified working mode
     switch (args->working_mode) {
     case MODE_LIST:
-        list_main(m_ctx);
+        if (args->passthrough_path) {
+            passthrough_main(m_ctx);
+        } else if (args->output_dir) {
+            shard_main(m_ctx);
+        } else if (args->time_order_window) {
+            sort_main(m_ctx);  // merge the time-ordered streams
+        } else {
+            list_main(m_ctx);
+        }
         break;
     case MODE_SORT:
         sort_main(m_ctx);
@@ -753,26 +1515,50 @@ master_main(const struct cmdline_args *args_local)
 
     double duration = -MPI_Wtime();  // start the time measurement
     args = args_local;  // share the command-line arguments by a global variable
-
-    // spawn one thread for each section -- sections are not used, because
-    // master's main thread should run as an OpenMP master thread
-    #pragma omp parallel num_threads(2)
-    {
-        // master's main thread
-        #pragma omp master
+    xchg_set_buff_size(args->xchg_buff_size);
+    xchg_set_credits(args->xchg_credits);
+
+    // the number of threads for the partitioned merge is given by nthreads-var
+    // (--num-threads or OMP_NUM_THREADS), the merge threads are nested in the
+    // master's main thread
+    const int merge_threads_cnt = omp_get_max_threads();
+    omp_set_max_active_levels(2);
+
+    int thread_provided;
+    MPI_Query_thread(&thread_provided);
+    if (thread_provided != MPI_THREAD_MULTIPLE) {
+        // only this thread may call MPI (allowed with --comm-thread), the
+        // progress reports (empty messages) are received after the query
+        assert(args->use_comm_thread);
+        struct progress_bar_ctx pb_ctx;
+        progress_bar_init(&pb_ctx, args->progress_bar_type,
+                          args->progress_bar_dest);
+        master_main_thread(merge_threads_cnt);
+        progress_bar_recv(&pb_ctx);
+        progress_bar_free(&pb_ctx);
+    } else {
+        // spawn one thread for each section -- sections are not used, because
+        // master's main thread should run as an OpenMP master thread
+        #pragma omp parallel num_threads(2)
         {
-            assert(mpi_comm_main != MPI_COMM_NULL);
-            master_main_thread();
-        }
+            // master's main thread
+            #pragma omp master
+            {
+                assert(mpi_comm_main != MPI_COMM_NULL);
+                master_main_thread(merge_threads_cnt);
+            }
 
-        // progress bar handling thread
-        #pragma omp single
-        {
-            assert(mpi_comm_progress != MPI_COMM_NULL);
-            progress_bar_thread(args->progress_bar_type,
-                                args->progress_bar_dest);
+            // progress bar handling thread
+            #pragma omp single
+            {
+                assert(mpi_comm_progress != MPI_COMM_NULL);
+                progress_bar_thread(args->progress_bar_type,
+                                    args->progress_bar_dest);
+            }
         }
     }
+    xchg_credits_finish();
+    xchg_shm_free();
 
     // reduce statistic values from each slave
     struct processed_summ processed_summ = { 0 };  // processed data statistics
@@ -0,0 +1,501 @@
+/**
+ * @brief Block-level reading and writing of the nfdump files (passthrough).
+ *
+ * Unfiltered exports of whole records do not need the records to be decoded.
+ * The slaves read the nfdump files block by block and forward the data blocks
+ * unchanged (still compressed), the master writes them into one nfdump file.
+ * Only the file layout version 1 (nfdump 1.6) is supported. All blocks of such
+ * a file are compressed by the method given by the file header flags, so the
+ * input files have to use the same compression.
+ *
+ * The blocks are exchanged as records of the usual prefixed messages, each
+ * record starts with struct nfblock_rec_hdr: its kind (NFBLOCK_REC_FILE or
+ * NFBLOCK_REC_BLOCK), the identifier of its input file and the index of the
+ * block in the file. The messages of all slave threads are interleaved and
+ * received out of order, but extension maps are stored in the data blocks and
+ * referenced by later records of the same file. Therefore, the output keeps
+ * each input file contiguous and in the block order: the master writes one
+ * input file at a time and buffers the blocks of the other files (and the
+ * early blocks of the current file) in anonymous temporary files. The file
+ * record is sent after the last block and carries the number of blocks, so
+ * the master knows when the current file is complete.
+ */
+
+/*
+ * Copyright 2015-2018 CESNET
+ *
+ * This file is part of Fdistdump.
+ *
+ * Fdistdump is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Fdistdump is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Fdistdump.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nfblock.h"
+
+#include <assert.h>             // for assert
+#include <errno.h>              // for errno
+#include <stdlib.h>             // for free, malloc, realloc
+#include <string.h>             // for memcpy, memmove, memset, strerror
+
+#include "common.h"             // for error_code_t
+#include "errwarn.h"            // for error/warning/info/debug messages, ...
+
+
+// compression flags of the file header (LZO, BZ2, LZ4, ZSTD)
+#define NFBLOCK_FLAGS_COMPRESSION (0x01 | 0x08 | 0x10 | 0x20)
+
+
+_Static_assert(sizeof (struct nfblock_file_hdr) == 140,
+               "unexpected size of the nfdump file header");
+_Static_assert(sizeof (struct nfblock_stat) == 136,
+               "unexpected size of the nfdump statistics record");
+_Static_assert(sizeof (struct nfblock_hdr) == 12,
+               "unexpected size of the nfdump block header");
+_Static_assert(sizeof (struct nfblock_rec_hdr) == 16,
+               "unexpected size of the passthrough record header");
+
+
+/*
+ * Data types declarations.
+ */
+// location of a block buffered in the temporary file of its part
+struct nfblock_buffered {
+    long offset;
+    size_t size;  // size of the block header and the block data
+    bool present;
+};
+
+// input file being reassembled
+struct nfblock_part {
+    uint64_t file_id;
+    bool complete;  // the file record was received
+    uint32_t blocks_cnt;  // number of blocks of the file, if complete
+    uint32_t next_seq;  // index of the next block to write
+    FILE *buffer;  // blocks received before they can be written, lazily
+    struct nfblock_buffered *buffered;  // indexed by the block index
+    size_t buffered_size;
+};
+
+
+/*
+ * Static functions.
+ */
+/**
+ * @brief Add the statistics of one file to the statistics of the output.
+ */
+static void
+stat_add(struct nfblock_stat *const sum, const struct nfblock_stat *const st,
+         const bool first)
+{
+    sum->flows += st->flows;
+    sum->bytes += st->bytes;
+    sum->pkts += st->pkts;
+    for (size_t i = 0; i < 4; ++i) {
+        sum->proto_flows[i] += st->proto_flows[i];
+        sum->proto_bytes[i] += st->proto_bytes[i];
+        sum->proto_pkts[i] += st->proto_pkts[i];
+    }
+    sum->sequence_failure += st->sequence_failure;
+
+    if (first || st->first_seen < sum->first_seen
+            || (st->first_seen == sum->first_seen
+                && st->msec_first < sum->msec_first)) {
+        sum->first_seen = st->first_seen;
+        sum->msec_first = st->msec_first;
+    }
+    if (first || st->last_seen > sum->last_seen
+            || (st->last_seen == sum->last_seen
+                && st->msec_last > sum->msec_last)) {
+        sum->last_seen = st->last_seen;
+        sum->msec_last = st->msec_last;
+    }
+}
+
+/**
+ * @brief Write the header and the statistics at the beginning of the output.
+ */
+static void
+out_write_head(struct nfblock_out *const out)
+{
+    ABORT_IF(fseek(out->file, 0, SEEK_SET) != 0
+             || fwrite(&out->hdr, sizeof (out->hdr), 1, out->file) != 1
+             || fwrite(&out->stat, sizeof (out->stat), 1, out->file) != 1,
+             E_INTERNAL, "`%s': write failed: %s", out->path, strerror(errno));
+}
+
+/**
+ * @brief Append the block (its header and data) to the output.
+ */
+static void
+out_write_block(struct nfblock_out *const out, const uint8_t *const block,
+                const size_t size)
+{
+    struct nfblock_hdr bh;
+    memcpy(&bh, block, sizeof (bh));
+
+    ABORT_IF(fwrite(block, size, 1, out->file) != 1, E_INTERNAL,
+             "`%s': write failed: %s", out->path, strerror(errno));
+    out->hdr.blocks_cnt++;
+    out->rec_cnt += bh.rec_cnt;
+}
+
+/**
+ * @brief Return the part of the input file, create it if it does not exist.
+ */
+static struct nfblock_part *
+out_part(struct nfblock_out *const out, const uint64_t file_id)
+{
+    // only a few files are in flight at a time, one per slave thread
+    for (size_t i = 0; i < out->parts_cnt; ++i) {
+        if (out->parts[i].file_id == file_id) {
+            return out->parts + i;
+        }
+    }
+
+    if (out->parts_cnt == out->parts_size) {
+        out->parts_size = out->parts_size ? out->parts_size * 2 : 16;
+        out->parts = realloc(out->parts,
+                             out->parts_size * sizeof (*out->parts));
+        ABORT_IF(!out->parts, E_MEM, "passthrough parts allocation failed");
+    }
+    struct nfblock_part *const part = out->parts + out->parts_cnt++;
+    *part = (struct nfblock_part){ .file_id = file_id };
+    return part;
+}
+
+/**
+ * @brief Buffer the block until the preceding blocks of its file are written.
+ */
+static void
+part_buffer(struct nfblock_part *const part, const uint32_t seq,
+            const uint8_t *const block, const size_t size)
+{
+    if (!part->buffer) {
+        part->buffer = tmpfile();
+        ABORT_IF(!part->buffer, E_INTERNAL,
+                 "passthrough: cannot create a temporary file: %s",
+                 strerror(errno));
+    }
+
+    if (seq >= part->buffered_size) {
+        const size_t old_size = part->buffered_size;
+        part->buffered_size = MAX((size_t)seq + 1, old_size * 2);
+        part->buffered = realloc(part->buffered, part->buffered_size
+                                 * sizeof (*part->buffered));
+        ABORT_IF(!part->buffered, E_MEM,
+                 "passthrough buffer index allocation failed");
+        memset(part->buffered + old_size, 0,
+               (part->buffered_size - old_size) * sizeof (*part->buffered));
+    }
+    ABORT_IF(part->buffered[seq].present || seq < part->next_seq, E_INTERNAL,
+             "passthrough: duplicate block %" PRIu32, seq);
+
+    ABORT_IF(fseek(part->buffer, 0, SEEK_END) != 0, E_INTERNAL,
+             "passthrough: temporary file seek failed: %s", strerror(errno));
+    part->buffered[seq] = (struct nfblock_buffered){
+        .offset = ftell(part->buffer),
+        .size = size,
+        .present = true,
+    };
+    ABORT_IF(part->buffered[seq].offset < 0
+             || fwrite(block, size, 1, part->buffer) != 1, E_INTERNAL,
+             "passthrough: temporary file write failed: %s", strerror(errno));
+}
+
+/**
+ * @brief Write the consecutive buffered blocks of the current part.
+ */
+static void
+part_drain(struct nfblock_out *const out, struct nfblock_part *const part)
+{
+    while (part->next_seq < part->buffered_size
+           && part->buffered[part->next_seq].present) {
+        const struct nfblock_buffered *const b =
+            part->buffered + part->next_seq;
+
+        if (b->size > out->copy_buff_size) {
+            free(out->copy_buff);
+            out->copy_buff_size = b->size;
+            out->copy_buff = malloc(out->copy_buff_size);
+            ABORT_IF(!out->copy_buff, E_MEM,
+                     "passthrough copy buffer allocation failed");
+        }
+        ABORT_IF(fseek(part->buffer, b->offset, SEEK_SET) != 0
+                 || fread(out->copy_buff, b->size, 1, part->buffer) != 1,
+                 E_INTERNAL, "passthrough: temporary file read failed");
+
+        out_write_block(out, out->copy_buff, b->size);
+        part->next_seq++;
+    }
+}
+
+/**
+ * @brief Write everything that can be written, in the order of the parts.
+ *
+ * The first part is the current input file. Once it is complete and all its
+ * blocks are written, it is removed and the next part becomes current.
+ */
+static void
+out_advance(struct nfblock_out *const out)
+{
+    while (out->parts_cnt > 0) {
+        struct nfblock_part *const part = out->parts;
+        part_drain(out, part);
+        if (!part->complete || part->next_seq != part->blocks_cnt) {
+            return;  // wait for more blocks of the current file
+        }
+
+        if (part->buffer) {
+            fclose(part->buffer);
+        }
+        free(part->buffered);
+        memmove(out->parts, out->parts + 1,
+                --out->parts_cnt * sizeof (*out->parts));
+    }
+}
+
+
+/*
+ * Public functions.
+ */
+/**
+ * @brief Open the nfdump file and read its header and statistics.
+ *
+ * @param[out] nf The file to initialize.
+ * @param[in] path Path to the file.
+ *
+ * @return True on success, false (and a warning) if the file cannot be read
+ *         or its layout is not supported.
+ */
+bool
+nfblock_open(struct nfblock_file *const nf, const char *const path)
+{
+    assert(nf && path);
+
+    *nf = (struct nfblock_file){ .path = path };
+    nf->file = fopen(path, "rb");
+    if (!nf->file) {
+        WARNING(E_INTERNAL, "`%s': unable to open the flow file: %s", path,
+                strerror(errno));
+        return false;
+    }
+
+    if (fread(&nf->hdr, sizeof (nf->hdr), 1, nf->file) != 1
+            || nf->hdr.magic != NFBLOCK_MAGIC) {
+        WARNING(E_INTERNAL, "`%s': not an nfdump file", path);
+    } else if (nf->hdr.version != NFBLOCK_LAYOUT_VERSION) {
+        WARNING(E_INTERNAL, "`%s': unsupported nfdump file layout version %"
+                PRIu16, path, nf->hdr.version);
+    } else if (fread(&nf->stat, sizeof (nf->stat), 1, nf->file) != 1) {
+        WARNING(E_INTERNAL, "`%s': truncated nfdump file", path);
+    } else {
+        return true;
+    }
+
+    fclose(nf->file);
+    nf->file = NULL;
+    return false;
+}
+
+/**
+ * @brief Read the header of the next block.
+ *
+ * @param[in,out] nf The file.
+ * @param[out] bh Header of the block.
+ *
+ * @return True on success, false at the end of the file or on error (with a
+ *         warning).
+ */
+bool
+nfblock_read_hdr(struct nfblock_file *const nf, struct nfblock_hdr *const bh)
+{
+    assert(nf && nf->file && bh);
+
+    const size_t read = fread(bh, 1, sizeof (*bh), nf->file);
+    if (read == sizeof (*bh)) {
+        return true;
+    }
+    if (ferror(nf->file)) {
+        WARNING(E_INTERNAL, "`%s': read failed: %s", nf->path,
+                strerror(errno));
+    } else if (read != 0) {
+        WARNING(E_INTERNAL, "`%s': truncated block header", nf->path);
+    }
+    return false;  // the end of the file
+}
+
+/**
+ * @brief Read the data of the block whose header was just read.
+ *
+ * @param[in,out] nf The file.
+ * @param[out] data Buffer of at least size bytes, or NULL to skip the data.
+ * @param[in] size Size of the block data (from its header).
+ *
+ * @return True on success, false on error (with a warning).
+ */
+bool
+nfblock_read_data(struct nfblock_file *const nf, uint8_t *const data,
+                  const size_t size)
+{
+    assert(nf && nf->file);
+
+    const bool ok = data ? fread(data, 1, size, nf->file) == size
+        : fseek(nf->file, size, SEEK_CUR) == 0;
+    if (!ok) {
+        WARNING(E_INTERNAL, "`%s': truncated data block", nf->path);
+    }
+    return ok;
+}
+
+/**
+ * @brief Close the nfdump file.
+ *
+ * @param[in,out] nf The file.
+ */
+void
+nfblock_close(struct nfblock_file *const nf)
+{
+    assert(nf);
+
+    if (nf->file) {
+        fclose(nf->file);
+        nf->file = NULL;
+    }
+}
+
+/**
+ * @brief Create the output nfdump file.
+ *
+ * The header and the statistics are written by nfblock_out_close(), when
+ * they are known.
+ *
+ * @param[out] out The output to initialize.
+ * @param[in] path Path to the output file, an existing file is overwritten.
+ */
+void
+nfblock_out_open(struct nfblock_out *const out, const char *const path)
+{
+    assert(out && path);
+
+    *out = (struct nfblock_out){ .path = path };
+    out->file = fopen(path, "wb");
+    ABORT_IF(!out->file, E_ARG, "`%s': unable to create the output file: %s",
+             path, strerror(errno));
+
+    // reserve the space for the header and the statistics
+    out_write_head(out);
+}
+
+/**
+ * @brief Write the passthrough record into the output.
+ *
+ * A file record is merged into the header and the statistics, a block record
+ * is appended to the output once all preceding blocks of its file are
+ * written and its file is the current one, it is buffered until then.
+ *
+ * @param[in,out] out The output.
+ * @param[in] rec The record (starting with struct nfblock_rec_hdr).
+ * @param[in] rec_len Length of the record.
+ */
+void
+nfblock_out_rec(struct nfblock_out *const out, const uint8_t *const rec,
+                const size_t rec_len)
+{
+    assert(out && out->file && rec);
+
+    struct nfblock_rec_hdr rh;
+    ABORT_IF(rec_len < sizeof (rh), E_INTERNAL, "invalid passthrough record");
+    memcpy(&rh, rec, sizeof (rh));
+    const uint8_t *const payload = rec + sizeof (rh);
+    const size_t payload_len = rec_len - sizeof (rh);
+
+    struct nfblock_part *const part = out_part(out, rh.file_id);
+    switch (rh.kind) {
+    case NFBLOCK_REC_FILE:
+    {
+        struct nfblock_file_hdr hdr;
+        struct nfblock_stat stat;
+        ABORT_IF(payload_len != sizeof (hdr) + sizeof (stat) || part->complete,
+                 E_INTERNAL, "invalid passthrough file record");
+        memcpy(&hdr, payload, sizeof (hdr));
+        memcpy(&stat, payload + sizeof (hdr), sizeof (stat));
+
+        if (out->files_cnt == 0) {
+            out->hdr = hdr;
+            out->hdr.blocks_cnt = 0;
+        } else {
+            ABORT_IF((hdr.flags & NFBLOCK_FLAGS_COMPRESSION)
+                     != (out->hdr.flags & NFBLOCK_FLAGS_COMPRESSION), E_ARG,
+                     "passthrough: the input files use different compression");
+        }
+        stat_add(&out->stat, &stat, out->files_cnt == 0);
+        out->files_cnt++;
+
+        part->complete = true;
+        part->blocks_cnt = rh.seq;
+        break;
+    }
+
+    case NFBLOCK_REC_BLOCK:
+    {
+        struct nfblock_hdr bh;
+        ABORT_IF(payload_len < sizeof (bh), E_INTERNAL,
+                 "invalid passthrough block record");
+        memcpy(&bh, payload, sizeof (bh));
+        ABORT_IF(payload_len != sizeof (bh) + (size_t)bh.size, E_INTERNAL,
+                 "invalid passthrough block record");
+
+        if (part == out->parts && rh.seq == part->next_seq) {
+            // the next block of the current file, no buffering needed
+            out_write_block(out, payload, payload_len);
+            part->next_seq++;
+        } else {
+            part_buffer(part, rh.seq, payload, payload_len);
+        }
+        break;
+    }
+
+    default:
+        ABORT(E_INTERNAL, "unknown passthrough record kind %" PRIu32, rh.kind);
+    }
+
+    out_advance(out);
+}
+
+/**
+ * @brief Write the header and the statistics and close the output.
+ *
+ * @param[in,out] out The output.
+ */
+void
+nfblock_out_close(struct nfblock_out *const out)
+{
+    assert(out && out->file);
+
+    ABORT_IF(out->parts_cnt != 0, E_INTERNAL,
+             "passthrough: %zu input file(s) were not received completely",
+             out->parts_cnt);
+    free(out->parts);
+    free(out->copy_buff);
+
+    out->hdr.magic = NFBLOCK_MAGIC;
+    out->hdr.version = NFBLOCK_LAYOUT_VERSION;
+    out_write_head(out);
+    ABORT_IF(fclose(out->file) != 0, E_INTERNAL, "`%s': write failed: %s",
+             out->path, strerror(errno));
+    out->file = NULL;
+
+    DEBUG("passthrough: wrote %" PRIu32 " block(s) with %" PRIu64
+          " record(s) of %" PRIu64 " file(s) into `%s'", out->hdr.blocks_cnt,
+          out->rec_cnt, out->files_cnt, out->path);
+}
@@ -0,0 +1,131 @@
+/**
+ * @brief Block-level reading and writing of the nfdump files (passthrough).
+ */
+
+/*
+ * Copyright 2015-2018 CESNET
+ *
+ * This file is part of Fdistdump.
+ *
+ * Fdistdump is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Fdistdump is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Fdistdump.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <inttypes.h>           // for fixed-width integer types
+#include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
+#include <stdio.h>              // for FILE
+
+
+#define NFBLOCK_MAGIC 0xA50C  // magic number of the nfdump file
+#define NFBLOCK_LAYOUT_VERSION 1  // the only supported file layout
+#define NFBLOCK_TYPE_DATA 2  // data block of flow records (DATA_BLOCK_TYPE_2)
+#define NFBLOCK_IDENT_LEN 128
+
+// kind of a passthrough record (see struct nfblock_rec_hdr)
+enum {
+    NFBLOCK_REC_FILE = 1,  // file header and statistics of one file
+    NFBLOCK_REC_BLOCK,  // block header and data of one data block
+};
+
+
+// header of the nfdump file (file_header_t of nfdump)
+struct nfblock_file_hdr {
+    uint16_t magic;
+    uint16_t version;
+    uint32_t flags;  // compression etc., the same for all blocks of a file
+    uint32_t blocks_cnt;
+    char ident[NFBLOCK_IDENT_LEN];
+};
+
+// statistics of the nfdump file (stat_record_t of nfdump)
+struct nfblock_stat {
+    uint64_t flows;
+    uint64_t bytes;
+    uint64_t pkts;
+    uint64_t proto_flows[4];  // TCP, UDP, ICMP, other
+    uint64_t proto_bytes[4];
+    uint64_t proto_pkts[4];
+    uint32_t first_seen;
+    uint32_t last_seen;
+    uint16_t msec_first;
+    uint16_t msec_last;
+    uint32_t sequence_failure;
+};
+
+// header of a block (data_block_header_t of nfdump)
+struct nfblock_hdr {
+    uint32_t rec_cnt;
+    uint32_t size;  // size of the block data following the header
+    uint16_t type;
+    uint16_t flags;
+};
+
+// header of a passthrough record, followed by the payload of its kind
+struct nfblock_rec_hdr {
+    uint32_t kind;
+    uint32_t seq;  // block: index of the block in its file, file: blocks count
+    uint64_t file_id;  // identifier of the input file, unique among slaves
+};
+
+// nfdump file being read
+struct nfblock_file {
+    FILE *file;
+    const char *path;
+    struct nfblock_file_hdr hdr;
+    struct nfblock_stat stat;
+};
+
+struct nfblock_part;  // input file being reassembled, see nfblock.c
+
+// nfdump file being written
+struct nfblock_out {
+    FILE *file;
+    const char *path;
+    struct nfblock_file_hdr hdr;  // of the first input file
+    struct nfblock_stat stat;  // sum of all input files
+    uint64_t files_cnt;
+    uint64_t rec_cnt;
+
+    struct nfblock_part *parts;  // input files not written yet, first is next
+    size_t parts_cnt;
+    size_t parts_size;  // number of allocated parts
+    uint8_t *copy_buff;  // buffer for the blocks read back from the parts
+    size_t copy_buff_size;
+};
+
+
+bool
+nfblock_open(struct nfblock_file *const nf, const char *const path);
+
+bool
+nfblock_read_hdr(struct nfblock_file *const nf, struct nfblock_hdr *const bh);
+
+bool
+nfblock_read_data(struct nfblock_file *const nf, uint8_t *const data,
+                  const size_t size);
+
+void
+nfblock_close(struct nfblock_file *const nf);
+
+void
+nfblock_out_open(struct nfblock_out *const out, const char *const path);
+
+void
+nfblock_out_rec(struct nfblock_out *const out, const uint8_t *const rec,
+                const size_t rec_len);
+
+void
+nfblock_out_close(struct nfblock_out *const out);
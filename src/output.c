@@ -29,7 +29,7 @@
 #include <stdint.h>             // for UINT32_MAX, UINT64_MAX, UINT8_MAX, ...
 #include <stdio.h>              // for printf, snprintf, putchar, puts
 #include <stdlib.h>             // for free, malloc
-#include <string.h>             // for strlen
+#include <string.h>             // for strlen, strerror, memcpy
 #include <time.h>               // for strftime, localtime_r
 
 
@@ -47,6 +47,7 @@
 #include <features.h>           // for __GLIBC_MINOR__, __GLIBC__
 #include <netinet/in.h>         // for ntohl, INET6_ADDRSTRLEN, IN6_IS_ADDR_...
 #include <sys/socket.h>         // for AF_INET, AF_INET6
+#include <sys/stat.h>           // for mkdir
 #include <sys/types.h>          // for ssize_t
 
 #include "common.h"             // for metadata_summ, processed_summ, ARRAY_...
@@ -86,6 +87,27 @@ typedef enum {
 } alignment_t;
 typedef const char *(*field_to_str_t)(const void *const);
 
+/**
+ * @brief Iterator over records of one or more libnf memories.
+ *
+ * If there is a sort key, records are merged by the sort key (each memory has
+ * to be sorted already), otherwise the memories are iterated one after
+ * another.
+ */
+struct batch_iter {
+    lnf_mem_t *const *lnf_mems;
+    size_t lnf_mems_cnt;
+
+    lnf_mem_cursor_t **cursors;  // NULL cursor means the memory is exhausted
+    lnf_rec_t **lnf_recs;        // current record of each memory
+    uint8_t *sort_keys;          // current sort key value of each memory
+    size_t sort_key_size;
+    size_t last;                 // memory of the last returned record
+
+    batch_refill_callback_t refill;  // refills an exhausted memory, optional
+    void *refill_user;
+};
+
 
 /*
  * Global variables.
@@ -98,11 +120,13 @@ struct {
     alignment_t *columnt_alignment;
 
     size_t max_field_size;
+    size_t stream_str_size;  // buffer size for one formatted stream record
 
     bool first_item;  // first item will not print '\n' before
 } o_ctx;
 
-static char global_str[MAX_STR_LEN];
+// thread-local, the stream records may be formatted by multiple threads
+static _Thread_local char global_str[MAX_STR_LEN];
 static struct output_params output_params; //output parameters
 static const struct fields *fields;
 
@@ -843,7 +867,7 @@ string_to_str_strlen(void)
 static const char *
 libnf_brec_to_str(const lnf_brec1_t *brec)
 {
-    static char res[MAX_STR_LEN];
+    static _Thread_local char res[MAX_STR_LEN];
     char *str_term = res;
     uint64_t remaining = sizeof (res);
 
@@ -1030,7 +1054,7 @@ field_to_str(const int field_id, const void *const data)
 }
 
 /**
- * @brief TODO
+ * @brief Format the field string into the destination buffer.
  *
  * Field string is left aligned. If it has fewer characters than the string
  * width, it will be padded with spaces on the right. The last field is printed
@@ -1053,17 +1077,24 @@ field_to_str(const int field_id, const void *const data)
  *               |~~~~~~|
  *          col_width_remainder = -6
  *
+ * The destination has to have at least MAX(strlen(string), col_width) +
+ * PROTECTIVE_PADDING + 2 bytes (see field_str_size()).
+ *
+ * @param dst Destination buffer, the result is null-terminated.
  * @param string
  * @param col_width
  * @param space_width
  * @param last
+ *
+ * @return Length of the formatted field (without the terminating null byte).
  */
-static void
-print_field(const char *const string, const int col_width,
-            const alignment_t alignment, const bool last)
+static size_t
+format_field(char *const dst, const char *const string, const int col_width,
+             const alignment_t alignment, const bool last)
 {
-    assert(string && col_width > 0);
+    assert(dst && string && col_width > 0);
 
+    char *pos = dst;
     switch (output_params.format) {
     case OUTPUT_FORMAT_PRETTY:
     {
@@ -1071,9 +1102,6 @@ print_field(const char *const string, const int col_width,
         const ssize_t col_width_remainder = col_width - string_len;
         size_t padding_width;
 
-        char aligned_and_padded_string[string_len + col_width_remainder + PROTECTIVE_PADDING];
-        char *pos = aligned_and_padded_string;
-
         if (col_width_remainder < 0 && output_params.ellipsize) {
             // not enough space: ellipsize and print the whole padding
             const size_t copy_len = col_width - STRLEN_STATIC(ELLIPSIS);
@@ -1117,24 +1145,56 @@ print_field(const char *const string, const int col_width,
         // handy to debug output
         //*pos = '|';
         //pos++;
-
-        *pos = '\0';  // terminate
-        fputs(aligned_and_padded_string, stdout);
         break;
     }
 
     case OUTPUT_FORMAT_CSV:
-        fputs(string, stdout);
+    {
+        const size_t string_len = strlen(string);
+        memcpy(pos, string, string_len);
+        pos += string_len;
         if (!last) {  // no trailing CSV separator for the last field
-            putchar(CSV_SEP);
+            *pos++ = CSV_SEP;
         }
         break;
+    }
 
     case OUTPUT_FORMAT_UNSET:
         ABORT(E_INTERNAL, "illegal output format");
     default:
         ABORT(E_INTERNAL, "unknown output format");
     }
+
+    *pos = '\0';  // terminate
+    return pos - dst;
+}
+
+/**
+ * @brief Return the buffer size sufficient for format_field().
+ */
+static size_t
+field_str_size(const size_t string_len, const int col_width)
+{
+    return MAX(string_len, (size_t)col_width) + PROTECTIVE_PADDING + 2;
+}
+
+/**
+ * @brief TODO
+ *
+ * @param string
+ * @param col_width
+ * @param space_width
+ * @param last
+ */
+static void
+print_field(const char *const string, const int col_width,
+            const alignment_t alignment, const bool last)
+{
+    assert(string && col_width > 0);
+
+    char str[field_str_size(strlen(string), col_width)];
+    format_field(str, string, col_width, alignment, last);
+    fputs(str, stdout);
 }
 
 /**
@@ -1252,43 +1312,160 @@ get_field_str(const size_t idx, lnf_rec_t *const lnf_rec, char *const buff)
     }
 }
 
+/**
+ * @defgroup batch_iter Iterator over records of one or more libnf memories.
+ * @{
+ */
+/**
+ * @brief Read the record under the cursor of the memory idx.
+ */
+static void
+batch_iter_read(struct batch_iter *const iter, const size_t idx)
+{
+    if (!iter->cursors[idx]) {
+        return;  // the memory is exhausted
+    }
+
+    int lnf_ret = lnf_mem_read_c(iter->lnf_mems[idx], iter->cursors[idx],
+                                 iter->lnf_recs[idx]);
+    assert(lnf_ret == LNF_OK);
+    if (iter->sort_key_size) {
+        lnf_ret = lnf_rec_fget(iter->lnf_recs[idx], fields->sort_key.field->id,
+                               iter->sort_keys + idx * iter->sort_key_size);
+        assert(lnf_ret == LNF_OK);
+    }
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+}
+
+static void
+batch_iter_init(struct batch_iter *const iter, lnf_mem_t *const lnf_mems[],
+                const size_t lnf_mems_cnt)
+{
+    assert(iter && lnf_mems && lnf_mems_cnt > 0);
+
+    iter->lnf_mems = lnf_mems;
+    iter->lnf_mems_cnt = lnf_mems_cnt;
+    iter->last = SIZE_MAX;  // nothing returned yet
+    iter->refill = NULL;
+    // merging is needed only if there are more memories and a sort key
+    iter->sort_key_size = (lnf_mems_cnt > 1 && fields->sort_key.field)
+        ? fields->sort_key.field->size : 0;
+
+    iter->cursors = calloc(lnf_mems_cnt, sizeof (*iter->cursors));
+    iter->lnf_recs = calloc(lnf_mems_cnt, sizeof (*iter->lnf_recs));
+    iter->sort_keys = calloc(lnf_mems_cnt, MAX(iter->sort_key_size, 1));
+    ABORT_IF(!iter->cursors || !iter->lnf_recs || !iter->sort_keys, E_MEM,
+             "batch iterator memory allocation failed");
+
+    for (size_t i = 0; i < lnf_mems_cnt; ++i) {
+        int lnf_ret = lnf_rec_init(iter->lnf_recs + i);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_init()");
+
+        // initialize the cursor to point to the first record in the memory
+        lnf_ret = lnf_mem_first_c(lnf_mems[i], iter->cursors + i);
+        assert((iter->cursors[i] && lnf_ret == LNF_OK)
+               || (!iter->cursors[i] && lnf_ret == LNF_EOF));
+        batch_iter_read(iter, i);
+    }
+}
+
+static void
+batch_iter_free(struct batch_iter *const iter)
+{
+    assert(iter);
+
+    for (size_t i = 0; i < iter->lnf_mems_cnt; ++i) {
+        lnf_rec_free(iter->lnf_recs[i]);
+    }
+    free(iter->sort_keys);
+    free(iter->lnf_recs);
+    free(iter->cursors);
+}
+
+/**
+ * @brief Return the next record, NULL if there are no more records.
+ *
+ * The returned record is valid until the next call. Number of merged memories
+ * is usually small (one per master's merge thread), so a linear search for
+ * the best sort key is used.
+ */
+static lnf_rec_t *
+batch_iter_next(struct batch_iter *const iter)
+{
+    assert(iter);
+
+    // advance the memory of the previously returned record
+    if (iter->last != SIZE_MAX) {
+        const size_t l = iter->last;
+        int lnf_ret = lnf_mem_next_c(iter->lnf_mems[l], iter->cursors + l);
+        assert((iter->cursors[l] && lnf_ret == LNF_OK)
+               || (!iter->cursors[l] && lnf_ret == LNF_EOF));
+        if (!iter->cursors[l] && iter->refill
+                && iter->refill(l, iter->refill_user)) {
+            // the memory was replaced by a new one with the next records
+            lnf_ret = lnf_mem_first_c(iter->lnf_mems[l], iter->cursors + l);
+            assert((iter->cursors[l] && lnf_ret == LNF_OK)
+                   || (!iter->cursors[l] && lnf_ret == LNF_EOF));
+        }
+        (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+        batch_iter_read(iter, l);
+    }
+
+    // find the memory with the best record
+    size_t best = SIZE_MAX;
+    for (size_t i = 0; i < iter->lnf_mems_cnt; ++i) {
+        if (!iter->cursors[i]) {
+            continue;
+        }
+        if (best == SIZE_MAX) {
+            best = i;
+            if (!iter->sort_key_size) {
+                break;  // no merging, memories are iterated one by one
+            }
+            continue;
+        }
+
+        if (sort_key_cmp(&fields->sort_key,
+                         iter->sort_keys + i * iter->sort_key_size,
+                         iter->sort_keys + best * iter->sort_key_size) < 0) {
+            best = i;
+        }
+    }
+
+    iter->last = best;
+    return best == SIZE_MAX ? NULL : iter->lnf_recs[best];
+}
+/**
+ * @}
+ */  // batch_iter
+
 /**
  * @brief TODO
  *
- * @param lnf_mem
+ * @param lnf_mems
+ * @param lnf_mems_cnt
  * @param rec_limit
  */
 static void
-set_column_widths_exactly(lnf_mem_t *const lnf_mem, const size_t rec_limit)
+set_column_widths_exactly(lnf_mem_t *const lnf_mems[],
+                          const size_t lnf_mems_cnt, const size_t rec_limit)
 {
-    // initialize a libnf record
-    lnf_rec_t *lnf_rec;
-    int lnf_ret = lnf_rec_init(&lnf_rec);
-    ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_init()");
-
-    // initialize the cursor to point to the first record in the memory
-    lnf_mem_cursor_t *cursor;
-    lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
-    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    struct batch_iter iter;
+    batch_iter_init(&iter, lnf_mems, lnf_mems_cnt);
 
     // loop through all records
     uint64_t rec_cntr = 0;  // aka lines counter
     char buff[o_ctx.max_field_size];
-    while (cursor && rec_limit > rec_cntr++) {
-        lnf_ret = lnf_mem_read_c(lnf_mem, cursor, lnf_rec);
-        assert(lnf_ret == LNF_OK);
-
+    lnf_rec_t *lnf_rec;
+    while (rec_limit > rec_cntr++ && (lnf_rec = batch_iter_next(&iter))) {
         // loop through all fields in the record
         for (size_t i = 0; i < fields->all_cnt; ++i) {
             const size_t field_str_len = strlen(get_field_str(i, lnf_rec, buff));
             MAX_ASSIGN(o_ctx.column_width[i], field_str_len);
         }
-
-        lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
-        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
     }
 
-    lnf_rec_free(lnf_rec);
+    batch_iter_free(&iter);
 }
 
 /**
@@ -1455,7 +1632,12 @@ output_init(struct output_params op, const struct fields *const fields_param)
             get_column_width_estimate(o_ctx.field_to_str_cb[i]);
         o_ctx.columnt_alignment[i] =
             get_column_alignment(o_ctx.field_to_str_cb[i]);
+
+        // converted strings are at most MAX_STR_LEN long, plus the newline
+        o_ctx.stream_str_size += field_str_size(MAX_STR_LEN,
+                                                o_ctx.column_width[i]);
     }
+    o_ctx.stream_str_size++;
 
     o_ctx.first_item = true;
 }
@@ -1506,15 +1688,97 @@ print_stream_next(const uint8_t *const data)
         return;
     }
 
+    char str[o_ctx.stream_str_size];
+    format_stream_next(data, str);
+    fputs(str, stdout);
+}
+
+/**
+ * @brief Return the buffer size sufficient for format_stream_next().
+ */
+size_t
+format_stream_size(void)
+{
+    assert(o_ctx.field_to_str_cb);
+
+    return o_ctx.stream_str_size;
+}
+
+/**
+ * @brief Format the stream record into a line of text.
+ *
+ * The line is the same as printed by print_stream_next(). It is thread-safe,
+ * so the slave threads may format their records themselves (see
+ * --slave-format).
+ *
+ * @param data The record in the fdistdump layout.
+ * @param str Destination buffer of format_stream_size() bytes, the result is
+ *            null-terminated.
+ *
+ * @return Length of the line including the newline (without the terminating
+ *         null byte).
+ */
+size_t
+format_stream_next(const uint8_t *const data, char *const str)
+{
+    assert(o_ctx.field_to_str_cb && data && str);
+
     // loop through the fields in the record
+    size_t len = 0;
     for (size_t i = 0; i < fields->all_cnt; ++i) {
         const bool last_column = (i == (fields->all_cnt - 1));
 
-        print_field(o_ctx.field_to_str_cb[i](data + o_ctx.field_offset[i]),
-                    o_ctx.column_width[i], o_ctx.columnt_alignment[i],
-                    last_column);
+        len += format_field(str + len,
+                            o_ctx.field_to_str_cb[i](data
+                                                     + o_ctx.field_offset[i]),
+                            o_ctx.column_width[i], o_ctx.columnt_alignment[i],
+                            last_column);
     }
-    putchar('\n');
+    str[len++] = '\n';
+    str[len] = '\0';
+
+    assert(len < o_ctx.stream_str_size);
+    return len;
+}
+
+/**
+ * @brief Create the output directory for the shards (see --output-dir).
+ *
+ * An existing directory is used as it is.
+ *
+ * @param dir Path to the directory.
+ */
+void
+output_dir_create(const char *const dir)
+{
+    assert(dir);
+
+    ABORT_IF(mkdir(dir, 0777) != 0 && errno != EEXIST, E_ARG,
+             "`%s': unable to create the output directory: %s", dir,
+             strerror(errno));
+}
+
+/**
+ * @brief Compose the file name of the output shard of the slave thread.
+ *
+ * The extension is given by the output format.
+ *
+ * @param name Destination buffer.
+ * @param name_size Size of the destination buffer.
+ * @param rank Rank of the slave.
+ * @param thread Thread number on the slave.
+ */
+void
+output_shard_name(char *const name, const size_t name_size, const int rank,
+                  const int thread)
+{
+    assert(name && o_ctx.field_to_str_cb);
+
+    const int ret = snprintf(name, name_size, "part-%d-%d.%s", rank, thread,
+                             output_params.format == OUTPUT_FORMAT_CSV
+                             ? "csv" : "txt");
+    ABORT_IF(ret < 0 || (size_t)ret >= name_size, E_INTERNAL,
+             "output shard name is too long");
 }
 
 /**
@@ -1525,6 +1789,19 @@ print_stream_next(const uint8_t *const data)
  */
 void
 print_batch(lnf_mem_t *const lnf_mem, uint64_t rec_limit)
+{
+    print_batch_merge(&lnf_mem, 1, rec_limit);
+}
+
+/**
+ * @brief Print records from multiple libnf memories, optionally refilled.
+ *
+ * See print_batch_merge() and print_batch_merge_refill().
+ */
+static void
+print_batch_merge_impl(lnf_mem_t *const lnf_mems[], const size_t lnf_mems_cnt,
+                       uint64_t rec_limit,
+                       const batch_refill_callback_t refill, void *const user)
 {
     assert(o_ctx.field_to_str_cb);
 
@@ -1539,8 +1816,9 @@ print_batch(lnf_mem_t *const lnf_mem, uint64_t rec_limit)
     o_ctx.first_item = o_ctx.first_item ? false : (putchar('\n'), false);
 
     if (!output_params.ellipsize) {
-        // loop through all records and calculate with of all columns
-        set_column_widths_exactly(lnf_mem, rec_limit);
+        // loop through all records and calculate with of all columns, only the
+        // records currently in the memories are considered if refilling is on
+        set_column_widths_exactly(lnf_mems, lnf_mems_cnt, rec_limit);
     }
 
 
@@ -1563,23 +1841,16 @@ print_batch(lnf_mem_t *const lnf_mem, uint64_t rec_limit)
     /*
      * Print the fields.
      */
-    // initialize a libnf record
-    lnf_rec_t *lnf_rec;
-    int lnf_ret = lnf_rec_init(&lnf_rec);
-    ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_init()");
-
-    // initialize the cursor to point to the first record in the memory
-    lnf_mem_cursor_t *cursor;
-    lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
-    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    struct batch_iter iter;
+    batch_iter_init(&iter, lnf_mems, lnf_mems_cnt);
+    iter.refill = refill;
+    iter.refill_user = user;
 
     // loop through all records
     uint64_t rec_cntr = 0;  // aka lines counter
     char buff[o_ctx.max_field_size];
-    while (cursor && rec_limit > rec_cntr++) {
-        lnf_ret = lnf_mem_read_c(lnf_mem, cursor, lnf_rec);
-        assert(lnf_ret == LNF_OK);
-
+    lnf_rec_t *lnf_rec;
+    while (rec_limit > rec_cntr++ && (lnf_rec = batch_iter_next(&iter))) {
         // loop through all fields in the record
         for (size_t i = 0; i < fields->all_cnt; ++i) {
             const char *const field_str = get_field_str(i, lnf_rec, buff);
@@ -1589,12 +1860,54 @@ print_batch(lnf_mem_t *const lnf_mem, uint64_t rec_limit)
                         o_ctx.columnt_alignment[i], last_column);
         }
         putchar('\n');
-
-        lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
-        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
     }
 
-    lnf_rec_free(lnf_rec);
+    batch_iter_free(&iter);
+}
+
+/**
+ * @brief Print records from multiple libnf memories.
+ *
+ * If there is a sort key, the memories are merged by the sort key (k-way
+ * merge), otherwise records of the memories are printed one memory after
+ * another. This is intended for memories with disjoint aggregation keys.
+ *
+ * @param lnf_mems Array of the libnf memories.
+ * @param lnf_mems_cnt Number of the libnf memories.
+ * @param rec_limit Print at most rec_limit records, 0 means no limit.
+ */
+void
+print_batch_merge(lnf_mem_t *const lnf_mems[], const size_t lnf_mems_cnt,
+                  uint64_t rec_limit)
+{
+    print_batch_merge_impl(lnf_mems, lnf_mems_cnt, rec_limit, NULL, NULL);
+}
+
+/**
+ * @brief Print records from multiple libnf memories refilled on exhaustion.
+ *
+ * Same as print_batch_merge(), but each memory holds only a chunk of its
+ * records (e.g., of a sorted run on disk). When all records of the memory at
+ * index idx were printed, refill(idx, user) is called. It has to replace
+ * lnf_mems[idx] by a memory with the next chunk (the array is owned by the
+ * caller) and return true, or return false if there are no more records.
+ * Without the ellipsizing, the column widths are computed only from the
+ * first chunks.
+ *
+ * @param lnf_mems Array of the libnf memories.
+ * @param lnf_mems_cnt Number of the libnf memories.
+ * @param rec_limit Print at most rec_limit records, 0 means no limit.
+ * @param refill Callback refilling an exhausted memory.
+ * @param user User data passed to the callback.
+ */
+void
+print_batch_merge_refill(lnf_mem_t *const lnf_mems[],
+                         const size_t lnf_mems_cnt, uint64_t rec_limit,
+                         const batch_refill_callback_t refill, void *const user)
+{
+    assert(refill);
+
+    print_batch_merge_impl(lnf_mems, lnf_mems_cnt, rec_limit, refill, user);
 }
 
 /**
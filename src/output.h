@@ -25,6 +25,7 @@
 
 #include <inttypes.h>           // for fixed-width integer types
 #include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
 
 #include <libnf.h>              // for lnf_mem_t
 
@@ -87,6 +88,9 @@ typedef enum {
     OUTPUT_DURATION_CONV_STR,
 } output_duration_conv_t;
 
+// refills the exhausted memory idx, see print_batch_merge_refill()
+typedef bool (*batch_refill_callback_t)(size_t idx, void *user);
+
 
 struct output_params {
     // items
@@ -124,9 +128,31 @@ print_stream_names();
 void
 print_stream_next(const uint8_t *const data);
 
+size_t
+format_stream_size(void);
+
+size_t
+format_stream_next(const uint8_t *const data, char *const str);
+
+void
+output_dir_create(const char *const dir);
+
+void
+output_shard_name(char *const name, const size_t name_size, const int rank,
+                  const int thread);
+
 void
 print_batch(lnf_mem_t *const lnf_mem, const uint64_t limit);
 
+void
+print_batch_merge(lnf_mem_t *const lnf_mems[], const size_t lnf_mems_cnt,
+                  uint64_t rec_limit);
+
+void
+print_batch_merge_refill(lnf_mem_t *const lnf_mems[],
+                         const size_t lnf_mems_cnt, uint64_t rec_limit,
+                         const batch_refill_callback_t refill, void *const user);
+
 void
 print_processed_summ(const struct processed_summ *const s,
                      const double duration);
@@ -25,11 +25,13 @@
 #include "slave.h"
 
 #include <assert.h>             // for assert
+#include <errno.h>              // for errno
 #include <inttypes.h>           // for fixed-width integer types
 #include <stdbool.h>            // for bool, true, false
 #include <stdint.h>             // for SIZE_MAX, UINT32_MAX
-#include <stdlib.h>             // for free, malloc
-#include <string.h>             // for strlen
+#include <stdio.h>              // for FILE, fopen, fwrite, setvbuf, snprintf
+#include <stdlib.h>             // for free, malloc, qsort, realloc
+#include <string.h>             // for strlen, memcpy, strdup, strcmp, strrchr
 
 #include <ffilter.h>            // for ff_t
 #include <libnf.h>              // for lnf_info, LNF_OK, lnf_rec_fget, LNF_EOF
@@ -43,18 +45,26 @@
 #include "common.h"             // for metadata_summ, ROOT_PROC, mpi_comm_main
 #include "errwarn.h"            // for error/warning/info/debug messages, ...
 #include "fields.h"             // for fields, sort_key, field
+#include "nfblock.h"            // for nfblock_open, nfblock_read_hdr, ...
+#include "output.h"             // for output_init, format_stream_next, ...
 #include "path_array.h"         // for path_array_free
+#include "spill.h"              // for spill_init, spill_account, ...
+#include "xchg.h"               // for xchg_send_raw_mem, ...
 
 
-
-#if LNF_MAX_RAW_LEN > XCHG_BUFF_SIZE
-#error "LNF_MAX_RAW_LEN > XCHG_BUFF_SIZE"
+#if LNF_MAX_RAW_LEN > XCHG_BUFF_SIZE_MIN
+#error "LNF_MAX_RAW_LEN > XCHG_BUFF_SIZE_MIN"
 #endif
 
 #if LNF_MAX_RAW_LEN > UINT32_MAX
 #error "LNF_MAX_RAW_LEN > UINT32_MAX"
 #endif
 
+#define SORT_PRUNE_PREFIX_FACTOR 2  // prefixes of all streams to the limit ratio
+#define CANCEL_CHECK_INTERVAL 4096  // records read between cancellation checks
+#define SHARD_BUFF_SIZE (1024 * 1024)  // stdio buffer of each output shard
+
+
 /*
  * Global variables.
  */
@@ -68,12 +78,25 @@ static const struct cmdline_args *args;
 struct slave_ctx {
     uint64_t proc_rec_cntr;  // processed record counter
     bool rec_limit_reached; // true if rec_limit records has been read
+    MPI_Request cancel_request;  // receive of the master's TAG_CANCEL
+    struct xchg_comm_msg cancel_msg;  // the last test of cancel_request
     struct processed_summ processed_summ;  // summary of processed records
     struct metadata_summ metadata_summ;    // summary of flow files metadata
 
+    lnf_mem_t **thread_mems;  // thread-local memories, for the in-node merge
+    bool spilled;  // true if any thread spilled its memory
+    struct spill **thread_spills;  // thread-local spills, for the final merge
+
     uint64_t tput_threshold;
     uint64_t tput_rec_info[2];  // 0: record count, 1: record size
     char *tput_rec_buff;
+
+    uint64_t prune_prefix;  // records per stream sent before the threshold
+    uint8_t prune_threshold[SORT_PRUNE_THRESHOLD_SIZE];  // validity, key
+
+    int rank;  // rank of this slave in mpi_comm_main
+    uint64_t *shard_rec_cnts;  // records in the output shard of each thread
+    uint32_t passthrough_file_cntr;  // files forwarded by the passthrough
 };
 
 // thread-private context
@@ -83,10 +106,16 @@ struct slave_ctx {
 struct thread_ctx {
     lnf_filter_t *lnf_filter; // libnf compiled filter expression
     lnf_mem_t *lnf_mem;  // libnf memory used for record storage
+    struct spill *spill;  // spill of the libnf memory, if memory is bounded
+    struct topk *topk;  // top-K records, if sorting with a record limit
+    struct time_order *time_order;  // reorder window of time-ordered listing
     lnf_file_t *lnf_file;  // libnf file
     lnf_rec_t *lnf_rec;    // libnf record
 
     uint8_t *buff[2];  // two chunks of memory for the record storage
+    struct xchg_ring ring;  // send buffers of the record streams, lazily
+    FILE *shard;  // output shard (see --output-dir), lazily
+    uint64_t shard_rec_cntr;  // number of records written into the shard
     struct processed_summ processed_summ;  // summary of processed records
     struct metadata_summ metadata_summ;    // summary of flow files metadata
 
@@ -135,6 +164,503 @@ init_bfindex(lnf_filter_t *lnf_filter)
 }
 #endif  // ENABLE_BFINDEX
 
+/**
+ * @brief Compare two sort key values in the output order (for qsort()).
+ */
+static int
+sort_key_qsort_cmp(const void *const a, const void *const b)
+{
+    return sort_key_cmp(&args->fields.sort_key, a, b);
+}
+
+/**
+ * @brief Compare two flow file paths by their names (for qsort()).
+ *
+ * Names of the rotated flow files (see FLOW_FILE_FORMAT) are ordered by time,
+ * files from different directories with the same name are ordered by path.
+ */
+static int
+path_time_cmp(const void *const a, const void *const b)
+{
+    const char *const path_a = *(char *const *)a;
+    const char *const path_b = *(char *const *)b;
+    const char *const name_a = strrchr(path_a, '/');
+    const char *const name_b = strrchr(path_b, '/');
+
+    const int cmp = strcmp(name_a ? name_a + 1 : path_a,
+                           name_b ? name_b + 1 : path_b);
+    return cmp ? cmp : strcmp(path_a, path_b);
+}
+
+/**
+ * @defgroup slave_topk Bounded top-K selection for sorting with a limit.
+ *
+ * When sorting with a record limit K, only the first K records of each thread
+ * can make it to the output. Instead of storing all records in the libnf
+ * linked list memory and sorting them, a binary heap of the K best records
+ * (see @ref top_n_heap) is maintained. The worst of them is at the root, so a
+ * new record is compared only with the root and most records are rejected
+ * after fetching the sort key. The memory is O(K) and the work is O(n log K).
+ * At the end, the selected records are written into the libnf memory, which
+ * sorts them as usual.
+ *
+ * With the late materialization, the heap holds only the sort key and the
+ * locator of the record (index of the flow file and the ordinal of the record
+ * in the file) instead of the record copy. The entries are small, so there is
+ * no limit on K. At the end, the selected records are re-read from the flow
+ * files in the file order, so each file is read only up to its last selected
+ * record, and only they go through the libnf memory.
+ *
+ * @{
+ */
+#define TOPK_LIMIT_MAX (64 * 1024)  // for larger limits, use only libnf memory
+#define TOPK_KEY_SIZE_MAX (SORT_PRUNE_THRESHOLD_SIZE - 1)  // largest sort key
+
+struct topk_entry {
+    union {
+        lnf_rec_t *rec;  // copy of the record
+        uint64_t row;  // ordinal of the record in the file (late mat.)
+    };
+    uint32_t file_idx;  // index of the flow file (late materialization)
+};
+
+struct topk {
+    struct top_n_heap heap;  // sort keys of the K best records
+    struct topk_entry *entries;  // record of each heap slot
+    size_t entries_size;  // number of allocated entries
+
+    bool late_mat;  // store record locators instead of record copies
+    char **files;  // paths of the read flow files (late materialization)
+    size_t files_cnt;
+    size_t files_size;  // number of allocated file paths
+};
+
+
+static struct topk *
+topk_init(const size_t capacity, const struct sort_key *const sort_key,
+          const bool late_mat)
+{
+    assert(capacity > 0 && sort_key && sort_key->field);
+    assert(sort_key->field->size <= TOPK_KEY_SIZE_MAX);
+
+    struct topk *const tk = calloc(1, sizeof (*tk));
+    ABORT_IF(!tk, E_MEM, "top-K context allocation failed");
+    top_n_heap_init(&tk->heap, sort_key, capacity);
+    tk->late_mat = late_mat;
+
+    return tk;
+}
+
+static void
+topk_free(struct topk *const tk)
+{
+    assert(tk);
+
+    if (!tk->late_mat) {
+        for (size_t i = 0; i < tk->heap.cnt; ++i) {
+            lnf_rec_free(tk->entries[i].rec);
+        }
+    }
+    for (size_t i = 0; i < tk->files_cnt; ++i) {
+        free(tk->files[i]);
+    }
+    free(tk->files);
+    free(tk->entries);
+    top_n_heap_free(&tk->heap);
+    free(tk);
+}
+
+/**
+ * @brief Register the flow file whose records will be offered next.
+ *
+ * Only for the late materialization, the records are located by the index of
+ * the last registered file.
+ */
+static void
+topk_add_file(struct topk *const tk, const char *const ff_path)
+{
+    assert(tk && tk->late_mat && ff_path);
+    ABORT_IF(tk->files_cnt == UINT32_MAX, E_INTERNAL,
+             "top-K: too many flow files");
+
+    if (tk->files_cnt == tk->files_size) {
+        tk->files_size = tk->files_size ? 2 * tk->files_size : 16;
+        tk->files = realloc(tk->files, tk->files_size * sizeof (*tk->files));
+        ABORT_IF(!tk->files, E_MEM, "top-K file paths allocation failed");
+    }
+    tk->files[tk->files_cnt] = strdup(ff_path);
+    ABORT_IF(!tk->files[tk->files_cnt], E_MEM,
+             "top-K file path allocation failed");
+    tk->files_cnt++;
+}
+
+/**
+ * @brief Offer the record to the top-K heap, HOT PATH!
+ *
+ * The record is copied (or its locator is stored with the late
+ * materialization) if it is among the K best records seen so far.
+ *
+ * @param[in,out] tk Top-K context.
+ * @param[in] lnf_rec The record.
+ * @param[in] row Ordinal of the record in the last registered file.
+ */
+static void
+topk_insert(struct topk *const tk, lnf_rec_t *const lnf_rec,
+            const uint64_t row)
+{
+    assert(tk && lnf_rec);
+
+    uint8_t key[TOPK_KEY_SIZE_MAX];
+    lnf_rec_fget(lnf_rec, tk->heap.sort_key->field->id, key);
+
+    const size_t cnt = tk->heap.cnt;
+    const size_t slot = top_n_heap_offer(&tk->heap, key);
+    if (slot == SIZE_MAX) {
+        return;  // not better than the worst record
+    }
+    if (slot == cnt) {  // a new slot, otherwise the worst record is replaced
+        if (slot == tk->entries_size) {
+            tk->entries_size = tk->heap.slots_size;
+            tk->entries = realloc(tk->entries,
+                                  tk->entries_size * sizeof (*tk->entries));
+            ABORT_IF(!tk->entries, E_MEM, "top-K entries allocation failed");
+        }
+        if (!tk->late_mat) {
+            const int lnf_ret = lnf_rec_init(&tk->entries[slot].rec);
+            ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_init()");
+        }
+    }
+
+    struct topk_entry *const entry = tk->entries + slot;
+
+    if (tk->late_mat) {
+        assert(tk->files_cnt > 0);
+        entry->row = row;
+        entry->file_idx = tk->files_cnt - 1;
+    } else {
+        const int lnf_ret = lnf_rec_copy(entry->rec, lnf_rec);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_copy()");
+    }
+}
+
+/**
+ * @brief Compare two entries by their locators (for qsort()).
+ */
+static int
+topk_locator_cmp(const void *const a, const void *const b)
+{
+    const struct topk_entry *const ea = a;
+    const struct topk_entry *const eb = b;
+
+    if (ea->file_idx != eb->file_idx) {
+        return (ea->file_idx > eb->file_idx) - (ea->file_idx < eb->file_idx);
+    }
+    return (ea->row > eb->row) - (ea->row < eb->row);
+}
+
+/**
+ * @brief Re-read the selected records from the flow files into the libnf
+ *        memory.
+ *
+ * The heap is destroyed, the entries are sorted by their locators.
+ */
+static void
+topk_materialize(struct topk *const tk, lnf_mem_t *const lnf_mem,
+                 lnf_rec_t *const lnf_rec)
+{
+    assert(tk && tk->late_mat && lnf_mem && lnf_rec);
+
+    qsort(tk->entries, tk->heap.cnt, sizeof (*tk->entries), topk_locator_cmp);
+
+    size_t i = 0;
+    while (i < tk->heap.cnt) {
+        const char *const ff_path = tk->files[tk->entries[i].file_idx];
+        lnf_file_t *lnf_file;
+        int lnf_ret = lnf_open(&lnf_file, ff_path, LNF_READ, NULL);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF,
+                 "`%s': unable to reopen the flow file", ff_path);
+
+        // read the file up to its last selected record
+        const uint32_t file_idx = tk->entries[i].file_idx;
+        uint64_t row = 0;
+        while (i < tk->heap.cnt && tk->entries[i].file_idx == file_idx) {
+            lnf_ret = lnf_read(lnf_file, lnf_rec);
+            ABORT_IF(lnf_ret != LNF_OK, E_LNF,
+                     "`%s': the flow file changed since it was read", ff_path);
+            if (row++ != tk->entries[i].row) {
+                continue;
+            }
+
+            lnf_ret = lnf_mem_write(lnf_mem, lnf_rec);
+            ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write()");
+            i++;
+        }
+        lnf_close(lnf_file);
+    }
+}
+
+/**
+ * @brief Write the selected records into the libnf memory.
+ *
+ * With the late materialization, the heap is destroyed.
+ *
+ * @param[in,out] tk Top-K context.
+ * @param[out] lnf_mem The libnf memory.
+ * @param[in,out] lnf_rec Auxiliary libnf record for the late materialization.
+ */
+static void
+topk_flush(struct topk *const tk, lnf_mem_t *const lnf_mem,
+           lnf_rec_t *const lnf_rec)
+{
+    assert(tk && lnf_mem);
+
+    if (tk->late_mat) {
+        topk_materialize(tk, lnf_mem, lnf_rec);
+    } else {
+        for (size_t i = 0; i < tk->heap.cnt; ++i) {
+            const int lnf_ret = lnf_mem_write(lnf_mem, tk->entries[i].rec);
+            ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write()");
+        }
+    }
+    DEBUG("top-K: selected %zu record(s) out of at most %zu", tk->heap.cnt,
+          tk->heap.capacity);
+}
+/**
+ * @}
+ */  // slave_topk
+
+/**
+ * @defgroup slave_time_order Time-ordered listing of records.
+ *
+ * The flow files are rotated by time (see FLOW_FILE_FORMAT) and the records
+ * inside them are mostly ordered by their first timestamp. With the
+ * time-ordered listing, the flow files are processed in the order of their
+ * names and each thread sends its records ordered by the first timestamp as a
+ * separate stream, like in the sort mode. The master merges the streams (see
+ * @ref master_sort_merge), so the output is chronological, the memory is
+ * bounded and nothing is sorted as a whole.
+ *
+ * The records are reordered in a window of a fixed number of records, which
+ * is a binary min-heap by the first timestamp. When the window is full, its
+ * oldest record is sent. A record older than the last sent one (disordered
+ * more than the window can repair) is sent anyway and counted as late.
+ *
+ * With a record limit, each stream ends after rec_limit records, so the
+ * remaining flow files of the thread are not read at all.
+ *
+ * @{
+ */
+struct time_order_entry {
+    uint64_t first;  // first timestamp of the record
+    size_t slot;  // index of the record in the slots
+};
+
+struct time_order {
+    size_t window;  // capacity of the window
+    size_t cnt;  // number of records in the window
+    struct time_order_entry *heap;  // min-heap, the oldest record at [0]
+    uint8_t *slots;  // window records in the fdistdump layout
+    xchg_rec_size_t rec_size;
+    size_t first_offset;  // offset of the first timestamp in the record
+
+    int mpi_tag;  // tag of the stream
+    bool buff_idx;
+    size_t buff_off;
+    struct xchg_comm_msg msg;
+    uint64_t first_last;  // first timestamp of the last sent record
+    uint64_t sent_cnt;
+    uint64_t late_cnt;
+};
+
+
+static struct time_order *
+time_order_init(const size_t window, const int mpi_tag)
+{
+    assert(window > 0);
+    assert(args->fields.sort_key.field
+           && args->fields.sort_key.field->id == LNF_FLD_FIRST);
+
+    struct time_order *const to = calloc(1, sizeof (*to));
+    ABORT_IF(!to, E_MEM, "time order context allocation failed");
+    to->window = window;
+    to->rec_size = args->fields.all_sizes_sum;
+    assert(sizeof (to->rec_size) + to->rec_size <= XCHG_STREAM_BUFF_SIZE);
+    to->heap = calloc(window, sizeof (*to->heap));
+    to->slots = malloc(window * to->rec_size);
+    ABORT_IF(!to->heap || !to->slots, E_MEM,
+             "time order window allocation failed");
+
+    for (size_t i = 0; args->fields.all[i].id != LNF_FLD_FIRST; ++i) {
+        to->first_offset += args->fields.all[i].size;
+    }
+    to->mpi_tag = mpi_tag;
+    xchg_comm_msg_init(&to->msg);
+
+    return to;
+}
+
+static void
+time_order_free(struct time_order *const to)
+{
+    assert(to);
+
+    free(to->slots);
+    free(to->heap);
+    free(to);
+}
+
+/**
+ * @brief Return true if the stream already contains rec_limit records.
+ */
+static inline bool
+time_order_done(const struct time_order *const to)
+{
+    return args->rec_limit && to->sent_cnt >= args->rec_limit;
+}
+
+static void
+time_order_sift_up(struct time_order *const to, size_t i)
+{
+    while (i > 0) {
+        const size_t parent = (i - 1) / 2;
+        if (to->heap[parent].first <= to->heap[i].first) {
+            break;
+        }
+        const struct time_order_entry tmp = to->heap[i];
+        to->heap[i] = to->heap[parent];
+        to->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void
+time_order_sift_down(struct time_order *const to, size_t i)
+{
+    while (true) {
+        const size_t left = 2 * i + 1;
+        const size_t right = left + 1;
+        size_t oldest = i;
+        if (left < to->cnt && to->heap[left].first < to->heap[oldest].first) {
+            oldest = left;
+        }
+        if (right < to->cnt && to->heap[right].first < to->heap[oldest].first) {
+            oldest = right;
+        }
+        if (oldest == i) {
+            break;
+        }
+        const struct time_order_entry tmp = to->heap[i];
+        to->heap[i] = to->heap[oldest];
+        to->heap[oldest] = tmp;
+        i = oldest;
+    }
+}
+
+/**
+ * @brief Append the record to the stream, send the buffer if it is full.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ */
+static void
+time_order_send(struct time_order *const to, struct thread_ctx *const t_ctx,
+                const uint8_t *const rec, const uint64_t first)
+{
+    if (first < to->first_last) {
+        to->late_cnt++;
+    } else {
+        to->first_last = first;
+    }
+
+    size_t written = xchg_rec_put(t_ctx->buff[to->buff_idx] + to->buff_off,
+                                  XCHG_STREAM_BUFF_SIZE - to->buff_off, rec,
+                                  to->rec_size);
+    if (written == 0) {  // the buffer is full, send it
+        xchg_comm_wait(&to->msg);
+        xchg_comm_send(&to->msg, t_ctx->buff[to->buff_idx], to->buff_off,
+                       ROOT_PROC, to->mpi_tag, mpi_comm_main, false);
+        to->buff_off = 0;
+        to->buff_idx = !to->buff_idx;
+
+        written = xchg_rec_put(t_ctx->buff[to->buff_idx],
+                               XCHG_STREAM_BUFF_SIZE, rec, to->rec_size);
+        assert(written != 0);
+    }
+    to->buff_off += written;
+    to->sent_cnt++;
+}
+
+/**
+ * @brief Insert the record into the window, HOT PATH!
+ *
+ * If the window is full, the oldest of its records and the new record is
+ * sent.
+ */
+static void
+time_order_push(struct time_order *const to, struct thread_ctx *const t_ctx,
+                const uint8_t *const rec)
+{
+    assert(to && t_ctx && rec && !time_order_done(to));
+
+    uint64_t first;
+    memcpy(&first, rec + to->first_offset, sizeof (first));
+
+    if (to->cnt < to->window) {  // not full yet, append the record
+        const size_t i = to->cnt++;
+        to->heap[i].first = first;
+        to->heap[i].slot = i;
+        memcpy(to->slots + i * to->rec_size, rec, to->rec_size);
+        time_order_sift_up(to, i);
+    } else if (first <= to->heap[0].first) {  // the new record is the oldest
+        time_order_send(to, t_ctx, rec, first);
+    } else {  // send the oldest record and reuse its slot
+        uint8_t *const slot = to->slots + to->heap[0].slot * to->rec_size;
+        time_order_send(to, t_ctx, slot, to->heap[0].first);
+        memcpy(slot, rec, to->rec_size);
+        to->heap[0].first = first;
+        time_order_sift_down(to, 0);
+    }
+}
+
+/**
+ * @brief Send the rest of the window in order and terminate the stream.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ */
+static void
+time_order_finish(struct time_order *const to, struct thread_ctx *const t_ctx)
+{
+    assert(to && t_ctx);
+
+    while (to->cnt > 0 && !time_order_done(to)) {
+        time_order_send(to, t_ctx, to->slots + to->heap[0].slot * to->rec_size,
+                        to->heap[0].first);
+        to->heap[0] = to->heap[--to->cnt];
+        time_order_sift_down(to, 0);
+    }
+
+    // send the remaining records if the buffer is not empty
+    if (to->buff_off != 0) {
+        xchg_comm_wait(&to->msg);
+        xchg_comm_send(&to->msg, t_ctx->buff[to->buff_idx], to->buff_off,
+                       ROOT_PROC, to->mpi_tag, mpi_comm_main, false);
+    }
+    xchg_comm_wait(&to->msg);
+
+    xchg_send_terminator(ROOT_PROC, to->mpi_tag);
+    DEBUG("time order: sent %" PRIu64 " record(s), %" PRIu64
+          " of them late, with tag %d", to->sent_cnt, to->late_cnt,
+          to->mpi_tag);
+    if (to->late_cnt > 0) {
+        WARNING(E_ARG, "time order: %" PRIu64 " record(s) were out of order "
+                "more than the window of %zu record(s) and are listed late, "
+                "increase --time-ordered", to->late_cnt, to->window);
+    }
+}
+/**
+ * @}
+ */  // slave_time_order
 
 static void
 thread_ctx_init(struct thread_ctx *const t_ctx)
@@ -164,8 +690,8 @@ thread_ctx_init(struct thread_ctx *const t_ctx)
     ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_rec_init()");
 
     // allocate two new data buffers for the records storage.
-    t_ctx->buff[0] = malloc(XCHG_BUFF_SIZE * sizeof (*t_ctx->buff[0]));
-    t_ctx->buff[1] = malloc(XCHG_BUFF_SIZE * sizeof (*t_ctx->buff[1]));
+    t_ctx->buff[0] = malloc(xchg_get_buff_size() * sizeof (*t_ctx->buff[0]));
+    t_ctx->buff[1] = malloc(xchg_get_buff_size() * sizeof (*t_ctx->buff[1]));
     ABORT_IF(!t_ctx->buff[0] || !t_ctx->buff[1], E_MEM,
              "thread record buffer allocation failed");
 
@@ -174,16 +700,34 @@ thread_ctx_init(struct thread_ctx *const t_ctx)
     switch (args->working_mode) {
     case MODE_LIST:
         // no storage required, everything will be sent while reading
+        if (args->time_order_window) {
+            // except for the reorder window, each thread sends its stream
+            t_ctx->time_order = time_order_init(args->time_order_window,
+                TAG_SORT_STREAM + omp_get_thread_num());
+        }
         break;
 
     case MODE_SORT:
         // initialize the libnf sorting memory and set its parameters
         libnf_mem_init_list(&t_ctx->lnf_mem, &args->fields);
+        if (args->use_late_mat || (args->rec_limit
+                                   && args->rec_limit <= TOPK_LIMIT_MAX)) {
+            // only the first rec_limit records of each thread will be sent
+            t_ctx->topk = topk_init(args->rec_limit, &args->fields.sort_key,
+                                    args->use_late_mat);
+        }
         break;
 
     case MODE_AGGR:
         // initialize the libnf aggregation memory and set its parameters
         libnf_mem_init_ht(&t_ctx->lnf_mem, &args->fields);
+        if (args->mem_budget) {
+            // the budget is shared equally by all threads
+            const size_t thread_budget =
+                MAX(args->mem_budget / omp_get_num_threads(), 1);
+            t_ctx->spill = spill_init(args->spill_dir, &args->fields,
+                                      thread_budget);
+        }
         break;
 
     case MODE_META:
@@ -197,6 +741,23 @@ thread_ctx_init(struct thread_ctx *const t_ctx)
     }
 }
 
+/**
+ * @brief Return the ring of the send buffers, allocate it on the first use.
+ *
+ * Only some of the threads send a record stream (e.g., only one thread of
+ * each slave sends the aggregated records), so the ring is allocated lazily.
+ */
+static struct xchg_ring *
+thread_ring(struct thread_ctx *const t_ctx)
+{
+    assert(t_ctx);
+
+    if (!t_ctx->ring.buff) {
+        xchg_ring_init(&t_ctx->ring, args->xchg_ring_size);
+    }
+    return &t_ctx->ring;
+}
+
 static void
 thread_ctx_free(struct thread_ctx *const t_ctx)
 {
@@ -216,10 +777,20 @@ thread_ctx_free(struct thread_ctx *const t_ctx)
     // free the thread-local record storage buffers
     free(t_ctx->buff[0]);
     free(t_ctx->buff[1]);
+    xchg_ring_free(&t_ctx->ring);
 
     if (t_ctx->lnf_mem) {
         libnf_mem_free(t_ctx->lnf_mem);
     }
+    if (t_ctx->spill) {
+        spill_free(t_ctx->spill);
+    }
+    if (t_ctx->time_order) {
+        time_order_free(t_ctx->time_order);
+    }
+    if (t_ctx->topk) {
+        topk_free(t_ctx->topk);
+    }
 }
 
 /**
@@ -403,60 +974,357 @@ metadata_summ_share(struct metadata_summ *shared,
 
 
 /**
- * @brief TODO
+ * @defgroup slave_funnel MPI calls of the worker threads.
  *
- * Read all records from the file. No aggregation is performed, records are only
- * saved into the record buffer. When the buffer is full, it is sent towards the
- * master.
+ * With the communication thread (--comm-thread), the process may have only
+ * MPI_THREAD_FUNNELED, so the worker threads must not call MPI. Each wrapper
+ * below packs the arguments of its MPI call and lets the communication thread
+ * make it (see xchg_comm_call()), the calling thread waits for the call to
+ * complete. Without the communication thread, MPI is called directly.
+ *
+ * The collectives over mpi_comm_slaves are called by one thread of each slave
+ * at a time, so their order is the same on all slaves.
+ *
+ * @{
+ */
+// arguments of a funneled MPI call
+struct funnel_args {
+    const void *send_buff;
+    void *recv_buff;
+    int count;
+    const int *send_cnts;
+    const int *send_displs;
+    const int *recv_cnts;
+    const int *recv_displs;
+    MPI_Datatype type;
+    MPI_Op op;
+    MPI_Comm comm;
+    int result;
+};
+
+
+/**
+ * @brief Make the call by the communication thread and wait for it.
  */
 static void
-ff_read_and_send(const char *ff_path, struct slave_ctx *s_ctx,
-                   struct thread_ctx *t_ctx, int mpi_tag)
+funnel(const xchg_comm_call_t call, struct funnel_args *const fa)
 {
-    assert(ff_path && s_ctx && t_ctx);
+    struct xchg_comm_msg msg;
+    xchg_comm_msg_init(&msg);
+    xchg_comm_call(&msg, call, fa);
+    xchg_comm_wait(&msg);
+}
 
+static void
+funnel_bcast_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Bcast(fa->recv_buff, fa->count, fa->type, ROOT_PROC, mpi_comm_main);
+}
 
-    // loop through all records, HOT PATH!
-    const xchg_rec_size_t rec_size = args->fields.all_sizes_sum;
-    size_t file_rec_cntr = 0;
-    size_t file_proc_rec_cntr = 0;
-    bool buff_idx = 0; //index to the currently used data buffer
-    size_t buff_off = 0; //current data buffer offset
-    size_t buff_rec_cntr = 0; //number of records in the current buffer
-    MPI_Request request = MPI_REQUEST_NULL;
-    int lnf_ret;
-    while ((lnf_ret = lnf_read(t_ctx->lnf_file, t_ctx->lnf_rec)) == LNF_OK) {
-        file_rec_cntr++;
+/**
+ * @brief MPI_Bcast() from the master over mpi_comm_main.
+ */
+static void
+funnel_bcast(void *const buff, const int count, const MPI_Datatype type)
+{
+    struct funnel_args fa = { .recv_buff = buff, .count = count,
+                              .type = type };
+    funnel(funnel_bcast_call, &fa);
+}
 
-        // try to match the filter (if there is one)
-        if (t_ctx->lnf_filter && !lnf_filter_match(t_ctx->lnf_filter,
-                                                   t_ctx->lnf_rec))
-        {
-            continue;
-        }
-        file_proc_rec_cntr++;
+static void
+funnel_allreduce_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Allreduce(fa->send_buff, fa->recv_buff, fa->count, fa->type, fa->op,
+                  mpi_comm_slaves);
+}
 
-        // check if there is enough space in the buffer for the next record
-        if (buff_off + rec_size + sizeof (rec_size) > XCHG_BUFF_SIZE) {
-            // break if the record limit has been reached by ANOTHER thread
-            #pragma omp flush
-            if (s_ctx->rec_limit_reached) {
-                buff_rec_cntr = 0;
-                break;
-            }
+/**
+ * @brief MPI_Allreduce() over mpi_comm_slaves.
+ */
+static void
+funnel_allreduce(const void *const send_buff, void *const recv_buff,
+                 const int count, const MPI_Datatype type, const MPI_Op op)
+{
+    struct funnel_args fa = { .send_buff = send_buff, .recv_buff = recv_buff,
+                              .count = count, .type = type, .op = op };
+    funnel(funnel_allreduce_call, &fa);
+}
 
-            MPI_Wait(&request, MPI_STATUS_IGNORE);
-            MPI_Isend(t_ctx->buff[buff_idx], buff_off, MPI_BYTE, ROOT_PROC,
-                      mpi_tag, mpi_comm_main, &request);
+static void
+funnel_alltoall_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Alltoall(fa->send_buff, 1, MPI_INT, fa->recv_buff, 1, MPI_INT,
+                 mpi_comm_slaves);
+}
 
-            // increment the thread-shared counter of processed records
-            #pragma omp atomic
-            s_ctx->proc_rec_cntr += buff_rec_cntr;
+/**
+ * @brief MPI_Alltoall() of one integer over mpi_comm_slaves.
+ */
+static void
+funnel_alltoall_int(const int send_vals[], int recv_vals[])
+{
+    struct funnel_args fa = { .send_buff = send_vals, .recv_buff = recv_vals };
+    funnel(funnel_alltoall_call, &fa);
+}
 
-            // clear the buffer context variables and toggle the buffers
-            buff_off = 0;
-            buff_rec_cntr = 0;
-            buff_idx = !buff_idx;
+static void
+funnel_alltoallv_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Alltoallv(fa->send_buff, fa->send_cnts, fa->send_displs, MPI_BYTE,
+                  fa->recv_buff, fa->recv_cnts, fa->recv_displs, MPI_BYTE,
+                  mpi_comm_slaves);
+}
+
+/**
+ * @brief MPI_Alltoallv() of bytes over mpi_comm_slaves.
+ */
+static void
+funnel_alltoallv(const void *const send_buff, const int send_cnts[],
+                 const int send_displs[], void *const recv_buff,
+                 const int recv_cnts[], const int recv_displs[])
+{
+    struct funnel_args fa = {
+        .send_buff = send_buff,
+        .send_cnts = send_cnts,
+        .send_displs = send_displs,
+        .recv_buff = recv_buff,
+        .recv_cnts = recv_cnts,
+        .recv_displs = recv_displs,
+    };
+    funnel(funnel_alltoallv_call, &fa);
+}
+
+static void
+funnel_allgather_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Allgather(fa->send_buff, 1, MPI_INT, fa->recv_buff, 1, MPI_INT,
+                  mpi_comm_slaves);
+}
+
+/**
+ * @brief MPI_Allgather() of one integer over mpi_comm_slaves.
+ */
+static void
+funnel_allgather_int(const int send_val, int recv_vals[])
+{
+    struct funnel_args fa = { .send_buff = &send_val, .recv_buff = recv_vals };
+    funnel(funnel_allgather_call, &fa);
+}
+
+static void
+funnel_allgatherv_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Allgatherv(fa->send_buff, fa->count, MPI_BYTE, fa->recv_buff,
+                   fa->recv_cnts, fa->recv_displs, MPI_BYTE, mpi_comm_slaves);
+}
+
+/**
+ * @brief MPI_Allgatherv() of bytes over mpi_comm_slaves.
+ */
+static void
+funnel_allgatherv(const void *const send_buff, const int send_cnt,
+                  void *const recv_buff, const int recv_cnts[],
+                  const int recv_displs[])
+{
+    struct funnel_args fa = {
+        .send_buff = send_buff,
+        .count = send_cnt,
+        .recv_buff = recv_buff,
+        .recv_cnts = recv_cnts,
+        .recv_displs = recv_displs,
+    };
+    funnel(funnel_allgatherv_call, &fa);
+}
+
+static void
+funnel_comm_size_call(void *const arg)
+{
+    struct funnel_args *const fa = arg;
+    MPI_Comm_size(fa->comm, &fa->result);
+}
+
+/**
+ * @brief MPI_Comm_size() of the communicator.
+ */
+static int
+funnel_comm_size(const MPI_Comm comm)
+{
+    struct funnel_args fa = { .comm = comm };
+    funnel(funnel_comm_size_call, &fa);
+    return fa.result;
+}
+/**
+ * @}
+ */  // slave_funnel
+
+
+/**
+ * @brief Test the receive of the master's TAG_CANCEL, set rec_limit_reached
+ *        if received.
+ *
+ * Called by the communication thread, if it is enabled (see cancel_check()).
+ */
+static void
+cancel_test(void *const arg)
+{
+    struct slave_ctx *const s_ctx = arg;
+
+    // the request is set to MPI_REQUEST_NULL when completed
+    if (s_ctx->cancel_request == MPI_REQUEST_NULL) {
+        return;
+    }
+    int cancelled;
+    MPI_Test(&s_ctx->cancel_request, &cancelled, MPI_STATUS_IGNORE);
+    if (cancelled) {
+        DEBUG("cancelled by the master");
+        s_ctx->rec_limit_reached = true;
+        #pragma omp flush
+    }
+}
+
+/**
+ * @brief Check if the listing was cancelled by the master or by the record
+ *        limit.
+ *
+ * The master sends TAG_CANCEL when it has enough records (see @ref
+ * master_list_cancel). Cancellation sets the rec_limit_reached flag, so all
+ * threads stop sending.
+ *
+ * The test of the cancellation is made by cancel_test(). With the
+ * communication thread, the test is only started if the previous one has
+ * completed and the threads do not wait for it, so the cancellation is
+ * noticed by a later check.
+ *
+ * @return True if no more records should be read.
+ */
+static bool
+cancel_check(struct slave_ctx *const s_ctx)
+{
+    #pragma omp flush  // to flush rec_limit_reached
+    if (s_ctx->rec_limit_reached) {
+        return true;
+    }
+
+    #pragma omp critical (cancel_request)
+    {
+        if (xchg_comm_test(&s_ctx->cancel_msg)) {
+            xchg_comm_call(&s_ctx->cancel_msg, cancel_test, s_ctx);
+        }
+    }
+
+    #pragma omp flush  // to flush rec_limit_reached
+    return s_ctx->rec_limit_reached;
+}
+
+/**
+ * @brief TODO
+ *
+ * Read all records from the file. No aggregation is performed, records are only
+ * saved into the record buffer. When the buffer is full, it is sent towards the
+ * master.
+ *
+ * With --slave-format, each record is sent formatted as a line of text instead
+ * (see format_stream_next()), so the master only writes it.
+ */
+static void
+ff_read_and_send(const char *ff_path, struct slave_ctx *s_ctx,
+                   struct thread_ctx *t_ctx, int mpi_tag)
+{
+    assert(ff_path && s_ctx && t_ctx);
+
+
+    // loop through all records, HOT PATH!
+    const xchg_rec_size_t rec_size = args->fields.all_sizes_sum;
+    uint8_t rec[rec_size];  // one record in the fdistdump layout
+    size_t file_rec_cntr = 0;
+    size_t file_proc_rec_cntr = 0;
+    struct xchg_ring *const ring = thread_ring(t_ctx);
+    uint8_t *buff = xchg_ring_buff(ring); //currently used data buffer
+    size_t buff_off = 0; //current data buffer offset
+    size_t buff_rec_cntr = 0; //number of records in the current buffer
+
+    // the formatted record (one line), only with --slave-format
+    const bool format = args->use_slave_format;
+    char text[format ? format_stream_size() : 1];
+
+    // the fixed-width layout may split the records into the fields
+    size_t col_sizes[args->fields.all_cnt];
+    size_t col_cnt = 0;
+    if (xchg_get_layout() == XCHG_LAYOUT_COLUMNS) {
+        assert(args->fields.all_cnt <= XCHG_FIXED_COLS_MAX);
+        for (; col_cnt < args->fields.all_cnt; ++col_cnt) {
+            col_sizes[col_cnt] = args->fields.all[col_cnt].size;
+        }
+    }
+    struct xchg_fixed fx_storage;
+    struct xchg_fixed *const fx =
+        (xchg_get_layout() == XCHG_LAYOUT_PREFIXED) ? NULL : &fx_storage;
+    if (fx) {
+        xchg_fixed_init(fx, buff, ring->buff_size, col_cnt, col_sizes);
+    }
+
+    int lnf_ret;
+    while ((lnf_ret = lnf_read(t_ctx->lnf_file, t_ctx->lnf_rec)) == LNF_OK) {
+        // abandon the file if the master does not need more records, also
+        // if the filter matches nothing
+        if (++file_rec_cntr % CANCEL_CHECK_INTERVAL == 0
+                && cancel_check(s_ctx)) {
+            buff_rec_cntr = 0;
+            break;
+        }
+
+        // try to match the filter (if there is one)
+        if (t_ctx->lnf_filter && !lnf_filter_match(t_ctx->lnf_filter,
+                                                   t_ctx->lnf_rec))
+        {
+            continue;
+        }
+        file_proc_rec_cntr++;
+
+        // loop through the fields in the record and fill the record buffer
+        size_t rec_off = 0;
+        for (size_t i = 0; i < args->fields.all_cnt; ++i) {
+            lnf_rec_fget(t_ctx->lnf_rec, args->fields.all[i].id,
+                         rec + rec_off);
+            rec_off += args->fields.all[i].size;
+        }
+        const uint8_t *const put = format ? (const uint8_t *)text : rec;
+        const size_t put_len = format ? format_stream_next(rec, text)
+            : rec_size;
+
+        // check if there is enough space in the buffer for the next record
+        const bool buff_full = fx
+            ? (fx->rec_cnt != 0 && fx->rec_cnt == fx->rec_cap)
+            : (buff_off + put_len + sizeof (rec_size) > ring->buff_size);
+        if (buff_full) {
+            // break if the record limit has been reached by ANOTHER thread
+            // or the master cancelled the listing
+            if (cancel_check(s_ctx)) {
+                buff_rec_cntr = 0;
+                break;
+            }
+
+            xchg_ring_send(ring, fx ? xchg_fixed_finish(fx) : buff_off,
+                           ROOT_PROC, mpi_tag);
+
+            // increment the thread-shared counter of processed records
+            #pragma omp atomic
+            s_ctx->proc_rec_cntr += buff_rec_cntr;
+
+            // clear the buffer context variables and move to the next buffer
+            buff = xchg_ring_buff(ring);
+            buff_off = 0;
+            buff_rec_cntr = 0;
+            if (fx) {
+                xchg_fixed_init(fx, buff, ring->buff_size, col_cnt, col_sizes);
+            }
 
             // break if the record limit has been reached by THIS thread
             if (args->rec_limit && s_ctx->proc_rec_cntr >= args->rec_limit) {
@@ -469,27 +1337,20 @@ ff_read_and_send(const char *ff_path, struct slave_ctx *s_ctx,
         // update the thread-private processed summary counters
         processed_summ_update(&t_ctx->processed_summ, t_ctx->lnf_rec);
 
-        // write the 4 byte long record size before each record
-        xchg_rec_size_t *const rec_size_ptr =
-            (xchg_rec_size_t *)(t_ctx->buff[buff_idx] + buff_off);
-        *rec_size_ptr = rec_size;
-        buff_off += sizeof (rec_size);
-
-        // loop through the fields in the record and fill the data buffer
-        for (size_t i = 0; i < args->fields.all_cnt; ++i) {
-            lnf_rec_fget(t_ctx->lnf_rec, args->fields.all[i].id,
-                         t_ctx->buff[buff_idx] + buff_off);
-            buff_off += args->fields.all[i].size;
-        }
+        // write the record (with its 4 byte long size) into the data buffer
+        const size_t written = fx ? xchg_fixed_put(fx, rec, rec_size)
+            : xchg_rec_put(buff + buff_off, ring->buff_size - buff_off, put,
+                           put_len);
+        assert(written != 0);
+        buff_off += written;
 
         buff_rec_cntr++;
     }
 
     // send the remaining records if the record buffer is not empty
     if (buff_rec_cntr != 0) {
-        MPI_Wait(&request, MPI_STATUS_IGNORE);
-        MPI_Isend(t_ctx->buff[buff_idx], buff_off, MPI_BYTE, ROOT_PROC, mpi_tag,
-                mpi_comm_main, &request);
+        xchg_ring_send(ring, fx ? xchg_fixed_finish(fx) : buff_off, ROOT_PROC,
+                       mpi_tag);
 
         // increment the thread-shared counter of processed records
         #pragma omp atomic
@@ -500,17 +1361,234 @@ ff_read_and_send(const char *ff_path, struct slave_ctx *s_ctx,
     if (args->rec_limit && s_ctx->proc_rec_cntr >= args->rec_limit) {
         s_ctx->rec_limit_reached = true;
         #pragma omp flush
-    } else if (lnf_ret != LNF_EOF) {
+    } else if (lnf_ret != LNF_EOF && !s_ctx->rec_limit_reached) {
         WARNING(E_LNF, "`%s': EOF was not reached", ff_path);
     }
 
-    // the buffers will be invalid after return, wait for the send to complete
-    MPI_Wait(&request, MPI_STATUS_IGNORE);
-    assert(request == MPI_REQUEST_NULL);
+    DEBUG("`%s': read %zu records, processed %zu records", ff_path,
+          file_rec_cntr, file_proc_rec_cntr);
+}
+
+/**
+ * @defgroup slave_shards Direct output of the listed records into shards.
+ *
+ * With --output-dir, each slave thread formats its records (as with
+ * --slave-format) and writes them into its own shard file in the output
+ * directory, nothing is sent to the master. The shard is created with the
+ * first record written by the thread, so a thread without any matching record
+ * leaves no (empty) shard. The record counts of all shards are gathered by the
+ * master, which writes the manifest (see shard_main()).
+ *
+ * @{
+ */
+/**
+ * @brief Create the output shard of the calling thread.
+ */
+static void
+shard_open(const struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
+{
+    assert(s_ctx && t_ctx && !t_ctx->shard);
+
+    char name[MAX_STR_LEN];
+    output_shard_name(name, sizeof (name), s_ctx->rank, omp_get_thread_num());
+    char path[MAX_STR_LEN];
+    const int ret = snprintf(path, sizeof (path), "%s/%s", args->output_dir,
+                             name);
+    ABORT_IF(ret < 0 || (size_t)ret >= sizeof (path), E_ARG,
+             "output directory path `%s' is too long", args->output_dir);
+
+    t_ctx->shard = fopen(path, "w");
+    ABORT_IF(!t_ctx->shard, E_ARG, "`%s': unable to create the output shard: %s",
+             path, strerror(errno));
+    ABORT_IF(setvbuf(t_ctx->shard, NULL, _IOFBF, SHARD_BUFF_SIZE) != 0,
+             E_INTERNAL, "setvbuf(): %s", strerror(errno));
+}
+
+/**
+ * @brief Close the output shard of the calling thread, store its record count.
+ */
+static void
+shard_close(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
+{
+    assert(s_ctx && t_ctx && t_ctx->shard);
+
+    ABORT_IF(fclose(t_ctx->shard) != 0, E_INTERNAL,
+             "output shard write failed: %s", strerror(errno));
+    t_ctx->shard = NULL;
+    s_ctx->shard_rec_cnts[omp_get_thread_num()] = t_ctx->shard_rec_cntr;
+    DEBUG("wrote %" PRIu64 " record(s) into the output shard",
+          t_ctx->shard_rec_cntr);
+}
+
+/**
+ * @brief Read all records from the file and write them into the shard.
+ *
+ * Records are formatted as lines of text (see format_stream_next()).
+ */
+static void
+ff_read_and_write(const char *ff_path, struct slave_ctx *s_ctx,
+                  struct thread_ctx *t_ctx)
+{
+    assert(ff_path && s_ctx && t_ctx);
+
+    // loop through all records, HOT PATH!
+    uint8_t rec[args->fields.all_sizes_sum];  // the fdistdump layout
+    char text[format_stream_size()];
+    size_t file_rec_cntr = 0;
+    size_t file_proc_rec_cntr = 0;
+    int lnf_ret;
+    while ((lnf_ret = lnf_read(t_ctx->lnf_file, t_ctx->lnf_rec)) == LNF_OK) {
+        file_rec_cntr++;
+
+        // try to match the filter (if there is one)
+        if (t_ctx->lnf_filter && !lnf_filter_match(t_ctx->lnf_filter,
+                                                   t_ctx->lnf_rec))
+        {
+            continue;
+        }
+        file_proc_rec_cntr++;
+
+        // update the thread-private processed summary counters
+        processed_summ_update(&t_ctx->processed_summ, t_ctx->lnf_rec);
+
+        // loop through the fields in the record and fill the record buffer
+        size_t rec_off = 0;
+        for (size_t i = 0; i < args->fields.all_cnt; ++i) {
+            lnf_rec_fget(t_ctx->lnf_rec, args->fields.all[i].id,
+                         rec + rec_off);
+            rec_off += args->fields.all[i].size;
+        }
+
+        const size_t text_len = format_stream_next(rec, text);
+        if (!t_ctx->shard) {
+            shard_open(s_ctx, t_ctx);  // with the first written record
+        }
+        ABORT_IF(fwrite(text, text_len, 1, t_ctx->shard) != 1, E_INTERNAL,
+                 "output shard write failed: %s", strerror(errno));
+    }
+    t_ctx->shard_rec_cntr += file_proc_rec_cntr;
+
+    if (lnf_ret != LNF_EOF) {
+        WARNING(E_LNF, "`%s': EOF was not reached", ff_path);
+    }
 
     DEBUG("`%s': read %zu records, processed %zu records", ff_path,
           file_rec_cntr, file_proc_rec_cntr);
 }
+/**
+ * @}
+ */  // slave_shards
+
+/**
+ * @brief Put the passthrough record into the ring buffer, send it if full.
+ *
+ * The record is an uncompacted prefixed record: the passthrough record header
+ * followed by the payload of the given size. The payload is not copied, its
+ * location in the buffer is returned and the caller has to fill it in.
+ */
+static uint8_t *
+passthrough_rec_put(struct xchg_ring *const ring, uint8_t **const buff,
+                    size_t *const buff_off, const struct nfblock_rec_hdr *rh,
+                    const size_t payload_size)
+{
+    const xchg_rec_size_t rec_size = sizeof (*rh) + payload_size;
+    const size_t written = sizeof (rec_size) + rec_size;
+    assert(written <= ring->buff_size);
+
+    if (*buff_off + written > ring->buff_size) {  // the buffer is full
+        xchg_ring_send(ring, *buff_off, ROOT_PROC, TAG_LIST);
+        *buff = xchg_ring_buff(ring);
+        *buff_off = 0;
+    }
+
+    uint8_t *const rec = *buff + *buff_off;
+    memcpy(rec, &rec_size, sizeof (rec_size));
+    memcpy(rec + sizeof (rec_size), rh, sizeof (*rh));
+    *buff_off += written;
+
+    return rec + sizeof (rec_size) + sizeof (*rh);
+}
+
+/**
+ * @brief Forward the data blocks of the file unchanged (see @ref nfblock.c).
+ *
+ * The records are not decoded. Each data block is sent as one record read
+ * straight into the send buffer, tagged by the file identifier (the slave
+ * rank and a per-slave file counter) and the index of the block. The file
+ * header and statistics are sent last with the number of blocks, so the
+ * master knows when the file is complete. Processed summary counters are
+ * taken from the file statistics.
+ */
+static void
+ff_passthrough(const char *ff_path, struct slave_ctx *s_ctx,
+               struct thread_ctx *t_ctx)
+{
+    struct nfblock_file nf;
+    if (!nfblock_open(&nf, ff_path)) {
+        return;
+    }
+
+    uint32_t file_idx;
+    #pragma omp atomic capture
+    file_idx = s_ctx->passthrough_file_cntr++;
+    struct nfblock_rec_hdr rh = {
+        .kind = NFBLOCK_REC_BLOCK,
+        .file_id = (uint64_t)s_ctx->rank << 32 | file_idx,
+    };
+
+    struct xchg_ring *const ring = thread_ring(t_ctx);
+    uint8_t *buff = xchg_ring_buff(ring);
+    size_t buff_off = 0;
+
+    // the largest block data fitting into the buffer as one record
+    const size_t rec_overhead = sizeof (xchg_rec_size_t) + sizeof (rh)
+        + sizeof (struct nfblock_hdr);
+    assert(ring->buff_size > rec_overhead);
+    const size_t block_size_max = ring->buff_size - rec_overhead;
+
+    // the data blocks, other blocks (e.g., appendices) are skipped
+    struct nfblock_hdr bh;
+    while (nfblock_read_hdr(&nf, &bh)) {
+        if (bh.type != NFBLOCK_TYPE_DATA) {
+            if (!nfblock_read_data(&nf, NULL, bh.size)) {
+                break;
+            }
+            continue;
+        }
+
+        // bh.size comes from the file, check it before any arithmetic
+        ABORT_IF(bh.size > block_size_max, E_ARG,
+                 "`%s': data block of %" PRIu32 " B does not fit into the exchange buffer, see --xchg-buff-size",
+                 ff_path, bh.size);
+        uint8_t *const payload = passthrough_rec_put(ring, &buff, &buff_off,
+                                                     &rh, sizeof (bh)
+                                                     + (size_t)bh.size);
+        memcpy(payload, &bh, sizeof (bh));
+        if (!nfblock_read_data(&nf, payload + sizeof (bh), bh.size)) {
+            // drop the incomplete block, the file ends before it
+            buff_off -= sizeof (xchg_rec_size_t) + sizeof (rh) + sizeof (bh)
+                + bh.size;
+            break;
+        }
+        rh.seq++;
+    }
+
+    // the file header and the statistics with the number of blocks
+    const uint64_t block_cntr = rh.seq;
+    rh.kind = NFBLOCK_REC_FILE;
+    uint8_t *const payload = passthrough_rec_put(ring, &buff, &buff_off, &rh,
+                                                 sizeof (nf.hdr)
+                                                 + sizeof (nf.stat));
+    memcpy(payload, &nf.hdr, sizeof (nf.hdr));
+    memcpy(payload + sizeof (nf.hdr), &nf.stat, sizeof (nf.stat));
+    xchg_ring_send(ring, buff_off, ROOT_PROC, TAG_LIST);
+    nfblock_close(&nf);
+
+    t_ctx->processed_summ.flows += nf.stat.flows;
+    t_ctx->processed_summ.pkts += nf.stat.pkts;
+    t_ctx->processed_summ.bytes += nf.stat.bytes;
+    DEBUG("`%s': forwarded %" PRIu64 " data block(s)", ff_path, block_cntr);
+}
 
 /**
  * @brief TODO
@@ -524,6 +1602,10 @@ ff_read_and_store(const char *ff_path, struct thread_ctx *t_ctx)
 {
     assert(ff_path && t_ctx);
 
+    if (t_ctx->topk && t_ctx->topk->late_mat) {
+        topk_add_file(t_ctx->topk, ff_path);  // records will be re-read
+    }
+
     // loop through all records, HOT PATH!
     int lnf_ret;
     size_t file_rec_cntr = 0;
@@ -541,9 +1623,20 @@ ff_read_and_store(const char *ff_path, struct thread_ctx *t_ctx)
         // update the thread-private processed summary counters
         processed_summ_update(&t_ctx->processed_summ, t_ctx->lnf_rec);
 
+        // keep the record only if it is among the first rec_limit records
+        if (t_ctx->topk) {
+            topk_insert(t_ctx->topk, t_ctx->lnf_rec, file_rec_cntr - 1);
+            continue;
+        }
+
         // write the record into the libnf memory (a hash table)
         lnf_ret = lnf_mem_write(t_ctx->lnf_mem, t_ctx->lnf_rec);
         ABORT_IF(lnf_ret != LNF_OK, E_LNF, "`%s': lnf_mem_write()", ff_path);
+
+        // spill the memory to disk if it exceeds the budget
+        if (t_ctx->spill) {
+            spill_account(t_ctx->spill, &t_ctx->lnf_mem);
+        }
     }
     if (lnf_ret != LNF_EOF) {
         WARNING(E_LNF, "`%s': EOF was not reached", ff_path);
@@ -553,97 +1646,51 @@ ff_read_and_store(const char *ff_path, struct thread_ctx *t_ctx)
           file_rec_cntr, file_proc_rec_cntr);
 }
 
-
-static void
-send_terminator(const int mpi_tag)
-{
-    MPI_Send(NULL, 0, MPI_BYTE, ROOT_PROC, mpi_tag, mpi_comm_main);
-}
-
 /**
- * @brief TODO
+ * @brief Read all records from the file into the time order window.
  *
- * Terminator is included.
- *
- * This function is not thread-safe without MPI_THREAD_MULTIPLE.
- *
- * @param lnf_mem
- * @param rec_limit
- * @param mpi_tag
- * @param buff
- * @param buff_size
+ * See @ref slave_time_order. Reading stops when the stream contains rec_limit
+ * records.
  */
 static void
-send_raw_mem(lnf_mem_t *const lnf_mem, size_t rec_limit, int mpi_tag,
-             uint8_t *const buff[2], const size_t buff_size)
+ff_read_and_stream(const char *ff_path, struct thread_ctx *t_ctx)
 {
-    assert(lnf_mem && buff && buff[0] && buff[1]
-           && buff_size >= sizeof (xchg_rec_size_t) + LNF_MAX_RAW_LEN);
+    assert(ff_path && t_ctx && t_ctx->time_order);
 
-    // zero record limit means send all records
-    if (rec_limit == 0) {
-        rec_limit = SIZE_MAX;
-    }
-
-    // initialize the cursor to point to the first record in the memory
-    lnf_mem_cursor_t *cursor;
-    int lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
+    // loop through all records, HOT PATH!
+    uint8_t rec[t_ctx->time_order->rec_size];  // in the fdistdump layout
+    int lnf_ret = LNF_OK;
+    size_t file_rec_cntr = 0;
+    size_t file_proc_rec_cntr = 0;
+    while (!time_order_done(t_ctx->time_order)
+            && (lnf_ret = lnf_read(t_ctx->lnf_file, t_ctx->lnf_rec)) == LNF_OK)
+    {
+        file_rec_cntr++;
 
-    // loop throught all records
-    bool buff_idx = 0;        // currently used data buffer index
-    size_t buff_off = 0;      // data buffer offset
-    size_t buff_rec_cntr = 0; // number of records in current buffer
-    size_t rec_cntr = 0;
-    MPI_Request request = MPI_REQUEST_NULL;
-    while (cursor && rec_limit > rec_cntr) {
-        // read another record, write it into the record buffer
-        // write the 4 byte long record size before the record
-        xchg_rec_size_t *const rec_size_ptr =
-            (xchg_rec_size_t *)(buff[buff_idx] + buff_off);
-        char *const rec_data_ptr =
-            (char *)rec_size_ptr + sizeof (xchg_rec_size_t);
-        const size_t buff_remaining =
-            buff_size - buff_off - sizeof (xchg_rec_size_t);
-
-        lnf_ret = lnf_mem_read_raw_c(lnf_mem, cursor, rec_data_ptr,
-                                     (int *)rec_size_ptr, buff_remaining);
-        assert(lnf_ret != LNF_EOF);
-
-        // was in the buffer enough space for the record?
-        if (lnf_ret != LNF_ERR_NOMEM) {  // yes
-            buff_off += sizeof (xchg_rec_size_t) + *rec_size_ptr;
-            buff_rec_cntr++;
-            rec_cntr++;
+        // try to match the filter (if there is one)
+        if (t_ctx->lnf_filter && !lnf_filter_match(t_ctx->lnf_filter,
+                                                   t_ctx->lnf_rec)) {
+            continue;
+        }
+        file_proc_rec_cntr++;
 
-            // move the cursor to the next record
-            lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
-        } else {  // no, send the full buffer
-            MPI_Wait(&request, MPI_STATUS_IGNORE);
-            MPI_Isend(buff[buff_idx], buff_off, MPI_BYTE, ROOT_PROC, mpi_tag,
-                      mpi_comm_main, &request);
+        // update the thread-private processed summary counters
+        processed_summ_update(&t_ctx->processed_summ, t_ctx->lnf_rec);
 
-            // clear the buffer context variables and toggle the buffers
-            buff_off = 0;
-            buff_rec_cntr = 0;
-            buff_idx = !buff_idx;
+        // convert the record into the fdistdump layout
+        size_t rec_off = 0;
+        for (size_t i = 0; i < args->fields.all_cnt; ++i) {
+            lnf_rec_fget(t_ctx->lnf_rec, args->fields.all[i].id, rec + rec_off);
+            rec_off += args->fields.all[i].size;
         }
+        time_order_push(t_ctx->time_order, t_ctx, rec);
     }
-    ABORT_IF(rec_limit == SIZE_MAX && lnf_ret != LNF_EOF, E_LNF,
-             "lnf_mem_next_c() or lnf_mem_first_c() failed");
-
-    // send the remaining records if the record buffer is not empty
-    if (buff_rec_cntr != 0) {
-        MPI_Wait(&request, MPI_STATUS_IGNORE);
-        MPI_Isend(buff[buff_idx], buff_off, MPI_BYTE, ROOT_PROC, mpi_tag,
-                  mpi_comm_main, &request);
+    if (!time_order_done(t_ctx->time_order) && lnf_ret != LNF_EOF) {
+        WARNING(E_LNF, "`%s': EOF was not reached", ff_path);
     }
 
-    // the buffers will be invalid after return, wait for the send to complete
-    MPI_Wait(&request, MPI_STATUS_IGNORE);
-    assert(request == MPI_REQUEST_NULL);
-
-    send_terminator(mpi_tag);
-    DEBUG("send_raw_mem: sent %zu record(s) with tag %d", rec_cntr, mpi_tag);
+    DEBUG("`%s': read %zu records, processed %zu records", ff_path,
+          file_rec_cntr, file_proc_rec_cntr);
 }
 
 
@@ -670,7 +1717,8 @@ progress_report_init(uint64_t files_cnt)
 /**
  * @brief TODO
  *
- * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
  *
  */
 static void
@@ -678,7 +1726,11 @@ progress_report_next(void)
 {
     assert(mpi_comm_progress != MPI_COMM_NULL);
 
-    MPI_Send(NULL, 0, MPI_BYTE, ROOT_PROC, TAG_PROGRESS, mpi_comm_progress);
+    struct xchg_comm_msg msg;
+    xchg_comm_msg_init(&msg);
+    xchg_comm_send(&msg, NULL, 0, ROOT_PROC, TAG_PROGRESS, mpi_comm_progress,
+                   false);
+    xchg_comm_wait(&msg);
 }
 /**
  * @}
@@ -702,8 +1754,8 @@ tput_phase_1(struct thread_ctx *const t_ctx)
     assert(t_ctx);
 
     // send the top N items from the sorted list
-    send_raw_mem(t_ctx->lnf_mem, args->rec_limit, TAG_TPUT1, t_ctx->buff,
-                 XCHG_BUFF_SIZE);
+    xchg_send_raw_mem(t_ctx->lnf_mem, args->rec_limit, ROOT_PROC, TAG_TPUT1,
+                      thread_ring(t_ctx));
 
     DEBUG("slave TPUT phase 1: done");
 }
@@ -777,10 +1829,8 @@ tput_phase_2_find_threshold_cnt(lnf_mem_t *lnf_mem, const uint64_t threshold,
  * list of records satisfying the received threshold
  * (see @ref tput_phase_2_find_threshold_cnt).
  *
- * This function is not thread-safe without MPI_THREAD_MULTIPLE.
- * It is incorrect to start multiple collective communications on the same
- * communicator in same time -- that is why every MPI collective function is in
- * a OpenMP single construct.
+ * Only one thread per slave (the one holding the merged libnf memory) takes
+ * part in the TPUT algorithm.
  *
  * @param[in] s_ctx Thread-shared context.
  * @param[in] t_ctx Thread-local context.
@@ -790,12 +1840,8 @@ tput_phase_2(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
 {
     assert(s_ctx && t_ctx);
 
-    #pragma omp single
-    {
-        MPI_Bcast(&s_ctx->tput_threshold, 1, MPI_UINT64_T, ROOT_PROC,
-                  mpi_comm_main);
-        DEBUG("have threshold %" PRIu64, s_ctx->tput_threshold);
-    }  // implicit barrier and flush
+    funnel_bcast(&s_ctx->tput_threshold, 1, MPI_UINT64_T);
+    DEBUG("have threshold %" PRIu64, s_ctx->tput_threshold);
 
     // find number of records satisfying the threshold
     assert(args->fields.sort_key.field);
@@ -806,8 +1852,8 @@ tput_phase_2(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
             args->fields.sort_key.field->id, args->fields.sort_key.direction);
 
     // send all records satisfying the threshold
-    send_raw_mem(t_ctx->lnf_mem, threshold_cnt, TAG_TPUT2, t_ctx->buff,
-                 XCHG_BUFF_SIZE);
+    xchg_send_raw_mem(t_ctx->lnf_mem, threshold_cnt, ROOT_PROC, TAG_TPUT2,
+                      thread_ring(t_ctx));
     DEBUG("slave TPUT phase 2: done");
 }
 
@@ -818,10 +1864,8 @@ tput_phase_2(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
  * up the record in its libnf memory. If it finds matching aggregation key, the
  * records is send to the master.
  *
- * This function is not thread-safe without MPI_THREAD_MULTIPLE.
- * It is incorrect to start multiple collective communications on the same
- * communicator in same time -- that is why every MPI collective function is in
- * a OpenMP single construct.
+ * Only one thread per slave (the one holding the merged libnf memory) takes
+ * part in the TPUT algorithm.
  *
  * @param[in] s_ctx Thread-shared context.
  * @param[in] t_ctx Thread-local context.
@@ -831,21 +1875,16 @@ tput_phase_3(struct slave_ctx *s_ctx, struct thread_ctx *const t_ctx)
 {
     assert(s_ctx && t_ctx);
 
-    #pragma omp single
-    {
-        // receive the rec_info buffer size and allocate required memory
-        MPI_Bcast(s_ctx->tput_rec_info, 2, MPI_UINT64_T, ROOT_PROC,
-                  mpi_comm_main);
-        const uint64_t rec_buff_size =
-            s_ctx->tput_rec_info[0] * s_ctx->tput_rec_info[1];
-        s_ctx->tput_rec_buff = malloc(rec_buff_size);
-        ABORT_IF(!s_ctx->tput_rec_buff, E_MEM,
-                 "slave TPUT phase 3 buffer allocation failed");
-
-        // receive all records at once
-        MPI_Bcast(s_ctx->tput_rec_buff, rec_buff_size, MPI_BYTE, ROOT_PROC,
-                  mpi_comm_main);
-    }  // implicit barrier and flush
+    // receive the rec_info buffer size and allocate required memory
+    funnel_bcast(s_ctx->tput_rec_info, 2, MPI_UINT64_T);
+    const uint64_t rec_buff_size =
+        s_ctx->tput_rec_info[0] * s_ctx->tput_rec_info[1];
+    s_ctx->tput_rec_buff = malloc(rec_buff_size);
+    ABORT_IF(!s_ctx->tput_rec_buff, E_MEM,
+             "slave TPUT phase 3 buffer allocation failed");
+
+    // receive all records at once
+    funnel_bcast(s_ctx->tput_rec_buff, rec_buff_size, MPI_BYTE);
 
     // initialize libnf memory designated for found records -- no aggregation
     lnf_mem_t *found_records;
@@ -873,23 +1912,493 @@ tput_phase_3(struct slave_ctx *s_ctx, struct thread_ctx *const t_ctx)
             assert(lnf_ret == LNF_OK);
         }
     }
-    DEBUG("slave TPUT phase 3: received %" PRIu64 " records, found %" PRIu64
-          " records", s_ctx->tput_rec_info[0], found_rec_cntr);
+    DEBUG("slave TPUT phase 3: received %" PRIu64 " records, found %" PRIu64
+          " records", s_ctx->tput_rec_info[0], found_rec_cntr);
+
+    // send the found records to the master
+    xchg_send_raw_mem(found_records, 0, ROOT_PROC, TAG_TPUT3,
+                      thread_ring(t_ctx));
+    libnf_mem_free(found_records);
+    free(s_ctx->tput_rec_buff);
+
+    DEBUG("slave TPUT phase 3: done");
+}
+/**
+ * @}
+ */  // slave_tput
+
+
+/**
+ * @defgroup slave_shuffle Hash-partitioned distributed aggregation (shuffle).
+ *
+ * Instead of sending all partial aggregates to the master, the key space is
+ * split into a number of virtual partitions by a hash of the aggregation key.
+ * Each partition is owned by exactly one slave. Every slave sends each of its
+ * records to the owner of the record's partition using all-to-all exchange on
+ * mpi_comm_slaves, so each owner ends up with all partial aggregates of its
+ * keys and merges them into final aggregates. Owners merge disjoint key ranges
+ * in parallel and only the final records are sent to the master. With a record
+ * limit, each owner sends only the first (top) N records, because the global
+ * top N records are a subset of the union of owners' top N records.
+ *
+ * Records are already aggregated inside each slave, so a heavy key is just
+ * one record per slave. The load of an owner is given by the number of
+ * distinct keys it receives. To keep it balanced even if the hash function
+ * distributes keys unevenly, there are SHUFFLE_PARTS_PER_SLAVE virtual
+ * partitions per slave and they are assigned to the owners using the longest
+ * processing time first rule according to their global sizes.
+ *
+ * @{
+ */
+#define SHUFFLE_PARTS_PER_SLAVE 16  // number of virtual partitions per slave
+#define SHUFFLE_SEG_SIZE_MIN (4 * (sizeof (xchg_rec_size_t) + LNF_MAX_RAW_LEN))
+
+struct shuffle_part {
+    uint64_t size;  // number of records in the partition on all slaves
+    uint64_t idx;   // partition index
+};
+
+/**
+ * @brief Compute a hash of the aggregation key of the libnf record.
+ *
+ * 64-bit FNV-1a hash over values of all aggregation key fields.
+ *
+ * @param[in] lnf_rec The libnf record read from the aggregation memory.
+ *
+ * @return Hash of the aggregation key.
+ */
+static uint64_t
+shuffle_key_hash(lnf_rec_t *const lnf_rec)
+{
+    assert(lnf_rec);
+
+    uint64_t hash = FNV1A_64_OFFSET_BASIS;
+    for (size_t i = 0; i < args->fields.aggr_keys_cnt; ++i) {
+        const struct field *const field = args->fields.aggr_keys[i].field;
+        uint8_t value[LNF_MAX_RAW_LEN] = { 0 };
+        assert(field->size <= sizeof (value));
+
+        const int lnf_ret = lnf_rec_fget(lnf_rec, field->id, value);
+        assert(lnf_ret == LNF_OK);
+        (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+        for (size_t j = 0; j < field->size; ++j) {
+            hash ^= value[j];
+            hash *= FNV1A_64_PRIME;
+        }
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Compute the partition of each record in the libnf memory.
+ *
+ * @param[in] lnf_mem The libnf memory. Will not be modified.
+ * @param[in] lnf_rec A libnf record used for reading.
+ * @param[in] parts_cnt Number of partitions.
+ * @param[out] part_sizes parts_cnt sized array of local partition sizes.
+ * @param[out] rec_cnt Number of records in the memory.
+ *
+ * @return Array of partition indexes, one for each record in the order of the
+ *         libnf memory cursor. Has to be freed by the caller.
+ */
+static uint32_t *
+shuffle_partition(lnf_mem_t *const lnf_mem, lnf_rec_t *const lnf_rec,
+                  const uint64_t parts_cnt, uint64_t part_sizes[],
+                  size_t *const rec_cnt)
+{
+    assert(lnf_mem && lnf_rec && parts_cnt > 0 && parts_cnt <= UINT32_MAX
+           && part_sizes && rec_cnt);
+
+    uint32_t *rec_part = NULL;
+    size_t rec_part_size = 0;
+    *rec_cnt = 0;
+
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    while (cursor) {
+        if (*rec_cnt == rec_part_size) {  // enlarge the array
+            rec_part_size = rec_part_size ? rec_part_size * 2 : 1024;
+            rec_part = realloc(rec_part, rec_part_size * sizeof (*rec_part));
+            ABORT_IF(!rec_part, E_MEM, "shuffle partition array allocation failed");
+        }
+
+        lnf_ret = lnf_mem_read_c(lnf_mem, cursor, lnf_rec);
+        assert(lnf_ret == LNF_OK);
+        const uint32_t part = shuffle_key_hash(lnf_rec) % parts_cnt;
+        rec_part[(*rec_cnt)++] = part;
+        part_sizes[part]++;
+
+        lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
+        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    }
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+    return rec_part;
+}
+
+static int
+shuffle_part_cmp(const void *p1, const void *p2)
+{
+    const struct shuffle_part *const part1 = p1;
+    const struct shuffle_part *const part2 = p2;
+
+    // descending by size, ascending by index to make the order deterministic
+    if (part1->size != part2->size) {
+        return part1->size < part2->size ? 1 : -1;
+    }
+    return (part1->idx > part2->idx) - (part1->idx < part2->idx);
+}
+
+/**
+ * @brief Assign the partitions to the owners.
+ *
+ * The largest remaining partition is always assigned to the least loaded
+ * owner. The result depends only on the global partition sizes, so all slaves
+ * compute the same assignment.
+ *
+ * @param[in] part_sizes parts_cnt sized array of global partition sizes.
+ * @param[in] parts_cnt Number of partitions.
+ * @param[in] owner_cnt Number of owners (slaves).
+ * @param[out] part_owner parts_cnt sized array of owners of the partitions.
+ */
+static void
+shuffle_assign_owners(const uint64_t part_sizes[], const uint64_t parts_cnt,
+                      const int owner_cnt, int part_owner[])
+{
+    assert(part_sizes && parts_cnt > 0 && owner_cnt > 0 && part_owner);
+
+    struct shuffle_part *const parts = malloc(parts_cnt * sizeof (*parts));
+    uint64_t *const owner_load = calloc(owner_cnt, sizeof (*owner_load));
+    ABORT_IF(!parts || !owner_load, E_MEM,
+             "shuffle owner assignment allocation failed");
+
+    for (uint64_t i = 0; i < parts_cnt; ++i) {
+        parts[i].size = part_sizes[i];
+        parts[i].idx = i;
+    }
+    qsort(parts, parts_cnt, sizeof (*parts), shuffle_part_cmp);
+
+    for (uint64_t i = 0; i < parts_cnt; ++i) {
+        int least_loaded = 0;
+        for (int j = 1; j < owner_cnt; ++j) {
+            if (owner_load[j] < owner_load[least_loaded]) {
+                least_loaded = j;
+            }
+        }
+        part_owner[parts[i].idx] = least_loaded;
+        owner_load[least_loaded] += parts[i].size;
+    }
+
+    uint64_t load_max = 0;
+    uint64_t load_sum = 0;
+    for (int j = 0; j < owner_cnt; ++j) {
+        MAX_ASSIGN(load_max, owner_load[j]);
+        load_sum += owner_load[j];
+    }
+    DEBUG("slave shuffle: %" PRIu64 " records in %" PRIu64 " partitions, "
+          "max owner load %" PRIu64, load_sum, parts_cnt, load_max);
+
+    free(owner_load);
+    free(parts);
+}
+
+/**
+ * @brief Send all records to their owners and merge records received from
+ *        the other slaves.
+ *
+ * Records are exchanged in rounds. In each round, the records are read into
+ * per-destination segments of the send buffer (in the same format as used by
+ * xchg_send_raw_mem()) until one of the segments is full or there are no
+ * records left. All segments are then exchanged at once using MPI_Alltoallv().
+ * The rounds are repeated until all slaves run out of records.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ *
+ * @param[in] local_mem The libnf memory with the local records.
+ * @param[out] owned_mem The libnf memory for the records of owned partitions.
+ * @param[in] rec_part Partition of each record in local_mem.
+ * @param[in] part_owner Owner of each partition.
+ * @param[in] slave_cnt Size of mpi_comm_slaves.
+ */
+static void
+shuffle_exchange(lnf_mem_t *const local_mem, lnf_mem_t *const owned_mem,
+                 const uint32_t rec_part[], const int part_owner[],
+                 const int slave_cnt)
+{
+    assert(local_mem && owned_mem && part_owner && slave_cnt > 0);
+
+    const size_t seg_size = MAX(xchg_get_buff_size() / (size_t)slave_cnt,
+                                SHUFFLE_SEG_SIZE_MIN);
+    uint8_t *const send_buff = malloc(seg_size * slave_cnt);
+    uint8_t *const recv_buff = malloc(seg_size * slave_cnt);
+    int *const send_cnts = calloc(slave_cnt, sizeof (*send_cnts));
+    int *const send_displs = calloc(slave_cnt, sizeof (*send_displs));
+    int *const recv_cnts = calloc(slave_cnt, sizeof (*recv_cnts));
+    int *const recv_displs = calloc(slave_cnt, sizeof (*recv_displs));
+    ABORT_IF(!send_buff || !recv_buff || !send_cnts || !send_displs
+             || !recv_cnts || !recv_displs, E_MEM,
+             "shuffle buffer allocation failed");
+    for (int i = 0; i < slave_cnt; ++i) {
+        send_displs[i] = i * seg_size;
+    }
+
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(local_mem, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+
+    uint8_t scratch[XCHG_COMPACT_REC_LEN_MAX];  // for the decoded records
+    size_t rec_idx = 0;
+    size_t recv_rec_cntr = 0;
+    size_t round_cntr = 0;
+    int all_done = false;
+    while (!all_done) {
+        // fill the segments until one of them is full or no records are left
+        for (int i = 0; i < slave_cnt; ++i) {
+            send_cnts[i] = 0;
+        }
+        while (cursor) {
+            const int owner = part_owner[rec_part[rec_idx]];
+            uint8_t *const seg = send_buff + send_displs[owner];
+            uint8_t rec[LNF_MAX_RAW_LEN];
+            int rec_len;
+            lnf_ret = lnf_mem_read_raw_c(local_mem, cursor, (char *)rec,
+                                         &rec_len, sizeof (rec));
+            assert(lnf_ret == LNF_OK);
+            const size_t written =
+                xchg_rec_put(seg + send_cnts[owner],
+                             seg_size - send_cnts[owner], rec, rec_len);
+            if (written == 0) {
+                break;  // the segment is full, exchange the segments now
+            }
+            send_cnts[owner] += written;
+            rec_idx++;
+
+            lnf_ret = lnf_mem_next_c(local_mem, &cursor);
+            assert((cursor && lnf_ret == LNF_OK)
+                   || (!cursor && lnf_ret == LNF_EOF));
+        }
+        const int local_done = (cursor == NULL);
+
+        // exchange the segment sizes and the segments
+        funnel_alltoall_int(send_cnts, recv_cnts);
+        int recv_total = 0;
+        for (int i = 0; i < slave_cnt; ++i) {
+            recv_displs[i] = recv_total;
+            recv_total += recv_cnts[i];
+        }
+        funnel_alltoallv(send_buff, send_cnts, send_displs, recv_buff,
+                         recv_cnts, recv_displs);
+
+        // merge the received records into the memory of owned partitions
+        uint8_t *rec_ptr = recv_buff;
+        const uint8_t *const recv_end = recv_buff + recv_total;
+        while (rec_ptr < recv_end) {
+            xchg_rec_size_t rec_size;
+            uint8_t *const rec = xchg_rec_get(&rec_ptr, scratch, &rec_size);
+            lnf_ret = lnf_mem_write_raw(owned_mem, (char *)rec, rec_size);
+            ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write_raw()");
+            recv_rec_cntr++;
+        }
+
+        funnel_allreduce(&local_done, &all_done, 1, MPI_INT, MPI_LAND);
+        round_cntr++;
+    }
+
+    DEBUG("slave shuffle: sent %zu records, received %zu records in %zu round(s)",
+          rec_idx, recv_rec_cntr, round_cntr);
+
+    free(recv_displs);
+    free(recv_cnts);
+    free(send_displs);
+    free(send_cnts);
+    free(recv_buff);
+    free(send_buff);
+}
+
+/**
+ * @brief Perform the shuffle aggregation and send the final records to the
+ *        master.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ *
+ * @param[in,out] t_ctx Thread-local context of the thread holding the merged
+ *                      libnf memory. The memory is replaced by the memory of
+ *                      owned partitions.
+ */
+static void
+shuffle_aggr(struct thread_ctx *const t_ctx)
+{
+    assert(t_ctx && t_ctx->lnf_mem && mpi_comm_slaves != MPI_COMM_NULL);
+
+    const int slave_cnt = funnel_comm_size(mpi_comm_slaves);
+    const uint64_t parts_cnt = (uint64_t)slave_cnt * SHUFFLE_PARTS_PER_SLAVE;
+
+    // partition the local records and compute the global partition sizes
+    uint64_t *const part_sizes = calloc(parts_cnt, sizeof (*part_sizes));
+    int *const part_owner = malloc(parts_cnt * sizeof (*part_owner));
+    ABORT_IF(!part_sizes || !part_owner, E_MEM,
+             "shuffle partition arrays allocation failed");
+    size_t rec_cnt;
+    uint32_t *const rec_part = shuffle_partition(t_ctx->lnf_mem, t_ctx->lnf_rec,
+                                                 parts_cnt, part_sizes,
+                                                 &rec_cnt);
+    funnel_allreduce(MPI_IN_PLACE, part_sizes, parts_cnt, MPI_UINT64_T,
+                     MPI_SUM);
+
+    // assign the partitions and exchange the records
+    shuffle_assign_owners(part_sizes, parts_cnt, slave_cnt, part_owner);
+    // the owned records are sent unordered, unless the limit is too large for
+    // the top-N selection
+    const bool top_n = args->rec_limit && args->fields.sort_key.field
+        && args->rec_limit <= LIBNF_TOP_N_LIMIT_MAX;
+    const bool sorted = args->rec_limit && args->fields.sort_key.field
+        && !top_n;
+    lnf_mem_t *owned_mem;
+    if (sorted) {
+        libnf_mem_init_ht(&owned_mem, &args->fields);
+    } else {
+        libnf_mem_init_ht_unsorted(&owned_mem, &args->fields);
+    }
+    shuffle_exchange(t_ctx->lnf_mem, owned_mem, rec_part, part_owner,
+                     slave_cnt);
+    free(rec_part);
+    free(part_owner);
+    free(part_sizes);
+
+    // local records are no longer needed, keep only the owned ones
+    libnf_mem_free(t_ctx->lnf_mem);
+    t_ctx->lnf_mem = owned_mem;
+
+    // keys of the owners are disjoint, the records are final, so only the
+    // first rec_limit records are needed
+    if (top_n) {
+        lnf_mem_t *top_mem;
+        libnf_mem_init_ht_unsorted(&top_mem, &args->fields);
+        libnf_mem_top_n(t_ctx->lnf_mem, top_mem, &args->fields,
+                        args->rec_limit);
+        libnf_mem_free(t_ctx->lnf_mem);
+        t_ctx->lnf_mem = top_mem;
+    }
+    xchg_send_raw_mem(t_ctx->lnf_mem, args->rec_limit, ROOT_PROC, TAG_AGGR,
+                      thread_ring(t_ctx));
+}
+/**
+ * @}
+ */  // slave_shuffle
+
+
+/**
+ * @brief Merge the thread-local libnf memories into the memory of thread 0.
+ *
+ * The merge is performed as a parallel binary tree reduction: in each round,
+ * every thread with an index divisible by 2 * stride merges the memory of the
+ * thread stride positions away into its own memory. After ceil(log2(T))
+ * rounds, the memory of thread 0 contains records of all threads. Every other
+ * memory is freed as soon as it has been merged.
+ *
+ * Must be called by all threads of the team.
+ *
+ * @param[in,out] s_ctx Thread-shared context.
+ * @param[in,out] t_ctx Thread-local context.
+ */
+static void
+merge_thread_mems_mt(struct slave_ctx *const s_ctx,
+                     struct thread_ctx *const t_ctx)
+{
+    assert(s_ctx && s_ctx->thread_mems && t_ctx && t_ctx->lnf_mem);
+
+    const int thread_num = omp_get_thread_num();
+    const int num_threads = omp_get_num_threads();
+
+    s_ctx->thread_mems[thread_num] = t_ctx->lnf_mem;
+    #pragma omp barrier  // all memories have to be published
+
+    for (int stride = 1; stride < num_threads; stride *= 2) {
+        const bool receiver = thread_num % (2 * stride) == 0;
+        if (receiver && thread_num + stride < num_threads) {
+            libnf_mem_merge(t_ctx->lnf_mem,
+                            s_ctx->thread_mems[thread_num + stride]);
+        }
+        #pragma omp barrier  // this round of merges is complete
+
+        if (!receiver && thread_num % stride == 0) {
+            // my memory has been merged in this round and is no longer needed
+            libnf_mem_free(t_ctx->lnf_mem);
+            t_ctx->lnf_mem = NULL;
+        }
+    }
 
-    // send the found records to the master
-    send_raw_mem(found_records, 0, TAG_TPUT3, t_ctx->buff, XCHG_BUFF_SIZE);
-    libnf_mem_free(found_records);
+    if (thread_num == 0) {
+        DEBUG("merged %d thread-local libnf memories", num_threads);
+    }
+}
 
-    #pragma omp barrier  // ensure nobody is using the buffer any more
-    #pragma omp single
-    free(s_ctx->tput_rec_buff);
+// state of the receive of the children subtrees
+struct tree_recv {
+    lnf_mem_t *lnf_mem;  // the merged libnf memory
+    int parent;  // rank of the parent, set by tree_recv_children()
+};
 
-    DEBUG("slave TPUT phase 3: done");
+/**
+ * @brief Receive the partial aggregates of all children subtrees.
+ *
+ * Called by the communication thread, if it is enabled (see tree_reduce()).
+ */
+static void
+tree_recv_children(void *const arg)
+{
+    struct tree_recv *const tr = arg;
+
+    int rank;
+    int world_size;
+    MPI_Comm_rank(mpi_comm_main, &rank);
+    MPI_Comm_size(mpi_comm_main, &world_size);
+
+    const uint64_t children_cnt =
+        xchg_tree_children_cnt(rank, args->tree_fanin, world_size);
+    if (children_cnt > 0) {
+        xchg_recv_loop(children_cnt, 0, TAG_AGGR, xchg_mem_write_raw_callback,
+                       tr->lnf_mem);
+    }
+
+    tr->parent = xchg_tree_parent(rank, args->tree_fanin);
+    DEBUG("reduction tree: merged %" PRIu64 " child(ren), sending to %d",
+          children_cnt, tr->parent);
 }
+
 /**
- * @}
- */  // slave_tput
+ * @brief Pass the merged hash table up the k-ary reduction tree.
+ *
+ * Partial aggregates of all children subtrees are received and aggregated into
+ * the merged libnf memory first. The result is then sent as one stream to the
+ * parent, which is either another slave or the master (see @ref xchg_tree).
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ *
+ * @param[in,out] t_ctx Thread-local context of the thread holding the merged
+ *                      libnf memory.
+ */
+static void
+tree_reduce(struct thread_ctx *const t_ctx)
+{
+    assert(t_ctx && t_ctx->lnf_mem && args->tree_fanin >= 2);
+
+    // the receives are made by the communication thread, if it is enabled
+    struct tree_recv tr = { .lnf_mem = t_ctx->lnf_mem };
+    struct xchg_comm_msg msg;
+    xchg_comm_msg_init(&msg);
+    xchg_comm_call(&msg, tree_recv_children, &tr);
+    xchg_comm_wait(&msg);
 
+    xchg_send_raw_mem(t_ctx->lnf_mem, 0, tr.parent, TAG_AGGR,
+                      thread_ring(t_ctx));
+}
 
 /**
  * @brief TODO
@@ -906,6 +2415,13 @@ process_file_mt(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx,
 {
     DEBUG("`%s': processing...", ff_path);
 
+    // skip the file if the listing was already cancelled
+    if (args->working_mode == MODE_LIST && !args->time_order_window
+            && cancel_check(s_ctx)) {
+        DEBUG("`%s': skipped, listing cancelled", ff_path);
+        return;
+    }
+
     // open the flow file
     // TODO: open and update metadata counters before or after bfindex?
     int lnf_ret = lnf_open(&t_ctx->lnf_file, ff_path, LNF_READ, NULL);
@@ -945,6 +2461,23 @@ process_file_mt(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx,
     switch (args->working_mode) {
     case MODE_LIST:
     {
+        if (t_ctx->time_order) {
+            // the stream of the thread ends after rec_limit records
+            if (!time_order_done(t_ctx->time_order)) {
+                ff_read_and_stream(ff_path, t_ctx);
+            }
+            break;
+        }
+
+        if (args->passthrough_path) {
+            ff_passthrough(ff_path, s_ctx, t_ctx);
+            break;
+        }
+        if (args->output_dir) {
+            ff_read_and_write(ff_path, s_ctx, t_ctx);
+            break;
+        }
+
         #pragma omp flush  // to flush rec_limit_reached
         if (!s_ctx->rec_limit_reached) {
             ff_read_and_send(ff_path, s_ctx, t_ctx, TAG_LIST);
@@ -978,6 +2511,393 @@ return_label:
     }
 }
 
+/**
+ * @brief Merge the spilled thread-local memories partition by partition and
+ *        send them to the master.
+ *
+ * Every thread spills the rest of its memory, so all records are on disk.
+ * Thread 0 then loads one partition of all threads at a time, aggregates it
+ * and sends it to the master. Partitions have disjoint keys, so they form one
+ * stream with final records of this slave.
+ *
+ * Must be called by all threads of the team.
+ *
+ * @param[in,out] s_ctx Thread-shared context.
+ * @param[in,out] t_ctx Thread-local context.
+ */
+static void
+spill_aggr_mt(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
+{
+    assert(s_ctx && s_ctx->thread_spills && t_ctx && t_ctx->spill);
+
+    const int thread_num = omp_get_thread_num();
+    const int num_threads = omp_get_num_threads();
+
+    spill_mem(t_ctx->spill, t_ctx->lnf_mem);
+    libnf_mem_free(t_ctx->lnf_mem);
+    t_ctx->lnf_mem = NULL;
+    s_ctx->thread_spills[thread_num] = t_ctx->spill;
+    #pragma omp barrier  // all spills have to be complete
+
+    if (thread_num == 0) {
+        for (size_t part = 0; part < SPILL_PARTS_CNT; ++part) {
+            lnf_mem_t *part_mem;
+            libnf_mem_init_ht(&part_mem, &args->fields);
+            for (int i = 0; i < num_threads; ++i) {
+                spill_load_part(s_ctx->thread_spills[i], part, part_mem);
+            }
+            xchg_send_raw_recs(part_mem, 0, ROOT_PROC, TAG_AGGR,
+                               thread_ring(t_ctx));
+            libnf_mem_free(part_mem);
+        }
+        xchg_send_terminator(ROOT_PROC, TAG_AGGR);
+        DEBUG("merged %zu spilled partition(s) of %d thread(s)",
+              (size_t)SPILL_PARTS_CNT, num_threads);
+    }
+    #pragma omp barrier  // the spills are freed by their threads
+}
+
+/**
+ * @brief Write the current record of the sorted memory in the list mode
+ *        format into the record buffer.
+ */
+static void
+sorted_rec_read(struct thread_ctx *const t_ctx, lnf_mem_cursor_t *const cursor,
+                uint8_t *const rec)
+{
+    const int lnf_ret = lnf_mem_read_c(t_ctx->lnf_mem, cursor, t_ctx->lnf_rec);
+    assert(lnf_ret == LNF_OK);
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+    size_t rec_off = 0;
+    for (size_t i = 0; i < args->fields.all_cnt; ++i) {
+        lnf_rec_fget(t_ctx->lnf_rec, args->fields.all[i].id, rec + rec_off);
+        rec_off += args->fields.all[i].size;
+    }
+}
+
+/**
+ * @brief Send the sorted prefix and receive the pruning threshold.
+ *
+ * The first s_ctx->prune_prefix records are sent in one message (possibly
+ * empty). The master then broadcasts the threshold (see @ref
+ * master_sort_merge), which is received by thread 0 for all threads.
+ *
+ * Must be called by all threads of the team.
+ *
+ * @return Number of records sent.
+ */
+static uint64_t
+send_sorted_prefix_mt(struct slave_ctx *const s_ctx,
+                      struct thread_ctx *const t_ctx,
+                      lnf_mem_cursor_t **const cursor, const int mpi_tag)
+{
+    const xchg_rec_size_t rec_size = args->fields.all_sizes_sum;
+    uint8_t rec[rec_size];
+
+    size_t buff_off = 0;
+    uint64_t rec_cntr = 0;
+    while (*cursor && rec_cntr < s_ctx->prune_prefix) {
+        sorted_rec_read(t_ctx, *cursor, rec);
+        const size_t written = xchg_rec_put(t_ctx->buff[0] + buff_off,
+                                            XCHG_STREAM_BUFF_SIZE - buff_off,
+                                            rec, rec_size);
+        assert(written != 0);  // the prefix fits into one message
+        buff_off += written;
+        rec_cntr++;
+
+        const int lnf_ret = lnf_mem_next_c(t_ctx->lnf_mem, cursor);
+        assert((*cursor && lnf_ret == LNF_OK)
+               || (!*cursor && lnf_ret == LNF_EOF));
+        (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+    }
+    struct xchg_comm_msg msg;
+    xchg_comm_msg_init(&msg);
+    xchg_comm_send(&msg, t_ctx->buff[0], buff_off, ROOT_PROC, mpi_tag,
+                   mpi_comm_main, false);
+    xchg_comm_wait(&msg);
+
+    #pragma omp barrier  // all prefixes have to be sent before the broadcast
+    #pragma omp master
+    {
+        funnel_bcast(s_ctx->prune_threshold, sizeof (s_ctx->prune_threshold),
+                     MPI_BYTE);
+    }
+    #pragma omp barrier  // the threshold is shared by all threads
+
+    return rec_cntr;
+}
+
+/**
+ * @brief Send the sorted records as a separate stream for the master's merge.
+ *
+ * Records are read from the sorted libnf memory and sent in the same format
+ * as in the list mode, so the master can compare them on the sort key and
+ * print them without the libnf memory (see @ref master_sort_merge). Messages
+ * are at most XCHG_STREAM_BUFF_SIZE bytes long. Terminator is included.
+ *
+ * If pruning is enabled, the prefix is sent first and after receiving the
+ * threshold, only records not after the threshold are sent. In that case,
+ * the function has to be called by all threads of the team.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ *
+ * @param[in,out] s_ctx Thread-shared context.
+ * @param[in,out] t_ctx Thread-local context with the sorted libnf memory.
+ * @param[in] mpi_tag Tag of the stream, unique for this thread.
+ */
+static void
+send_sorted_stream(struct slave_ctx *const s_ctx,
+                   struct thread_ctx *const t_ctx, const int mpi_tag)
+{
+    assert(s_ctx && t_ctx && t_ctx->lnf_mem);
+
+    const xchg_rec_size_t rec_size = args->fields.all_sizes_sum;
+    assert(sizeof (rec_size) + rec_size <= XCHG_STREAM_BUFF_SIZE);
+    uint8_t rec[rec_size];  // one record in the fdistdump layout
+
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(t_ctx->lnf_mem, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+
+    // the sort key in the record and the threshold, if there is one
+    const uint8_t *threshold = NULL;
+    size_t key_offset = 0;
+    uint64_t rec_cntr = 0;
+    if (args->use_sort_prune) {
+        rec_cntr = send_sorted_prefix_mt(s_ctx, t_ctx, &cursor, mpi_tag);
+        if (s_ctx->prune_threshold[0]) {
+            threshold = s_ctx->prune_threshold + 1;
+        }
+        for (size_t i = 0; args->fields.all[i].id
+                != args->fields.sort_key.field->id; ++i) {
+            key_offset += args->fields.all[i].size;
+        }
+    }
+    const uint64_t prefix_cnt = rec_cntr;
+
+    bool buff_idx = 0;
+    size_t buff_off = 0;
+    struct xchg_comm_msg msg;
+    xchg_comm_msg_init(&msg);
+    while (cursor && (!args->rec_limit || rec_cntr < args->rec_limit)) {
+        sorted_rec_read(t_ctx, cursor, rec);
+        if (threshold && sort_key_cmp(&args->fields.sort_key, rec + key_offset,
+                                      threshold) > 0) {
+            break;  // all remaining records are after the threshold
+        }
+
+        size_t written = xchg_rec_put(t_ctx->buff[buff_idx] + buff_off,
+                                      XCHG_STREAM_BUFF_SIZE - buff_off, rec,
+                                      rec_size);
+        if (written == 0) {  // the buffer is full, send it
+            xchg_comm_wait(&msg);
+            xchg_comm_send(&msg, t_ctx->buff[buff_idx], buff_off, ROOT_PROC,
+                           mpi_tag, mpi_comm_main, false);
+            buff_off = 0;
+            buff_idx = !buff_idx;
+
+            written = xchg_rec_put(t_ctx->buff[buff_idx],
+                                   XCHG_STREAM_BUFF_SIZE, rec, rec_size);
+            assert(written != 0);
+        }
+        buff_off += written;
+        rec_cntr++;
+
+        lnf_ret = lnf_mem_next_c(t_ctx->lnf_mem, &cursor);
+        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    }
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+    // send the remaining records if the buffer is not empty
+    if (buff_off != 0) {
+        xchg_comm_wait(&msg);
+        xchg_comm_send(&msg, t_ctx->buff[buff_idx], buff_off, ROOT_PROC,
+                       mpi_tag, mpi_comm_main, false);
+    }
+    xchg_comm_wait(&msg);
+
+    xchg_send_terminator(ROOT_PROC, mpi_tag);
+    DEBUG("send_sorted_stream: sent %" PRIu64 " record(s) (%" PRIu64
+          " in the prefix) with tag %d", rec_cntr, prefix_cnt, mpi_tag);
+}
+
+/**
+ * @defgroup slave_sample_sort Distributed sample sort.
+ *
+ * Used for sorting without a record limit. Records of all threads are merged
+ * into one libnf memory and sorted on each slave. Each slave then takes
+ * SAMPLE_SORT_OVERSAMPLING evenly spaced sort keys of its records as samples,
+ * all samples are gathered by all slaves and sorted, and slave_cnt - 1
+ * evenly spaced samples are chosen as range splitters. Each record is sent to
+ * the slave owning its range using the same all-to-all exchange as the
+ * shuffle (see @ref slave_shuffle). Each slave finally sorts its range and
+ * sends it as a sorted stream to the master. The ranges are disjoint and
+ * ordered, so the master's merge (see @ref master_sort_merge) just
+ * concatenates them.
+ *
+ * @{
+ */
+#define SAMPLE_SORT_OVERSAMPLING 64  // number of samples per slave
+
+/**
+ * @brief Gather samples of all slaves and choose the range splitters.
+ *
+ * @param[in] lnf_mem Sorted libnf memory with the local records.
+ * @param[in] lnf_rec Auxiliary libnf record.
+ * @param[in] slave_cnt Size of mpi_comm_slaves.
+ *
+ * @return Array of slave_cnt - 1 splitters (sort key values), NULL if there
+ *         are no records at all. Has to be freed by the caller.
+ */
+static uint8_t *
+sample_sort_splitters(lnf_mem_t *const lnf_mem, lnf_rec_t *const lnf_rec,
+                      const int slave_cnt)
+{
+    const int key_id = args->fields.sort_key.field->id;
+    const size_t key_size = args->fields.sort_key.field->size;
+
+    // take evenly spaced samples of the sorted local records
+    const uint64_t rec_cnt = libnf_mem_rec_cnt(lnf_mem);
+    const int local_cnt = MIN(rec_cnt, (uint64_t)SAMPLE_SORT_OVERSAMPLING);
+    uint8_t *const local = malloc(MAX(local_cnt, 1) * key_size);
+    ABORT_IF(!local, E_MEM, "sample buffer allocation failed");
+
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
+    uint64_t rec_idx = 0;
+    for (int i = 0; i < local_cnt; ++i) {
+        const uint64_t sample_idx = (i * rec_cnt + rec_cnt / 2) / local_cnt;
+        for (; rec_idx < sample_idx; ++rec_idx) {
+            lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
+        }
+        assert(cursor);
+        lnf_ret = lnf_mem_read_c(lnf_mem, cursor, lnf_rec);
+        assert(lnf_ret == LNF_OK);
+        lnf_rec_fget(lnf_rec, key_id, local + i * key_size);
+    }
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+    // gather samples of all slaves
+    int *const cnts = malloc(slave_cnt * sizeof (*cnts));
+    int *const displs = malloc(slave_cnt * sizeof (*displs));
+    ABORT_IF(!cnts || !displs, E_MEM, "sample count allocation failed");
+    const int local_bytes = local_cnt * key_size;
+    funnel_allgather_int(local_bytes, cnts);
+    int total_bytes = 0;
+    for (int i = 0; i < slave_cnt; ++i) {
+        displs[i] = total_bytes;
+        total_bytes += cnts[i];
+    }
+    uint8_t *const samples = malloc(MAX(total_bytes, 1));
+    ABORT_IF(!samples, E_MEM, "sample buffer allocation failed");
+    funnel_allgatherv(local, local_bytes, samples, cnts, displs);
+    free(displs);
+    free(cnts);
+    free(local);
+
+    const size_t samples_cnt = total_bytes / key_size;
+    if (samples_cnt == 0) {
+        free(samples);
+        return NULL;
+    }
+
+    // choose evenly spaced splitters from the sorted samples
+    qsort(samples, samples_cnt, key_size, sort_key_qsort_cmp);
+    uint8_t *const splitters = malloc(MAX(slave_cnt - 1, 1) * key_size);
+    ABORT_IF(!splitters, E_MEM, "splitters allocation failed");
+    for (int i = 1; i < slave_cnt; ++i) {
+        memcpy(splitters + (i - 1) * key_size,
+               samples + (i * samples_cnt / slave_cnt) * key_size, key_size);
+    }
+    free(samples);
+
+    return splitters;
+}
+
+/**
+ * @brief Sort the records of all slaves by ranges and send the local range.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ *
+ * @param[in,out] s_ctx Thread-shared context.
+ * @param[in,out] t_ctx Thread-local context of the thread holding the merged
+ *                      libnf memory.
+ */
+static void
+sample_sort(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
+{
+    assert(s_ctx && t_ctx && t_ctx->lnf_mem
+           && mpi_comm_slaves != MPI_COMM_NULL);
+
+    const int slave_cnt = funnel_comm_size(mpi_comm_slaves);
+    const int key_id = args->fields.sort_key.field->id;
+    const size_t key_size = args->fields.sort_key.field->size;
+
+    libnf_mem_sort(t_ctx->lnf_mem);
+    uint8_t *const splitters =
+        sample_sort_splitters(t_ctx->lnf_mem, t_ctx->lnf_rec, slave_cnt);
+
+    if (splitters) {
+        // determine the range (the owner) of each record
+        const size_t rec_cnt = libnf_mem_rec_cnt(t_ctx->lnf_mem);
+        uint32_t *const rec_owner = malloc(MAX(rec_cnt, 1)
+                                           * sizeof (*rec_owner));
+        int *const owner = malloc(slave_cnt * sizeof (*owner));
+        ABORT_IF(!rec_owner || !owner, E_MEM,
+                 "sample sort arrays allocation failed");
+        for (int i = 0; i < slave_cnt; ++i) {
+            owner[i] = i;  // each range is owned by one slave
+        }
+
+        lnf_mem_cursor_t *cursor;
+        int lnf_ret = lnf_mem_first_c(t_ctx->lnf_mem, &cursor);
+        for (size_t i = 0; cursor; ++i) {
+            uint8_t key[TOPK_KEY_SIZE_MAX];
+            lnf_ret = lnf_mem_read_c(t_ctx->lnf_mem, cursor, t_ctx->lnf_rec);
+            assert(lnf_ret == LNF_OK);
+            lnf_rec_fget(t_ctx->lnf_rec, key_id, key);
+
+            // the first splitter greater than the key (upper bound)
+            size_t lo = 0;
+            size_t hi = slave_cnt - 1;
+            while (lo < hi) {
+                const size_t mid = lo + (hi - lo) / 2;
+                if (sort_key_cmp(&args->fields.sort_key, key,
+                                 splitters + mid * key_size) < 0) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            rec_owner[i] = lo;
+
+            lnf_ret = lnf_mem_next_c(t_ctx->lnf_mem, &cursor);
+        }
+        (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+        free(splitters);
+
+        // exchange the records, keep only the local range
+        lnf_mem_t *range_mem;
+        libnf_mem_init_list(&range_mem, &args->fields);
+        shuffle_exchange(t_ctx->lnf_mem, range_mem, rec_owner, owner,
+                         slave_cnt);
+        free(owner);
+        free(rec_owner);
+
+        libnf_mem_free(t_ctx->lnf_mem);
+        t_ctx->lnf_mem = range_mem;
+        libnf_mem_sort(t_ctx->lnf_mem);
+    }
+
+    send_sorted_stream(s_ctx, t_ctx, TAG_SORT_STREAM);
+}
+/**
+ * @}
+ */  // slave_sample_sort
+
 static void
 postprocess_mt(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
 {
@@ -985,30 +2905,68 @@ postprocess_mt(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
 
     switch (args->working_mode) {
     case MODE_LIST:
+        if (t_ctx->time_order) {
+            // send the rest of the reorder window
+            time_order_finish(t_ctx->time_order, t_ctx);
+            break;
+        }
         // all records already sent during reading
-        send_terminator(TAG_LIST);
+        xchg_send_terminator(ROOT_PROC, TAG_LIST);
         break;
 
     case MODE_SORT:
+        if (args->use_sample_sort) {
+            // merge thread-local memories, the slaves sort by ranges
+            merge_thread_mems_mt(s_ctx, t_ctx);
+            if (omp_get_thread_num() == 0) {
+                sample_sort(s_ctx, t_ctx);
+            }
+            break;
+        }
+
+        if (t_ctx->topk) {
+            topk_flush(t_ctx->topk, t_ctx->lnf_mem, t_ctx->lnf_rec);
+        }
         // merge thread-specific hash tables into thread-shared one
         DEBUG("sorting records in thread-local libnf memory...");
         libnf_mem_sort(t_ctx->lnf_mem);
         DEBUG("sorting records in thread-local libnf memory done");
-        send_raw_mem(t_ctx->lnf_mem, args->rec_limit, TAG_SORT, t_ctx->buff,
-                     XCHG_BUFF_SIZE);
+        send_sorted_stream(s_ctx, t_ctx,
+                           TAG_SORT_STREAM + omp_get_thread_num());
         break;
 
     case MODE_AGGR:
+        if (args->mem_budget) {
+            #pragma omp barrier  // s_ctx->spilled is final after all reads
+            if (s_ctx->spilled) {
+                // the merged memory would not fit, merge the partitions
+                spill_aggr_mt(s_ctx, t_ctx);
+                break;
+            }
+        }
+
+        // merge thread-local hash tables, so each slave sends only one stream
+        merge_thread_mems_mt(s_ctx, t_ctx);
+        if (omp_get_thread_num() != 0) {
+            break;  // only thread 0 holds the merged hash table
+        }
+
         if (args->use_tput) {
             assert(args->rec_limit);
             // use the TPUT Top-N algorithm
             tput_phase_1(t_ctx);
             tput_phase_2(s_ctx, t_ctx);
             tput_phase_3(s_ctx, t_ctx);
+        } else if (args->tree_fanin) {
+            // merge partial aggregates of the subtree and pass them up
+            tree_reduce(t_ctx);
+        } else if (args->use_shuffle) {
+            // merge partial aggregates of the owned partitions
+            shuffle_aggr(t_ctx);
         } else {
             // send all records
-            send_raw_mem(t_ctx->lnf_mem, 0, TAG_AGGR, t_ctx->buff,
-                         XCHG_BUFF_SIZE);
+            xchg_send_raw_mem(t_ctx->lnf_mem, 0, ROOT_PROC, TAG_AGGR,
+                              thread_ring(t_ctx));
         }
         break;
 
@@ -1025,6 +2983,75 @@ postprocess_mt(struct slave_ctx *const s_ctx, struct thread_ctx *const t_ctx)
     DEBUG("postprocess_mt done");
 }
 
+/**
+ * @brief Process all flow files by a team of threads and postprocess the
+ *        results.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE, unless the
+ * communication thread is running (see @ref xchg_comm).
+ *
+ * The team has exactly num_threads threads, because the master expects one
+ * stream from each of them. If the OpenMP runtime grants fewer threads (e.g.,
+ * because of OMP_THREAD_LIMIT or OMP_DYNAMIC), the processing is aborted.
+ *
+ * @param[in,out] s_ctx Thread-shared context.
+ * @param[in] ff_paths Paths to the flow files.
+ * @param[in] ff_paths_cnt Number of the flow files.
+ * @param[in] num_threads Number of the threads reported to the master.
+ */
+static void
+process_files(struct slave_ctx *const s_ctx, char *const *const ff_paths,
+              const size_t ff_paths_cnt, const int num_threads)
+{
+    #pragma omp parallel num_threads(num_threads)
+    {
+        ABORT_IF(omp_get_num_threads() != num_threads, E_INTERNAL,
+                 "the OpenMP runtime granted %d thread(s) instead of %d",
+                 omp_get_num_threads(), num_threads);
+
+        struct thread_ctx t_ctx = { 0 };
+        thread_ctx_init(&t_ctx);
+
+        /*
+         * Perform a parallel loop through all files.
+         * schedule(dynamic): dynamic scheduler is best for this use case, see
+         *   https://github.com/CESNET/fdistdump/issues/6
+         * nowait: don't wait for the other threads and start merging memory
+         *   immediately
+         */
+        uint64_t file_cntr = 0;
+        #pragma omp for schedule(dynamic) nowait
+        for (size_t i = 0; i < ff_paths_cnt; ++i) {
+            const char *const ff_path = ff_paths[i];
+
+            // process the flow file
+            process_file_mt(s_ctx, &t_ctx, ff_path);
+            file_cntr++;
+
+            // report that another flow file has been processed
+            progress_report_next();
+
+        }  // end of the parallel loop through all files, no barrier
+        DEBUG("thread processed %" PRIu64 " flow file(s)", file_cntr);
+        if (t_ctx.shard) {
+            shard_close(s_ctx, &t_ctx);
+        }
+
+        // atomic update of the thread-shared counters
+        processed_summ_share(&s_ctx->processed_summ, &t_ctx.processed_summ);
+        metadata_summ_share(&s_ctx->metadata_summ, &t_ctx.metadata_summ);
+        if (t_ctx.spill && spill_used(t_ctx.spill)) {
+            #pragma omp atomic write
+            s_ctx->spilled = true;
+        }
+
+        // postprocessing required in the parallel section
+        postprocess_mt(s_ctx, &t_ctx);
+
+        thread_ctx_free(&t_ctx);
+    }  // impicit barrier
+}
+
 /*
  * Public functions.
  */
@@ -1044,8 +3071,19 @@ slave_main(const struct cmdline_args *args_local)
     assert(args_local);
 
     args = args_local;  // share the command-line arguments by a global variable
+    xchg_set_compact(args->use_compact_xchg);
+    xchg_set_compress(args->use_compress_xchg);
+    xchg_set_layout(args->xchg_layout);
+    xchg_set_buff_size(args->xchg_buff_size);
+    xchg_set_credits(args->xchg_credits);
+    xchg_set_comm_thread(args->use_comm_thread);
+    if (args->use_slave_format || args->output_dir) {
+        output_init(args->output_params, &args->fields);
+    }
 
-    struct slave_ctx s_ctx = { 0 };
+    struct slave_ctx s_ctx = { .cancel_request = MPI_REQUEST_NULL };
+    xchg_comm_msg_init(&s_ctx.cancel_msg);
+    MPI_Comm_rank(mpi_comm_main, &s_ctx.rank);
 
     // generate paths to the specific flow files
     size_t ff_paths_cnt = 0;
@@ -1054,6 +3092,11 @@ slave_main(const struct cmdline_args *args_local)
                                      &ff_paths_cnt);
     assert(ff_paths);
     DEBUG("going to process %zu flow file(s)", ff_paths_cnt);
+    if (args->time_order_window) {
+        // names of the rotated files are ordered by time, the dynamic
+        // schedule then gives each thread its files in this order
+        qsort(ff_paths, ff_paths_cnt, sizeof (*ff_paths), path_time_cmp);
+    }
 
     // report number of files to be processed
     progress_report_init(ff_paths_cnt);
@@ -1068,52 +3111,108 @@ slave_main(const struct cmdline_args *args_local)
     DEBUG("using %d thread(s) out of %d available", num_threads_used,
           num_threads_max);
     // send a number of used threads
-    MPI_Reduce(&num_threads_used, NULL, 1, MPI_INT, MPI_SUM, ROOT_PROC,
+    MPI_Gather(&num_threads_used, 1, MPI_INT, NULL, 0, MPI_INT, ROOT_PROC,
                mpi_comm_main);
+    if (args->use_xchg_shm) {
+        // each thread sends through at most one ring
+        xchg_shm_init(MIN((size_t)num_threads_used * args->xchg_ring_size,
+                          XCHG_SHM_SLOTS_MAX));
+    }
 
-    #pragma omp parallel
-    {
-        struct thread_ctx t_ctx = { 0 };
-        thread_ctx_init(&t_ctx);
-
-        /*
-         * Perform a parallel loop through all files.
-         * schedule(dynamic): dynamic scheduler is best for this use case, see
-         *   https://github.com/CESNET/fdistdump/issues/6
-         * nowait: don't wait for the other threads and start merging memory
-         *   immediately
-         */
-        uint64_t file_cntr = 0;
-        #pragma omp for schedule(dynamic) nowait
-        for (size_t i = 0; i < ff_paths_cnt; ++i) {
-            const char *const ff_path = ff_paths[i];
+    if (args->use_sort_prune) {
+        // the prefixes of all streams together contain a few times more
+        // records than the limit, each prefix has to fit into one message
+        int streams_cnt;
+        MPI_Allreduce(&num_threads_used, &streams_cnt, 1, MPI_INT, MPI_SUM,
+                      mpi_comm_slaves);
+        const uint64_t prefix_wanted = (args->rec_limit
+            * SORT_PRUNE_PREFIX_FACTOR + streams_cnt - 1) / streams_cnt;
+        const uint64_t prefix_fits = XCHG_STREAM_BUFF_SIZE
+            / (sizeof (xchg_rec_size_t) + args->fields.all_sizes_sum);
+        s_ctx.prune_prefix = MIN(MIN(prefix_wanted, prefix_fits),
+                                 args->rec_limit);
+        DEBUG("sort pruning: prefix of %" PRIu64 " record(s) per stream",
+              s_ctx.prune_prefix);
+    }
 
-            // process the flow file
-            process_file_mt(&s_ctx, &t_ctx, ff_path);
-            file_cntr++;
+    if (args->output_dir) {
+        output_dir_create(args->output_dir);
+        s_ctx.shard_rec_cnts = calloc(num_threads_used,
+                                      sizeof (*s_ctx.shard_rec_cnts));
+        ABORT_IF(!s_ctx.shard_rec_cnts, E_MEM,
+                 "shard record counts allocation failed");
+    }
 
-            // report that another flow file has been processed
-            progress_report_next();
+    if (args->working_mode == MODE_LIST && !args->time_order_window
+            && !args->passthrough_path && !args->output_dir) {
+        // the master may cancel the listing at any time
+        MPI_Irecv(NULL, 0, MPI_BYTE, ROOT_PROC, TAG_CANCEL, mpi_comm_main,
+                  &s_ctx.cancel_request);
+    }
 
-        }  // end of the parallel loop through all files, no barrier
-        DEBUG("thread processed %" PRIu64 " flow file(s)", file_cntr);
+    if (args->working_mode == MODE_AGGR || args->use_sample_sort) {
+        s_ctx.thread_mems = calloc(num_threads_used,
+                                   sizeof (*s_ctx.thread_mems));
+        ABORT_IF(!s_ctx.thread_mems, E_MEM,
+                 "thread memories array allocation failed");
+        if (args->mem_budget) {
+            s_ctx.thread_spills = calloc(num_threads_used,
+                                         sizeof (*s_ctx.thread_spills));
+            ABORT_IF(!s_ctx.thread_spills, E_MEM,
+                     "thread spills array allocation failed");
+        }
+    }
 
-        // atomic update of the thread-shared counters
-        processed_summ_share(&s_ctx.processed_summ, &t_ctx.processed_summ);
-        metadata_summ_share(&s_ctx.metadata_summ, &t_ctx.metadata_summ);
+    if (args->use_comm_thread) {
+        // the main thread makes all MPI calls for the others (see @ref
+        // xchg_comm), they form a nested team
+        int thread_provided;
+        MPI_Query_thread(&thread_provided);
+        omp_set_max_active_levels(2);
+        #pragma omp parallel num_threads(2)
+        {
+            if (omp_get_num_threads() != 2) {
+                // the runtime granted only one thread, nobody would send
+                ABORT_IF(thread_provided != MPI_THREAD_MULTIPLE, E_MPI,
+                         "unable to start the communication thread required by MPI_THREAD_FUNNELED");
+                WARNING(E_INTERNAL, "unable to start the communication thread, sending directly");
+                xchg_set_comm_thread(false);
+                process_files(&s_ctx, ff_paths, ff_paths_cnt, num_threads_used);
+            } else if (omp_get_thread_num() == 0) {
+                xchg_comm_run();
+            } else {
+                process_files(&s_ctx, ff_paths, ff_paths_cnt, num_threads_used);
+                xchg_comm_stop();
+            }
+        }
+    } else {
+        process_files(&s_ctx, ff_paths, ff_paths_cnt, num_threads_used);
+    }
 
-        // postprocessing required in the parallel section
-        postprocess_mt(&s_ctx, &t_ctx);
+    // the master sends the cancellation in any case
+    MPI_Wait(&s_ctx.cancel_request, MPI_STATUS_IGNORE);
+    xchg_credits_finish();
+    xchg_shm_free();
 
-        thread_ctx_free(&t_ctx);
-    }  // impicit barrier
+    if (args->output_dir) {
+        // the master writes the manifest of all shards
+        MPI_Gatherv(s_ctx.shard_rec_cnts, num_threads_used, MPI_UINT64_T, NULL,
+                    NULL, NULL, MPI_UINT64_T, ROOT_PROC, mpi_comm_main);
+        free(s_ctx.shard_rec_cnts);
+    }
 
     // path array is no longer needed
     path_array_free(ff_paths, ff_paths_cnt);
+    free(s_ctx.thread_mems);
+    free(s_ctx.thread_spills);
 
     // reduce statistic values to the master
     MPI_Reduce(&s_ctx.processed_summ, NULL, STRUCT_PROCESSED_SUMM_ELEMENTS,
                MPI_UINT64_T, MPI_SUM, ROOT_PROC, mpi_comm_main);
     MPI_Reduce(&s_ctx.metadata_summ, NULL, STRUCT_METADATA_SUMM_ELEMENTS,
                MPI_UINT64_T, MPI_SUM, ROOT_PROC, mpi_comm_main);
+
+    if (args->use_slave_format || args->output_dir) {
+        output_free();
+    }
 }
@@ -0,0 +1,432 @@
+/**
+ * @brief Memory-bounded aggregation: spilling of the libnf memory to disk.
+ *
+ * The number of records in the aggregation memory (libnf hash table) is kept
+ * under a limit derived from the memory budget. When the limit is exceeded,
+ * all records of the memory are written into spill files and the memory is
+ * emptied. The records are hash-partitioned by their aggregation key into
+ * SPILL_PARTS_CNT spill files, so each key is stored in exactly one partition.
+ * At the end, the partitions are loaded and aggregated one by one, so only one
+ * partition has to fit in the memory at a time. A single partition is not
+ * split any further, so a partition exceeding the budget on its own (e.g.,
+ * because of a large number of distinct keys) exceeds it also in the memory.
+ * The aggregated partitions may be stored back as runs and read in chunks, so
+ * the final merge does not need all aggregated records in the memory.
+ *
+ * The spill files are created in the scratch directory and unlinked right
+ * away, so they are removed by the system even if the process crashes.
+ */
+
+/*
+ * Copyright 2015-2018 CESNET
+ *
+ * This file is part of Fdistdump.
+ *
+ * Fdistdump is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Fdistdump is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Fdistdump.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"             // for PROJECT_NAME
+
+#include <assert.h>             // for assert
+#include <errno.h>              // for errno
+#include <inttypes.h>           // for fixed-width integer types
+#include <stdbool.h>            // for bool, false, true
+#include <stdio.h>              // for FILE, fdopen, fread, fwrite, ...
+#include <stdlib.h>             // for calloc, free, getenv, mkstemp
+#include <string.h>             // for strerror
+
+#include <unistd.h>             // for close, ftruncate, unlink
+
+#include "common.h"             // for libnf_mem_*, xchg_rec_size_t, ...
+#include "errwarn.h"            // for error/warning/info/debug messages, ...
+#include "spill.h"
+
+
+#define SPILL_REC_OVERHEAD 64  // estimated hash table overhead per record
+#define SPILL_SLACK_DIV 8  // spill when the memory is at least 7/8 full
+#define SPILL_DIR_DEFAULT "/tmp"  // scratch directory if $TMPDIR is not set
+
+
+/*
+ * Data types declarations.
+ */
+struct spill {
+    const struct fields *fields;  // fields of the spilled libnf memory
+    size_t key_size;    // size of the aggregation key of a raw record
+    size_t mem_budget;  // memory budget of the libnf memory in bytes
+
+    uint64_t recs_max;  // record limit of the memory derived from the budget
+    uint64_t recs_known;  // number of records at the last exact count
+    uint64_t writes_unchecked;  // number of writes since the last exact count
+
+    FILE *parts[SPILL_PARTS_CNT];  // spill file of each partition
+    uint64_t spilled_cnt;  // number of spills
+    uint64_t spilled_recs;  // number of spilled records (before merging)
+};
+
+
+/*
+ * Static functions.
+ */
+/**
+ * @brief Compute the partition from the aggregation key (64-bit FNV-1a).
+ *
+ * The key is the prefix of the libnf raw record (see @ref master_merge).
+ */
+static size_t
+spill_part(const struct spill *const sp, const uint8_t *const rec)
+{
+    uint64_t hash = FNV1A_64_OFFSET_BASIS;
+    for (size_t i = 0; i < sp->key_size; ++i) {
+        hash ^= rec[i];
+        hash *= FNV1A_64_PRIME;
+    }
+    return hash % SPILL_PARTS_CNT;
+}
+
+/**
+ * @brief Append the raw record to the spill file.
+ *
+ * Each record is prefixed with its size, as in the exchange buffers.
+ */
+static void
+spill_rec_write(FILE *const file, const uint8_t *const rec,
+                const size_t rec_len)
+{
+    const xchg_rec_size_t rec_size = rec_len;
+    ABORT_IF(fwrite(&rec_size, sizeof (rec_size), 1, file) != 1
+             || fwrite(rec, rec_len, 1, file) != 1, E_INTERNAL,
+             "spill file write failed: %s", strerror(errno));
+}
+
+/**
+ * @brief Read the next raw record from the spill file.
+ *
+ * @return True on success, false on the end of the file.
+ */
+static bool
+spill_rec_read(FILE *const file, uint8_t rec[LNF_MAX_RAW_LEN],
+               xchg_rec_size_t *const rec_size)
+{
+    if (fread(rec_size, sizeof (*rec_size), 1, file) != 1) {
+        ABORT_IF(ferror(file), E_INTERNAL, "spill file read failed");
+        return false;
+    }
+    ABORT_IF(*rec_size > LNF_MAX_RAW_LEN
+             || fread(rec, *rec_size, 1, file) != 1, E_INTERNAL,
+             "spill file read failed");
+    return true;
+}
+
+/**
+ * @brief Create an anonymous (already unlinked) temporary file in the dir.
+ */
+static FILE *
+spill_file_create(const char *const dir)
+{
+    char path[MAX_STR_LEN];
+    const int ret = snprintf(path, sizeof (path), "%s/%s-spill-XXXXXX", dir,
+                             PROJECT_NAME);
+    ABORT_IF(ret < 0 || (size_t)ret >= sizeof (path), E_ARG,
+             "spill directory path `%s' is too long", dir);
+
+    const int fd = mkstemp(path);
+    ABORT_IF(fd == -1, E_INTERNAL, "cannot create spill file `%s': %s", path,
+             strerror(errno));
+    unlink(path);  // the file will be removed after close
+
+    FILE *const file = fdopen(fd, "w+b");
+    if (!file) {
+        close(fd);
+        ABORT(E_INTERNAL, "fdopen(): %s", strerror(errno));
+    }
+
+    return file;
+}
+
+
+/*
+ * Public functions.
+ */
+/**
+ * @brief Create a spill context for one libnf hash table memory.
+ *
+ * @param[in] dir Scratch directory for the spill files, NULL means $TMPDIR or
+ *                /tmp.
+ * @param[in] fields Fields of the libnf memory.
+ * @param[in] mem_budget Memory budget of the libnf memory in bytes.
+ *
+ * @return Pointer to the new spill context.
+ */
+struct spill *
+spill_init(const char *dir, const struct fields *const fields,
+           const size_t mem_budget)
+{
+    assert(fields && fields->aggr_keys_sizes_sum > 0 && mem_budget > 0);
+
+    if (!dir) {
+        dir = getenv("TMPDIR");
+    }
+    if (!dir || dir[0] == '\0') {
+        dir = SPILL_DIR_DEFAULT;
+    }
+
+    struct spill *const sp = calloc(1, sizeof (*sp));
+    ABORT_IF(!sp, E_MEM, "spill context allocation failed");
+
+    sp->fields = fields;
+    sp->key_size = fields->aggr_keys_sizes_sum;
+    sp->mem_budget = mem_budget;
+    for (size_t i = 0; i < SPILL_PARTS_CNT; ++i) {
+        sp->parts[i] = spill_file_create(dir);
+    }
+
+    return sp;
+}
+
+/**
+ * @brief Close and remove the spill files, free the spill context.
+ *
+ * @param[in] sp Spill context.
+ */
+void
+spill_free(struct spill *const sp)
+{
+    assert(sp);
+
+    if (sp->spilled_cnt) {
+        DEBUG("spill: spilled %" PRIu64 " time(s), %" PRIu64 " record(s)",
+              sp->spilled_cnt, sp->spilled_recs);
+    }
+    for (size_t i = 0; i < SPILL_PARTS_CNT; ++i) {
+        fclose(sp->parts[i]);
+    }
+    free(sp);
+}
+
+/**
+ * @brief Account for one write into the libnf memory, spill it if needed.
+ *
+ * Has to be called after each write into the memory. Counting the records in
+ * the libnf memory requires a traversal, so the exact count is computed only
+ * if the upper bound (records at the last count plus writes since then)
+ * exceeds the limit. If the exact count is close to the limit, all records
+ * are spilled and the memory is replaced by a new, empty one.
+ *
+ * @param[in,out] sp Spill context.
+ * @param[in,out] lnf_mem The libnf memory, may be replaced.
+ *
+ * @return True if the memory was spilled, false otherwise.
+ */
+bool
+spill_account(struct spill *const sp, lnf_mem_t **const lnf_mem)
+{
+    assert(sp && lnf_mem && *lnf_mem);
+
+    if (sp->recs_max == 0) {  // first write, the record length is known now
+        const uint64_t rec_size = libnf_mem_rec_len(*lnf_mem)
+            + SPILL_REC_OVERHEAD;
+        sp->recs_max = MAX(sp->mem_budget / rec_size, 1);
+        DEBUG("spill: limiting the memory to %" PRIu64 " record(s)",
+              sp->recs_max);
+    }
+
+    if (sp->recs_known + ++sp->writes_unchecked <= sp->recs_max) {
+        return false;  // the upper bound is under the limit
+    }
+
+    // count the records exactly
+    sp->recs_known = libnf_mem_rec_cnt(*lnf_mem);
+    sp->writes_unchecked = 0;
+    if (sp->recs_known < sp->recs_max - sp->recs_max / SPILL_SLACK_DIV) {
+        return false;
+    }
+
+    spill_mem(sp, *lnf_mem);
+    libnf_mem_free(*lnf_mem);
+    libnf_mem_init_ht(lnf_mem, sp->fields);
+    sp->recs_known = 0;
+
+    return true;
+}
+
+/**
+ * @brief Append all records from the libnf memory to the spill files.
+ *
+ * The memory is not modified.
+ *
+ * @param[in,out] sp Spill context.
+ * @param[in] lnf_mem The libnf memory.
+ */
+void
+spill_mem(struct spill *const sp, lnf_mem_t *const lnf_mem)
+{
+    assert(sp && lnf_mem);
+
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+
+    uint64_t rec_cntr = 0;
+    while (cursor) {
+        uint8_t rec[LNF_MAX_RAW_LEN];
+        int rec_len;
+        lnf_ret = lnf_mem_read_raw_c(lnf_mem, cursor, (char *)rec, &rec_len,
+                                     sizeof (rec));
+        assert(lnf_ret == LNF_OK && (size_t)rec_len >= sp->key_size);
+
+        spill_rec_write(sp->parts[spill_part(sp, rec)], rec, rec_len);
+        rec_cntr++;
+
+        lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
+        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    }
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+    sp->spilled_cnt++;
+    sp->spilled_recs += rec_cntr;
+    DEBUG("spill: spilled %" PRIu64 " record(s)", rec_cntr);
+}
+
+/**
+ * @brief Return true if any records were spilled.
+ *
+ * @param[in] sp Spill context.
+ */
+bool
+spill_used(const struct spill *const sp)
+{
+    assert(sp);
+
+    return sp->spilled_cnt > 0;
+}
+
+/**
+ * @brief Aggregate all records of the partition into the libnf memory.
+ *
+ * The libnf memory has to be an empty hash table or contain only records of
+ * the same partition (e.g., of the same partition of other spill context).
+ *
+ * @param[in,out] sp Spill context.
+ * @param[in] part Partition index, less than SPILL_PARTS_CNT.
+ * @param[out] lnf_mem The libnf memory.
+ */
+void
+spill_load_part(struct spill *const sp, const size_t part,
+                lnf_mem_t *const lnf_mem)
+{
+    assert(sp && part < SPILL_PARTS_CNT && lnf_mem);
+
+    FILE *const file = sp->parts[part];
+    rewind(file);
+
+    uint8_t rec[LNF_MAX_RAW_LEN];
+    xchg_rec_size_t rec_size;
+    while (spill_rec_read(file, rec, &rec_size)) {
+        const int lnf_ret = lnf_mem_write_raw(lnf_mem, (char *)rec, rec_size);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write_raw()");
+    }
+}
+
+/**
+ * @brief Replace the partition by a run: the records of the libnf memory.
+ *
+ * The records are written in the order of the memory cursor, so a sorted
+ * memory yields a sorted run. The memory should be the aggregated partition
+ * (see spill_load_part()), its records can be then read back in chunks by
+ * spill_load_chunk() from the beginning of the run.
+ *
+ * @param[in,out] sp Spill context.
+ * @param[in] part Partition index, less than SPILL_PARTS_CNT.
+ * @param[in] lnf_mem The libnf memory.
+ * @param[in] rec_limit Store at most rec_limit records, 0 means no limit.
+ */
+void
+spill_store_part(struct spill *const sp, const size_t part,
+                 lnf_mem_t *const lnf_mem, const uint64_t rec_limit)
+{
+    assert(sp && part < SPILL_PARTS_CNT && lnf_mem);
+
+    FILE *const file = sp->parts[part];
+    rewind(file);
+    ABORT_IF(ftruncate(fileno(file), 0) != 0, E_INTERNAL,
+             "spill file truncation failed: %s", strerror(errno));
+
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
+    assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+
+    for (uint64_t i = 0; cursor && (rec_limit == 0 || i < rec_limit); ++i) {
+        uint8_t rec[LNF_MAX_RAW_LEN];
+        int rec_len;
+        lnf_ret = lnf_mem_read_raw_c(lnf_mem, cursor, (char *)rec, &rec_len,
+                                     sizeof (rec));
+        assert(lnf_ret == LNF_OK);
+        spill_rec_write(file, rec, rec_len);
+
+        lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
+        assert((cursor && lnf_ret == LNF_OK) || (!cursor && lnf_ret == LNF_EOF));
+    }
+    (void)lnf_ret;  // to suppress -Wunused-variable with -DNDEBUG
+
+    ABORT_IF(fflush(file) != 0, E_INTERNAL, "spill file write failed: %s",
+             strerror(errno));
+    rewind(file);
+}
+
+/**
+ * @brief Read the next chunk of the run into the libnf memory.
+ *
+ * The run has to be stored by spill_store_part() first. Records of the run
+ * have unique aggregation keys, so the memory holds exactly the records read.
+ *
+ * @param[in,out] sp Spill context.
+ * @param[in] part Partition index, less than SPILL_PARTS_CNT.
+ * @param[out] lnf_mem Empty libnf hash table memory.
+ * @param[in] recs_max Maximum number of records to read.
+ *
+ * @return Number of records read, zero if the run is exhausted.
+ */
+uint64_t
+spill_load_chunk(struct spill *const sp, const size_t part,
+                 lnf_mem_t *const lnf_mem, const uint64_t recs_max)
+{
+    assert(sp && part < SPILL_PARTS_CNT && lnf_mem && recs_max > 0);
+
+    uint64_t rec_cntr = 0;
+    uint8_t rec[LNF_MAX_RAW_LEN];
+    xchg_rec_size_t rec_size;
+    while (rec_cntr < recs_max && spill_rec_read(sp->parts[part], rec,
+                                                 &rec_size)) {
+        const int lnf_ret = lnf_mem_write_raw(lnf_mem, (char *)rec, rec_size);
+        ABORT_IF(lnf_ret != LNF_OK, E_LNF, "lnf_mem_write_raw()");
+        rec_cntr++;
+    }
+
+    return rec_cntr;
+}
+
+/**
+ * @brief Return the record count of a chunk, so that one chunk of each run
+ *        fits into the memory budget together.
+ *
+ * @param[in] sp Spill context, with at least one spill.
+ */
+uint64_t
+spill_chunk_recs(const struct spill *const sp)
+{
+    assert(sp && sp->recs_max > 0);
+
+    return MAX(sp->recs_max / SPILL_PARTS_CNT, 1);
+}
@@ -0,0 +1,70 @@
+/**
+ * @brief Memory-bounded aggregation: spilling of the libnf memory to disk.
+ */
+
+/*
+ * Copyright 2015-2018 CESNET
+ *
+ * This file is part of Fdistdump.
+ *
+ * Fdistdump is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Fdistdump is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Fdistdump.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
+#include <stdint.h>             // for uint64_t
+
+#include <libnf.h>              // for lnf_mem_t
+
+#include "fields.h"             // for struct fields
+
+
+#define SPILL_PARTS_CNT 64  // number of hash partitions of the spilled records
+
+
+struct spill;  // opaque spill context
+
+
+struct spill *
+spill_init(const char *dir, const struct fields *const fields,
+           const size_t mem_budget);
+
+void
+spill_free(struct spill *const sp);
+
+bool
+spill_account(struct spill *const sp, lnf_mem_t **const lnf_mem);
+
+void
+spill_mem(struct spill *const sp, lnf_mem_t *const lnf_mem);
+
+bool
+spill_used(const struct spill *const sp);
+
+void
+spill_load_part(struct spill *const sp, const size_t part,
+                lnf_mem_t *const lnf_mem);
+
+void
+spill_store_part(struct spill *const sp, const size_t part,
+                 lnf_mem_t *const lnf_mem, const uint64_t rec_limit);
+
+uint64_t
+spill_load_chunk(struct spill *const sp, const size_t part,
+                 lnf_mem_t *const lnf_mem, const uint64_t recs_max);
+
+uint64_t
+spill_chunk_recs(const struct spill *const sp);
@@ -0,0 +1,2451 @@
+/**
+ * @brief Exchange of flow records between the processes.
+ *
+ * Records are exchanged in messages of at most xchg_get_buff_size() bytes. Each
+ * record in a message is prefixed with its size (xchg_rec_size_t). An empty
+ * message is a terminator, each source sends exactly one terminator after its
+ * last record.
+ *
+ * If the compact encoding is enabled (see @ref xchg_compact), a record may be
+ * stored encoded. Such record has XCHG_REC_COMPACT set in its size prefix and
+ * the rest of the prefix is the size of the encoded record. The receiving side
+ * decodes the records transparently, so both encoded and plain records may be
+ * mixed in a single message.
+ *
+ * Records of a single stream usually have the same size, so the prefixes may
+ * be dropped by the fixed-width layout (see @ref xchg_fixed). Such message
+ * starts with a header with XCHG_MSG_FIXED set in its first word and stores
+ * the records either row by row or column by column.
+ *
+ * If the compression is enabled (see @ref xchg_compress), the whole message
+ * may be compressed. Such message has XCHG_MSG_COMPRESSED set in its first
+ * word, which is otherwise the size prefix of the first record.
+ */
+
+/*
+ * Copyright 2015-2018 CESNET
+ *
+ * This file is part of Fdistdump.
+ *
+ * Fdistdump is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Fdistdump is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Fdistdump.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "xchg.h"
+
+#include "config.h"             // for ENABLE_LZ4
+
+#include <assert.h>             // for assert
+#include <limits.h>             // for INT_MAX
+#include <stdatomic.h>          // for atomic_load, atomic_store, ...
+#include <inttypes.h>           // for PRIu64
+#include <stdbool.h>            // for bool, false, true
+#include <stdint.h>             // for SIZE_MAX, UINT16_MAX, UINT32_C
+#include <stdlib.h>             // for free, malloc
+#include <string.h>             // for memcpy, memset
+#include <time.h>               // for nanosleep, clock_gettime, timespec
+
+#include <libnf.h>              // for lnf_mem_first_c, lnf_mem_read_raw_c, ...
+#include <mpi.h>                // for MPI_Isend, MPI_Irecv, MPI_Wait, ...
+#ifdef ENABLE_LZ4
+#include <lz4.h>                // for LZ4_compress_default, ...
+#endif  // ENABLE_LZ4
+
+#include "common.h"             // for mpi_comm_main, MIN, MAX, ...
+#include "errwarn.h"            // for error/warning/info/debug messages, ...
+
+
+#define XCHG_POLL_INTERVAL_MIN 1000  // 1 us
+#define XCHG_POLL_INTERVAL_MAX 1000000  // 1 ms
+
+static size_t xchg_buff_size = XCHG_BUFF_SIZE;  // size of the messages
+
+
+/**
+ * @brief Set the maximum size of the exchanged messages.
+ *
+ * Has to be the same on all processes, it is the size of both the send and
+ * the receive buffers.
+ *
+ * @param[in] buff_size Size of the messages in bytes.
+ */
+void
+xchg_set_buff_size(const size_t buff_size)
+{
+    assert(buff_size >= XCHG_BUFF_SIZE_MIN && buff_size <= XCHG_BUFF_SIZE_MAX);
+    xchg_buff_size = buff_size;
+}
+
+size_t
+xchg_get_buff_size(void)
+{
+    return xchg_buff_size;
+}
+
+/**
+ * @brief Return a monotonic time in seconds.
+ *
+ * Unlike MPI_Wtime(), it may be called by the worker threads also under
+ * MPI_THREAD_FUNNELED (see @ref xchg_comm).
+ */
+static double
+monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * @defgroup xchg_compact Compact encoding of the exchanged records.
+ *
+ * Most of the flow data are IPv4 flows with small counters, but libnf stores
+ * every address in a 16 bytes long lnf_ip_t (an IPv4 address occupies only
+ * the last 4 bytes, the rest are zeros) and every counter in 8 bytes. The
+ * encoding is independent of the record layout, so it works for both the
+ * libnf raw records and the fdistdump records: the record is treated as a
+ * sequence of 4 bytes long words (in the host byte order) and each word is
+ * stored using 0, 1, 2 or 4 bytes. Zero words (e.g., the first 12 bytes of an
+ * IPv4 address or the upper half of a small counter) occupy no space, IPv6
+ * addresses are stored in full.
+ *
+ * The encoded record consists of:
+ *   - the length of the decoded record (uint16_t),
+ *   - 2 bit long width codes of the words, four codes per byte,
+ *   - the non-zero bytes of the words (least significant byte first),
+ *   - the trailing bytes of the record not forming a whole word, unchanged.
+ *
+ * A record is sent encoded only if the encoded form is shorter.
+ *
+ * @{
+ */
+#define XCHG_COMPACT_WORD_SIZE 4
+
+static bool xchg_compact = false;  // is the compact encoding enabled?
+
+
+/**
+ * @brief Return the width code (and the number of bytes) of the word.
+ */
+static inline uint8_t
+compact_word_code(const uint32_t word)
+{
+    if (word == 0) {
+        return 0;
+    } else if (word <= UINT8_MAX) {
+        return 1;
+    } else if (word <= UINT16_MAX) {
+        return 2;
+    } else {
+        return 3;
+    }
+}
+
+/**
+ * @brief Try to encode the record into the destination buffer.
+ *
+ * @param[in] rec Plain record.
+ * @param[in] rec_len Length of the plain record.
+ * @param[out] dst Destination buffer.
+ * @param[in] dst_size Size of the destination buffer.
+ *
+ * @return Length of the encoded record, 0 if the record was not encoded
+ *         (encoded form would not be shorter or it does not fit).
+ */
+static size_t
+compact_encode(const uint8_t *const rec, const size_t rec_len,
+               uint8_t *const dst, const size_t dst_size)
+{
+    assert(rec && dst);
+
+    if (rec_len > XCHG_COMPACT_REC_LEN_MAX) {
+        return 0;
+    }
+    const size_t words_cnt = rec_len / XCHG_COMPACT_WORD_SIZE;
+    const size_t tail_len = rec_len % XCHG_COMPACT_WORD_SIZE;
+    const size_t codes_len = (words_cnt + 3) / 4;
+    // the worst case (all words are full) has to fit into the buffer
+    if (sizeof (uint16_t) + codes_len + rec_len > dst_size) {
+        return 0;
+    }
+
+    const uint16_t len16 = rec_len;
+    memcpy(dst, &len16, sizeof (len16));
+    uint8_t *const codes = dst + sizeof (len16);
+    memset(codes, 0, codes_len);
+    uint8_t *out = codes + codes_len;
+
+    for (size_t i = 0; i < words_cnt; ++i) {
+        uint32_t word;
+        memcpy(&word, rec + i * XCHG_COMPACT_WORD_SIZE, sizeof (word));
+
+        const uint8_t code = compact_word_code(word);
+        codes[i / 4] |= code << (2 * (i % 4));
+        const size_t width = (code == 3) ? 4 : code;
+        for (size_t b = 0; b < width; ++b) {
+            *out++ = word >> (8 * b);
+        }
+    }
+    memcpy(out, rec + words_cnt * XCHG_COMPACT_WORD_SIZE, tail_len);
+    out += tail_len;
+
+    const size_t enc_len = out - dst;
+    return (enc_len < rec_len) ? enc_len : 0;
+}
+
+/**
+ * @brief Decode the record encoded by compact_encode().
+ *
+ * @param[in] enc Encoded record.
+ * @param[in] enc_len Length of the encoded record.
+ * @param[out] dst Destination buffer of at least XCHG_COMPACT_REC_LEN_MAX
+ *                 bytes.
+ *
+ * @return Length of the decoded record.
+ */
+static size_t
+compact_decode(const uint8_t *const enc, const size_t enc_len,
+               uint8_t *const dst)
+{
+    assert(enc && enc_len >= sizeof (uint16_t) && dst);
+
+    uint16_t len16;
+    memcpy(&len16, enc, sizeof (len16));
+    const size_t rec_len = len16;
+    ABORT_IF(rec_len > XCHG_COMPACT_REC_LEN_MAX, E_INTERNAL,
+             "invalid compact record length %zu", rec_len);
+
+    const size_t words_cnt = rec_len / XCHG_COMPACT_WORD_SIZE;
+    const size_t tail_len = rec_len % XCHG_COMPACT_WORD_SIZE;
+    const uint8_t *const codes = enc + sizeof (len16);
+    const uint8_t *in = codes + (words_cnt + 3) / 4;
+
+    for (size_t i = 0; i < words_cnt; ++i) {
+        const uint8_t code = (codes[i / 4] >> (2 * (i % 4))) & 0x3;
+        const size_t width = (code == 3) ? 4 : code;
+        uint32_t word = 0;
+        for (size_t b = 0; b < width; ++b) {
+            word |= (uint32_t)*in++ << (8 * b);
+        }
+        memcpy(dst + i * XCHG_COMPACT_WORD_SIZE, &word, sizeof (word));
+    }
+    memcpy(dst + words_cnt * XCHG_COMPACT_WORD_SIZE, in, tail_len);
+    in += tail_len;
+
+    ABORT_IF((size_t)(in - enc) != enc_len, E_INTERNAL,
+             "corrupted compact record");
+    return rec_len;
+}
+
+
+/**
+ * @brief Enable or disable the compact encoding of the sent records.
+ *
+ * Receiving is not affected, encoded records are always decoded.
+ *
+ * @param[in] compact Enable the compact encoding?
+ */
+void
+xchg_set_compact(const bool compact)
+{
+    xchg_compact = compact;
+}
+
+/**
+ * @brief Write the record with its size prefix into the buffer.
+ *
+ * The record is encoded if the compact encoding is enabled and it pays off.
+ *
+ * @param[out] dst Destination in the message buffer.
+ * @param[in] dst_size Remaining space in the message buffer.
+ * @param[in] rec Plain record.
+ * @param[in] rec_len Length of the plain record.
+ *
+ * @return Number of bytes written (including the prefix), 0 if the record does
+ *         not fit into the buffer.
+ */
+size_t
+xchg_rec_put(uint8_t *const dst, const size_t dst_size,
+             const uint8_t *const rec, const size_t rec_len)
+{
+    assert(dst && rec);
+
+    if (dst_size < sizeof (xchg_rec_size_t)) {
+        return 0;
+    }
+    uint8_t *const data = dst + sizeof (xchg_rec_size_t);
+    const size_t data_size = dst_size - sizeof (xchg_rec_size_t);
+
+    xchg_rec_size_t prefix;
+    size_t data_len = 0;
+    if (xchg_compact) {
+        data_len = compact_encode(rec, rec_len, data, data_size);
+    }
+    if (data_len) {  // encoded
+        prefix = data_len | XCHG_REC_COMPACT;
+    } else {  // plain
+        if (rec_len > data_size) {
+            return 0;
+        }
+        memcpy(data, rec, rec_len);
+        data_len = rec_len;
+        prefix = rec_len;
+    }
+    memcpy(dst, &prefix, sizeof (prefix));
+
+    return sizeof (prefix) + data_len;
+}
+
+/**
+ * @brief Read the record with its size prefix from the buffer.
+ *
+ * Encoded records are decoded into the scratch buffer, plain records are
+ * returned in place.
+ *
+ * @param[in,out] src Pointer to the record prefix, moved behind the record.
+ * @param[out] scratch Buffer of at least XCHG_COMPACT_REC_LEN_MAX bytes.
+ * @param[out] rec_len Length of the plain record.
+ *
+ * @return Pointer to the plain record.
+ */
+uint8_t *
+xchg_rec_get(uint8_t **const src, uint8_t *const scratch,
+             xchg_rec_size_t *const rec_len)
+{
+    assert(src && *src && scratch && rec_len);
+
+    xchg_rec_size_t prefix;
+    memcpy(&prefix, *src, sizeof (prefix));
+    uint8_t *const data = *src + sizeof (prefix);
+
+    if (prefix & XCHG_REC_COMPACT) {
+        const size_t data_len = prefix & ~XCHG_REC_COMPACT;
+        *rec_len = compact_decode(data, data_len, scratch);
+        *src = data + data_len;
+        return scratch;
+    } else {
+        *rec_len = prefix;
+        *src = data + prefix;
+        return data;
+    }
+}
+/**
+ * @}
+ */  // xchg_compact
+
+
+/**
+ * @defgroup xchg_fixed Fixed-width layout of the exchanged messages.
+ *
+ * All records of a fixed-width message have the same size, so they are stored
+ * without the size prefixes. The message consists of:
+ *   - the header (struct fixed_hdr),
+ *   - col_cnt sizes of the columns (uint32_t each, only for the column
+ *     layout),
+ *   - rec_cnt records of rec_size bytes.
+ * In the row layout (col_cnt is zero), the records are stored one after
+ * another. In the column layout, the records are split into columns of the
+ * given sizes (e.g., the fields) and the columns are stored one after
+ * another, each of them containing the values of all records. Columns of
+ * equally sized values are well suited for the compression and for the
+ * processing of whole columns at once.
+ *
+ * The first word of the header has XCHG_MSG_FIXED set and the format version
+ * in the low bits. The size prefix of a record never has XCHG_MSG_FIXED set,
+ * so the receiver tells the fixed-width messages apart by the first word.
+ * The compact encoding is not used in the fixed-width messages.
+ *
+ * @{
+ */
+struct fixed_hdr {
+    xchg_rec_size_t magic;  // XCHG_MSG_FIXED | XCHG_FIXED_VERSION
+    uint32_t rec_cnt;  // number of records
+    uint32_t rec_size;  // size of each record
+    uint32_t col_cnt;  // number of columns, 0 for the row layout
+};
+
+static enum xchg_layout xchg_layout = XCHG_LAYOUT_PREFIXED;
+
+
+/**
+ * @brief Return the size of the header including the column sizes.
+ */
+static size_t
+fixed_hdr_size(const size_t col_cnt)
+{
+    return sizeof (struct fixed_hdr) + col_cnt * sizeof (uint32_t);
+}
+
+/**
+ * @brief Set the layout of the records in the sent messages.
+ *
+ * Receiving is not affected, all layouts are always accepted.
+ *
+ * @param[in] layout The layout.
+ */
+void
+xchg_set_layout(const enum xchg_layout layout)
+{
+    xchg_layout = layout;
+}
+
+enum xchg_layout
+xchg_get_layout(void)
+{
+    return xchg_layout;
+}
+
+/**
+ * @brief Start writing a fixed-width message into the buffer.
+ *
+ * The record size is given by the first record written by xchg_fixed_put().
+ *
+ * @param[out] fx The message context.
+ * @param[out] msg The message buffer.
+ * @param[in] msg_size Size of the message buffer.
+ * @param[in] col_cnt Number of columns, 0 for the row layout.
+ * @param[in] col_sizes Sizes of the columns, their sum is the record size.
+ */
+void
+xchg_fixed_init(struct xchg_fixed *const fx, uint8_t *const msg,
+                const size_t msg_size, const size_t col_cnt,
+                const size_t col_sizes[])
+{
+    assert(fx && msg && col_cnt <= XCHG_FIXED_COLS_MAX
+           && (col_cnt == 0 || col_sizes)
+           && msg_size > fixed_hdr_size(col_cnt));
+
+    fx->msg = msg;
+    fx->msg_size = msg_size;
+    fx->rec_size = 0;
+    fx->rec_cnt = 0;
+    fx->rec_cap = 0;
+    fx->col_cnt = col_cnt;
+    for (size_t i = 0; i < col_cnt; ++i) {
+        fx->col_sizes[i] = col_sizes[i];
+    }
+    fx->data = msg + fixed_hdr_size(col_cnt);
+}
+
+/**
+ * @brief Append the record to the fixed-width message.
+ *
+ * In the column layout, the columns are written into slots for rec_cap
+ * records and moved together by xchg_fixed_finish().
+ *
+ * @param[in,out] fx The message context.
+ * @param[in] rec The record.
+ * @param[in] rec_len Length of the record, the same for all records.
+ *
+ * @return Number of bytes written, 0 if the message is full.
+ */
+size_t
+xchg_fixed_put(struct xchg_fixed *const fx, const uint8_t *const rec,
+               const size_t rec_len)
+{
+    assert(fx && rec && rec_len > 0);
+
+    if (fx->rec_cnt == 0) {  // first record, the record size is known now
+        fx->rec_size = rec_len;
+        fx->rec_cap = (fx->msg_size - fixed_hdr_size(fx->col_cnt)) / rec_len;
+    }
+    assert(rec_len == fx->rec_size);
+    if (fx->rec_cnt == fx->rec_cap) {
+        return 0;
+    }
+
+    if (fx->col_cnt == 0) {
+        memcpy(fx->data + fx->rec_cnt * rec_len, rec, rec_len);
+    } else {
+        size_t col_off = 0;  // offset of the column in the record
+        for (size_t i = 0; i < fx->col_cnt; ++i) {
+            const size_t col_size = fx->col_sizes[i];
+            memcpy(fx->data + col_off * fx->rec_cap + fx->rec_cnt * col_size,
+                   rec + col_off, col_size);
+            col_off += col_size;
+        }
+        assert(col_off == rec_len);
+    }
+    fx->rec_cnt++;
+
+    return rec_len;
+}
+
+/**
+ * @brief Finish the fixed-width message, fill in the header.
+ *
+ * @param[in,out] fx The message context.
+ *
+ * @return Size of the message, 0 if it contains no records.
+ */
+size_t
+xchg_fixed_finish(struct xchg_fixed *const fx)
+{
+    assert(fx);
+
+    if (fx->rec_cnt == 0) {
+        return 0;
+    }
+
+    // close the gaps between the partially filled columns
+    size_t col_off = 0;
+    for (size_t i = 0; i < fx->col_cnt; ++i) {
+        memmove(fx->data + col_off * fx->rec_cnt,
+                fx->data + col_off * fx->rec_cap,
+                fx->rec_cnt * fx->col_sizes[i]);
+        col_off += fx->col_sizes[i];
+
+        const uint32_t col_size = fx->col_sizes[i];
+        memcpy(fx->msg + fixed_hdr_size(i), &col_size, sizeof (col_size));
+    }
+
+    const struct fixed_hdr hdr = {
+        .magic = XCHG_MSG_FIXED | XCHG_FIXED_VERSION,
+        .rec_cnt = fx->rec_cnt,
+        .rec_size = fx->rec_size,
+        .col_cnt = fx->col_cnt,
+    };
+    memcpy(fx->msg, &hdr, sizeof (hdr));
+
+    return fixed_hdr_size(fx->col_cnt) + fx->rec_cnt * fx->rec_size;
+}
+
+/**
+ * @brief Parse the header of the message if it is a fixed-width message.
+ *
+ * @param[out] fx The message context.
+ * @param[in] msg The received (uncompressed) message.
+ * @param[in] msg_size Size of the message.
+ *
+ * @return True if the message is a fixed-width message, false otherwise.
+ */
+bool
+xchg_fixed_parse(struct xchg_fixed *const fx, uint8_t *const msg,
+                 const size_t msg_size)
+{
+    assert(fx && msg);
+
+    struct fixed_hdr hdr;
+    if (msg_size < sizeof (hdr)) {
+        return false;
+    }
+    memcpy(&hdr, msg, sizeof (hdr));
+    if ((hdr.magic & (XCHG_REC_COMPACT | XCHG_MSG_FIXED)) != XCHG_MSG_FIXED) {
+        return false;  // the size prefix of the first record
+    }
+
+    ABORT_IF((hdr.magic & ~XCHG_MSG_FIXED) != XCHG_FIXED_VERSION, E_INTERNAL,
+             "unsupported fixed-width message version %" PRIu32,
+             hdr.magic & ~XCHG_MSG_FIXED);
+    ABORT_IF(hdr.col_cnt > XCHG_FIXED_COLS_MAX || hdr.rec_size == 0
+             || msg_size != fixed_hdr_size(hdr.col_cnt)
+                            + (size_t)hdr.rec_cnt * hdr.rec_size, E_INTERNAL,
+             "corrupted fixed-width message");
+
+    fx->msg = msg;
+    fx->msg_size = msg_size;
+    fx->rec_size = hdr.rec_size;
+    fx->rec_cnt = hdr.rec_cnt;
+    fx->rec_cap = hdr.rec_cnt;
+    fx->col_cnt = hdr.col_cnt;
+    size_t col_sizes_sum = 0;
+    for (size_t i = 0; i < fx->col_cnt; ++i) {
+        uint32_t col_size;
+        memcpy(&col_size, msg + fixed_hdr_size(i), sizeof (col_size));
+        fx->col_sizes[i] = col_size;
+        col_sizes_sum += col_size;
+    }
+    ABORT_IF(fx->col_cnt && col_sizes_sum != fx->rec_size, E_INTERNAL,
+             "corrupted fixed-width message");
+    fx->data = msg + fixed_hdr_size(fx->col_cnt);
+
+    return true;
+}
+
+/**
+ * @brief Return the record of the fixed-width message.
+ *
+ * Records of the row layout are returned in place, records of the column
+ * layout are gathered into the scratch buffer.
+ *
+ * @param[in] fx The parsed message context.
+ * @param[in] idx Index of the record, less than rec_cnt.
+ * @param[out] scratch Buffer of at least rec_size bytes.
+ *
+ * @return Pointer to the record.
+ */
+uint8_t *
+xchg_fixed_get(const struct xchg_fixed *const fx, const size_t idx,
+               uint8_t *const scratch)
+{
+    assert(fx && idx < fx->rec_cnt && scratch);
+
+    if (fx->col_cnt == 0) {
+        return fx->data + idx * fx->rec_size;
+    }
+
+    size_t col_off = 0;
+    for (size_t i = 0; i < fx->col_cnt; ++i) {
+        const size_t col_size = fx->col_sizes[i];
+        memcpy(scratch + col_off,
+               fx->data + col_off * fx->rec_cnt + idx * col_size, col_size);
+        col_off += col_size;
+    }
+    return scratch;
+}
+/**
+ * @}
+ */  // xchg_fixed
+
+
+/**
+ * @defgroup xchg_compress Compression of the exchanged messages.
+ *
+ * Messages of the record streams received by xchg_recv_loop() may be
+ * compressed by LZ4 (only if built with ENABLE_LZ4). The compressed message
+ * consists of:
+ *   - the header, a xchg_rec_size_t word with XCHG_MSG_COMPRESSED set and the
+ *     size of the uncompressed message in the rest of the bits,
+ *   - the LZ4 compressed block of the uncompressed message.
+ * The size prefix of a record never has XCHG_MSG_COMPRESSED set, so the
+ * receiver tells the compressed messages apart by the first word and both
+ * kinds of messages may be mixed in a single stream.
+ *
+ * A message is sent compressed only if it shrinks at least by
+ * 1/XCHG_COMPRESS_GAIN_DIV. Otherwise, the compression does not pay off for
+ * this data and the next messages of the sender (see @ref xchg_ring) are sent
+ * uncompressed without trying, the number of the skipped messages doubles
+ * with each failure (up to XCHG_COMPRESS_SKIP_MAX) and resets after a
+ * success.
+ *
+ * @{
+ */
+#define XCHG_COMPRESS_GAIN_DIV 8  // compress if it saves at least 1/8
+#define XCHG_COMPRESS_SKIP_MAX 64  // max. messages sent without trying
+
+static bool xchg_compress = false;  // is the compression enabled?
+
+
+/**
+ * @brief Enable or disable the compression of the sent messages.
+ *
+ * Receiving is not affected, compressed messages are always decompressed.
+ * Without ENABLE_LZ4, the compression cannot be enabled.
+ *
+ * @param[in] compress Enable the compression?
+ */
+void
+xchg_set_compress(const bool compress)
+{
+#ifdef ENABLE_LZ4
+    xchg_compress = compress;
+#else
+    if (compress) {
+        WARNING(E_ARG, "compression disabled, built without LZ4 support");
+    }
+    xchg_compress = false;
+#endif  // ENABLE_LZ4
+}
+
+#ifdef ENABLE_LZ4
+/**
+ * @brief Compress the message with the header into the destination buffer.
+ *
+ * The compressed message has to be shorter by at least 1/GAIN_DIV.
+ *
+ * @return Size of the compressed message including the header, 0 if the
+ *         compression does not pay off.
+ */
+static size_t
+msg_compress(const uint8_t *const msg, const size_t msg_size,
+             uint8_t *const dst, const size_t dst_size)
+{
+    assert(msg && msg_size > 0 && dst && dst_size > sizeof (xchg_rec_size_t));
+
+    const xchg_rec_size_t header = msg_size | XCHG_MSG_COMPRESSED;
+    const size_t compressed_max = msg_size - msg_size / XCHG_COMPRESS_GAIN_DIV
+        - sizeof (header);
+    const int compressed_size = LZ4_compress_default(
+            (const char *)msg, (char *)dst + sizeof (header), msg_size,
+            MIN(compressed_max, dst_size - sizeof (header)));
+    if (compressed_size <= 0) {
+        return 0;
+    }
+
+    memcpy(dst, &header, sizeof (header));
+    return sizeof (header) + compressed_size;
+}
+#endif  // ENABLE_LZ4
+
+/**
+ * @brief Return the uncompressed message.
+ *
+ * Compressed messages are decompressed into the scratch buffer, which is
+ * allocated on the first use (the caller frees it), uncompressed messages are
+ * returned as they are.
+ *
+ * @param[in] msg The received message.
+ * @param[in,out] msg_size Size of the received message, updated to the size of
+ *                         the uncompressed message.
+ * @param[in,out] scratch Pointer to the scratch buffer of the message size
+ *                        (see xchg_get_buff_size()), NULL if not allocated
+ *                        yet.
+ *
+ * @return The uncompressed message.
+ */
+uint8_t *
+xchg_msg_unpack(uint8_t *const msg, size_t *const msg_size,
+                uint8_t **const scratch)
+{
+    assert(msg && msg_size && scratch);
+
+    xchg_rec_size_t header;
+    if (*msg_size < sizeof (header)) {
+        return msg;
+    }
+    memcpy(&header, msg, sizeof (header));
+    if (!(header & XCHG_MSG_COMPRESSED) || (header & XCHG_REC_COMPACT)) {
+        return msg;  // the size prefix of the first record
+    }
+
+#ifdef ENABLE_LZ4
+    const size_t plain_size = header & ~XCHG_MSG_COMPRESSED;
+    ABORT_IF(plain_size > xchg_buff_size, E_INTERNAL,
+             "invalid compressed message size %zu", plain_size);
+    if (!*scratch) {
+        *scratch = malloc(xchg_buff_size);
+        ABORT_IF(!*scratch, E_MEM, "decompression buffer allocation failed");
+    }
+
+    const int ret = LZ4_decompress_safe((const char *)msg + sizeof (header),
+                                        (char *)*scratch,
+                                        *msg_size - sizeof (header),
+                                        xchg_buff_size);
+    ABORT_IF(ret < 0 || (size_t)ret != plain_size, E_INTERNAL,
+             "corrupted compressed message");
+    *msg_size = plain_size;
+    return *scratch;
+#else
+    ABORT(E_INTERNAL, "received a compressed message, built without LZ4 support");
+#endif  // ENABLE_LZ4
+}
+/**
+ * @}
+ */  // xchg_compress
+
+
+/**
+ * @defgroup xchg_credits Credit-based flow control of the record exchange.
+ *
+ * Without a flow control, the senders push messages as fast as they can read
+ * the records and the MPI library of the receiver buffers all of the
+ * unexpected messages, so the memory of the receiver (usually the master) is
+ * not bounded. With the flow control enabled, each sending process may have
+ * at most a window of messages unprocessed by the receiver. Every message sent
+ * by xchg_ring_send() consumes a credit and the receiver returns the credit
+ * (TAG_CREDIT) after the message is processed by xchg_recv_loop(). A sender
+ * without credits waits for one, so the receiver memory is bounded by the
+ * window times the number of the sending processes and each sending process
+ * gets an equal share of it.
+ *
+ * The credits are per process, not per thread, because all threads of a
+ * process send with the same source rank. Terminators do not consume credits.
+ * The receiver does not wait for its credit messages to be delivered, the
+ * senders may be busy (e.g., waiting in a collective operation). All of the
+ * outstanding credits are settled by xchg_credits_finish() at the end.
+ *
+ * @{
+ */
+// receiver side credits of one source process
+struct credit_grant {
+    uint32_t pending;  // processed messages not returned yet
+    uint32_t values[2];  // credit messages (the second for the final one)
+    MPI_Request requests[2];
+};
+
+// receiver side credits of one receiving loop, kept until settled
+struct credit_grants {
+    struct credit_grant *grants;  // indexed by the source rank
+    size_t grants_cnt;
+    size_t pending_cnt;  // number of sources with pending credits
+    struct credit_grants *next;
+};
+
+static size_t credit_window = 0;  // credits of each sending process, 0 is off
+static uint64_t credits_used = 0;  // number of messages sent under the credits
+static uint64_t credits_returned = 0;  // number of credits received back
+static uint64_t credit_wait_cnt = 0;  // number of waits for a credit
+static double credit_wait_time = 0.0;  // time spent waiting for credits
+static struct credit_grants *grants_unsettled = NULL;
+
+
+/**
+ * @brief Take a credit before sending a message, wait for it if necessary.
+ *
+ * Credits are shared by all threads of the process, a thread without a credit
+ * blocks the others until the credit arrives.
+ */
+static void
+credit_take(void)
+{
+    #pragma omp critical (xchg_credits)
+    {
+        if (credits_used - credits_returned >= credit_window) {
+            const double wait_start = MPI_Wtime();
+            do {
+                uint32_t credits;
+                MPI_Recv(&credits, 1, MPI_UINT32_T, MPI_ANY_SOURCE, TAG_CREDIT,
+                         mpi_comm_main, MPI_STATUS_IGNORE);
+                credits_returned += credits;
+            } while (credits_used - credits_returned >= credit_window);
+            credit_wait_time += MPI_Wtime() - wait_start;
+            credit_wait_cnt++;
+        }
+        credits_used++;
+    }
+}
+
+/**
+ * @brief Take a credit if one is available, never wait.
+ *
+ * @return True if the credit was taken, false otherwise.
+ */
+static bool
+credit_try_take(void)
+{
+    bool taken = false;
+    #pragma omp critical (xchg_credits)
+    {
+        if (credits_used - credits_returned < credit_window) {
+            credits_used++;
+            taken = true;
+        }
+    }
+    return taken;
+}
+
+/**
+ * @brief Add the credits received from a receiver.
+ */
+static void
+credits_add(const uint32_t credits)
+{
+    #pragma omp critical (xchg_credits)
+    {
+        credits_returned += credits;
+    }
+}
+
+/**
+ * @brief Allocate the credits of one receiving loop.
+ *
+ * @return The credits, NULL if the flow control is disabled.
+ */
+static struct credit_grants *
+credit_grants_init(void)
+{
+    if (!credit_window) {
+        return NULL;
+    }
+
+    int world_size;
+    MPI_Comm_size(mpi_comm_main, &world_size);
+
+    struct credit_grants *const cg = calloc(1, sizeof (*cg));
+    ABORT_IF(!cg, E_MEM, "credits allocation failed");
+    cg->grants_cnt = world_size;
+    cg->grants = calloc(cg->grants_cnt, sizeof (*cg->grants));
+    ABORT_IF(!cg->grants, E_MEM, "credits allocation failed");
+    for (size_t i = 0; i < cg->grants_cnt; ++i) {
+        cg->grants[i].requests[0] = MPI_REQUEST_NULL;
+        cg->grants[i].requests[1] = MPI_REQUEST_NULL;
+    }
+
+    return cg;
+}
+
+/**
+ * @brief Return the pending credits whose previous credit message was sent.
+ *
+ * Each source has at most one credit message in flight, the credits of the
+ * messages processed meanwhile are accumulated into the next one.
+ */
+static void
+credit_grants_flush(struct credit_grants *const cg)
+{
+    for (size_t i = 0; i < cg->grants_cnt && cg->pending_cnt; ++i) {
+        struct credit_grant *const cr = cg->grants + i;
+        if (!cr->pending) {
+            continue;
+        }
+
+        int sent;
+        MPI_Test(&cr->requests[0], &sent, MPI_STATUS_IGNORE);
+        if (sent) {
+            cr->values[0] = cr->pending;
+            cr->pending = 0;
+            cg->pending_cnt--;
+            MPI_Isend(&cr->values[0], 1, MPI_UINT32_T, i, TAG_CREDIT,
+                      mpi_comm_main, &cr->requests[0]);
+        }
+    }
+}
+
+/**
+ * @brief Return the credit of a processed message of the source.
+ */
+static void
+credit_grant(struct credit_grants *const cg, const int source)
+{
+    assert(cg && source >= 0 && (size_t)source < cg->grants_cnt);
+
+    if (cg->grants[source].pending++ == 0) {
+        cg->pending_cnt++;
+    }
+    credit_grants_flush(cg);
+}
+
+/**
+ * @brief Return all pending credits at the end of the receiving loop.
+ *
+ * The credit messages are not waited for, the credits are kept until
+ * xchg_credits_finish().
+ */
+static void
+credit_grants_return(struct credit_grants *const cg)
+{
+    for (size_t i = 0; i < cg->grants_cnt && cg->pending_cnt; ++i) {
+        struct credit_grant *const cr = cg->grants + i;
+        if (!cr->pending) {
+            continue;
+        }
+
+        cr->values[1] = cr->pending;
+        cr->pending = 0;
+        cg->pending_cnt--;
+        MPI_Isend(&cr->values[1], 1, MPI_UINT32_T, i, TAG_CREDIT,
+                  mpi_comm_main, &cr->requests[1]);
+    }
+
+    #pragma omp critical (xchg_grants)
+    {
+        cg->next = grants_unsettled;
+        grants_unsettled = cg;
+    }
+}
+
+
+/**
+ * @brief Set the window of the credit-based flow control.
+ *
+ * Has to be the same on all processes.
+ *
+ * @param[in] window Number of messages of each sending process which may be
+ *                   unprocessed by the receiver, 0 disables the flow control.
+ */
+void
+xchg_set_credits(const size_t window)
+{
+    assert(window <= XCHG_CREDITS_MAX);
+    credit_window = window;
+}
+
+/**
+ * @brief Settle all outstanding credits of the process.
+ *
+ * Receives the credits not returned yet to this process as a sender and waits
+ * for the credit messages sent by this process as a receiver. Has to be called
+ * by every process after all of its exchanges, outside of the parallel region.
+ */
+void
+xchg_credits_finish(void)
+{
+    while (credits_returned < credits_used) {
+        uint32_t credits;
+        MPI_Recv(&credits, 1, MPI_UINT32_T, MPI_ANY_SOURCE, TAG_CREDIT,
+                 mpi_comm_main, MPI_STATUS_IGNORE);
+        credits_returned += credits;
+    }
+    if (credits_used) {
+        DEBUG("xchg_credits: sent %" PRIu64 " message(s) under the credits, waited %"
+              PRIu64 " time(s) for %f s in total", credits_used,
+              credit_wait_cnt, credit_wait_time);
+    }
+
+    while (grants_unsettled) {
+        struct credit_grants *const cg = grants_unsettled;
+        grants_unsettled = cg->next;
+
+        for (size_t i = 0; i < cg->grants_cnt; ++i) {
+            MPI_Waitall(2, cg->grants[i].requests, MPI_STATUSES_IGNORE);
+        }
+        free(cg->grants);
+        free(cg);
+    }
+}
+/**
+ * @}
+ */  // xchg_credits
+
+
+/**
+ * @defgroup xchg_comm Communication thread of the process.
+ *
+ * Without the communication thread, every thread calls MPI_Isend() and
+ * MPI_Wait() itself, which requires MPI_THREAD_MULTIPLE and the threads
+ * contend for the lock of the MPI library. With the communication thread
+ * enabled, the threads only push their messages into a lock-free queue and
+ * one thread of the process (the one running xchg_comm_run()) sends them.
+ * The sending threads learn about the completed sends from the sent flag of
+ * each message, so they do not call MPI at all. The messages consuming the
+ * credits (see @ref xchg_credits) take them on the communication thread,
+ * a message without a credit waits in a pending list and does not hold up
+ * the messages which do not need one.
+ *
+ * The queue is the intrusive multiple-producer single-consumer queue by
+ * Dmitry Vyukov. A push is one atomic exchange, the messages of each producer
+ * are popped in the order they were pushed. Thus the messages of each thread
+ * are sent in order and a terminator never overtakes the data of its stream.
+ *
+ * Without the communication thread, the same functions send the messages
+ * directly.
+ *
+ * The other MPI calls of the worker threads (e.g., the collectives, the
+ * receives of the tree reduction and the tests of the cancellation) are
+ * queued as calls of functions (see xchg_comm_call()), which the
+ * communication thread makes in the order of the queue as well. With all MPI
+ * calls made by the communication thread, which is the main thread of the
+ * process, MPI_THREAD_FUNNELED is sufficient.
+ *
+ * @{
+ */
+static bool comm_thread = false;  // is the communication thread enabled?
+static atomic_bool comm_stopping = false;  // no more messages will be pushed
+
+static struct xchg_comm_msg comm_stub;  // the queue is never empty
+static _Atomic(struct xchg_comm_msg *) comm_head = &comm_stub;  // producers
+static struct xchg_comm_msg *comm_tail = &comm_stub;  // consumer
+
+
+/**
+ * @brief Push the message into the queue (any thread).
+ */
+static void
+comm_push(struct xchg_comm_msg *const msg)
+{
+    atomic_store_explicit(&msg->next, NULL, memory_order_relaxed);
+    struct xchg_comm_msg *const prev =
+        atomic_exchange_explicit(&comm_head, msg, memory_order_acq_rel);
+    // the queue is broken until the link is stored, the consumer waits
+    atomic_store_explicit(&prev->next, msg, memory_order_release);
+}
+
+/**
+ * @brief Pop the oldest message from the queue (communication thread only).
+ *
+ * @return The message, NULL if the queue is empty or a push is in progress.
+ */
+static struct xchg_comm_msg *
+comm_pop(void)
+{
+    struct xchg_comm_msg *tail = comm_tail;
+    struct xchg_comm_msg *next =
+        atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &comm_stub) {  // skip the stub
+        if (!next) {
+            return NULL;
+        }
+        comm_tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        comm_tail = next;
+        return tail;
+    }
+
+    // tail is the last message, put the stub behind it to pop it
+    if (tail != atomic_load_explicit(&comm_head, memory_order_acquire)) {
+        return NULL;  // a push is in progress
+    }
+    comm_push(&comm_stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        comm_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Enable or disable the communication thread.
+ *
+ * Has to be called before any message is sent. If enabled, one thread has to
+ * run xchg_comm_run() while the others send.
+ *
+ * @param[in] enable True to send the messages by the communication thread.
+ */
+void
+xchg_set_comm_thread(const bool enable)
+{
+    comm_thread = enable;
+}
+
+/**
+ * @brief Initialize the message, it is considered sent.
+ *
+ * @param[out] msg The message.
+ */
+void
+xchg_comm_msg_init(struct xchg_comm_msg *const msg)
+{
+    assert(msg);
+
+    msg->request = MPI_REQUEST_NULL;
+    atomic_init(&msg->sent, true);
+    atomic_init(&msg->next, NULL);
+}
+
+/**
+ * @brief Send the message, by the communication thread if it is enabled.
+ *
+ * The buffer has to be kept unchanged until the send completes, see
+ * xchg_comm_test() and xchg_comm_wait(). The message structure is used until
+ * then as well.
+ *
+ * @param[out] msg The message.
+ * @param[in] buff The data, may be NULL if size is zero.
+ * @param[in] size Size of the data in bytes.
+ * @param[in] dest Rank of the destination process in comm.
+ * @param[in] mpi_tag Tag of the message.
+ * @param[in] comm Communicator.
+ * @param[in] credit True if the message consumes an exchange credit.
+ */
+void
+xchg_comm_send(struct xchg_comm_msg *const msg, const void *const buff,
+               const size_t size, const int dest, const int mpi_tag,
+               const MPI_Comm comm, const bool credit)
+{
+    assert(msg && (buff || size == 0) && size <= INT_MAX);
+
+    if (!comm_thread) {
+        if (credit) {
+            credit_take();
+        }
+        MPI_Isend(buff, size, MPI_BYTE, dest, mpi_tag, comm, &msg->request);
+        return;
+    }
+
+    msg->buff = buff;
+    msg->size = size;
+    msg->dest = dest;
+    msg->tag = mpi_tag;
+    msg->comm = comm;
+    msg->credit = credit;
+    msg->call = NULL;
+    atomic_store_explicit(&msg->sent, false, memory_order_relaxed);
+    comm_push(msg);
+}
+
+/**
+ * @brief Call the function by the communication thread if it is enabled,
+ *        directly otherwise.
+ *
+ * The function may call MPI, including the blocking collectives. It is called
+ * only after the sends of all messages queued before it were started, so
+ * e.g. a collective never overtakes the data the other processes need before
+ * they enter it. The call completes as a send does, see xchg_comm_test() and
+ * xchg_comm_wait(). The communication thread does not send while the
+ * function runs.
+ *
+ * @param[out] msg The message.
+ * @param[in] call The function.
+ * @param[in] arg Argument of the function, used until the call completes.
+ */
+void
+xchg_comm_call(struct xchg_comm_msg *const msg, const xchg_comm_call_t call,
+               void *const arg)
+{
+    assert(msg && call);
+
+    if (!comm_thread) {
+        call(arg);
+        msg->request = MPI_REQUEST_NULL;  // completed
+        return;
+    }
+
+    msg->buff = NULL;
+    msg->size = 0;
+    msg->dest = MPI_PROC_NULL;
+    msg->tag = MPI_ANY_TAG;
+    msg->comm = MPI_COMM_NULL;  // never holds up a send
+    msg->credit = false;
+    msg->call = call;
+    msg->arg = arg;
+    atomic_store_explicit(&msg->sent, false, memory_order_relaxed);
+    comm_push(msg);
+}
+
+/**
+ * @brief Return true if the send of the message has completed.
+ *
+ * @param[in,out] msg The message.
+ */
+bool
+xchg_comm_test(struct xchg_comm_msg *const msg)
+{
+    assert(msg);
+
+    if (!comm_thread) {
+        int sent;
+        MPI_Test(&msg->request, &sent, MPI_STATUS_IGNORE);
+        return sent;
+    }
+    return atomic_load_explicit(&msg->sent, memory_order_acquire);
+}
+
+/**
+ * @brief Wait until the send of the message completes.
+ *
+ * The communication thread is not disturbed, the waiting backs off in the
+ * same way as the receiving (see @ref xchg_recv).
+ *
+ * @param[in,out] msg The message.
+ */
+void
+xchg_comm_wait(struct xchg_comm_msg *const msg)
+{
+    assert(msg);
+
+    if (!comm_thread) {
+        MPI_Wait(&msg->request, MPI_STATUS_IGNORE);
+        return;
+    }
+
+    long poll_interval = 0;
+    while (!atomic_load_explicit(&msg->sent, memory_order_acquire)) {
+        poll_interval = MIN(MAX(2 * poll_interval, XCHG_POLL_INTERVAL_MIN),
+                            XCHG_POLL_INTERVAL_MAX);
+        const struct timespec ts = { 0, poll_interval };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// state of the communication thread
+struct comm_state {
+    // messages in flight, their requests are completed by MPI_Testsome()
+    size_t inflight_cap;
+    size_t inflight_cnt;
+    MPI_Request *requests;
+    struct xchg_comm_msg **msgs;
+    int *done_idxs;
+
+    // messages waiting for a credit or behind such a message, in order
+    struct xchg_comm_msg *pending_head;
+    struct xchg_comm_msg *pending_tail;
+
+    MPI_Request credit_request;  // receive of a credit, if waiting for one
+    uint32_t credit_recvd;
+    double credit_wait_start;
+
+    uint64_t msg_cnt;
+};
+
+/**
+ * @brief Start the send of the message.
+ */
+static void
+comm_isend(struct comm_state *const cs, struct xchg_comm_msg *const msg)
+{
+    if (cs->inflight_cnt == cs->inflight_cap) {
+        cs->inflight_cap *= 2;
+        cs->requests = realloc(cs->requests,
+                               cs->inflight_cap * sizeof (*cs->requests));
+        cs->msgs = realloc(cs->msgs, cs->inflight_cap * sizeof (*cs->msgs));
+        cs->done_idxs = realloc(cs->done_idxs,
+                                cs->inflight_cap * sizeof (*cs->done_idxs));
+        ABORT_IF(!cs->requests || !cs->msgs || !cs->done_idxs, E_MEM,
+                 "communication thread allocation failed");
+    }
+
+    MPI_Isend(msg->buff, msg->size, MPI_BYTE, msg->dest, msg->tag, msg->comm,
+              &cs->requests[cs->inflight_cnt]);
+    cs->msgs[cs->inflight_cnt++] = msg;
+    cs->msg_cnt++;
+}
+
+/**
+ * @brief Send the pending messages that can be sent.
+ *
+ * A message consuming a credit is sent only if a credit is available and no
+ * earlier message is still waiting for one, so the messages under the credits
+ * keep their order. Any other message is sent right away, unless an earlier
+ * pending message has the same destination, tag and communicator (e.g., the
+ * terminator of a stream waits for the data of the stream, MPI messages of
+ * the same envelope are not overtaking). A call (see xchg_comm_call()) is made
+ * only if no earlier message is pending.
+ *
+ * @return True if any message was sent or any call was made.
+ */
+static bool
+comm_send_pending(struct comm_state *const cs)
+{
+    bool sent_any = false;
+    bool credit_blocked = false;
+    struct xchg_comm_msg *kept_head = NULL;
+    struct xchg_comm_msg *kept_tail = NULL;
+
+    struct xchg_comm_msg *msg = cs->pending_head;
+    while (msg) {
+        struct xchg_comm_msg *const next = msg->pending_next;
+
+        bool keep = false;
+        if (msg->call) {
+            keep = (kept_head != NULL);  // after all earlier messages
+        }
+        for (const struct xchg_comm_msg *k = kept_head; k && !keep;
+             k = k->pending_next) {
+            keep = (k->dest == msg->dest && k->tag == msg->tag
+                    && k->comm == msg->comm);
+        }
+        // take the credit only for a message which will be sent
+        if (msg->credit) {
+            keep = keep || credit_blocked || !credit_try_take();
+            credit_blocked = credit_blocked || keep;
+        }
+
+        if (keep) {
+            msg->pending_next = NULL;
+            if (kept_tail) {
+                kept_tail->pending_next = msg;
+            } else {
+                kept_head = msg;
+            }
+            kept_tail = msg;
+        } else if (msg->call) {
+            msg->call(msg->arg);
+            // the message may be reused by its owner from now on
+            atomic_store_explicit(&msg->sent, true, memory_order_release);
+            sent_any = true;
+        } else {
+            comm_isend(cs, msg);
+            sent_any = true;
+        }
+        msg = next;
+    }
+    cs->pending_head = kept_head;
+    cs->pending_tail = kept_tail;
+
+    // wait for a credit without blocking the other messages
+    if (credit_blocked && cs->credit_request == MPI_REQUEST_NULL) {
+        MPI_Irecv(&cs->credit_recvd, 1, MPI_UINT32_T, MPI_ANY_SOURCE,
+                  TAG_CREDIT, mpi_comm_main, &cs->credit_request);
+        cs->credit_wait_start = MPI_Wtime();
+    }
+
+    return sent_any;
+}
+
+/**
+ * @brief Complete the receive of a credit.
+ */
+static void
+comm_credit_done(struct comm_state *const cs)
+{
+    credits_add(cs->credit_recvd);
+    #pragma omp critical (xchg_credits)
+    {
+        credit_wait_time += MPI_Wtime() - cs->credit_wait_start;
+        credit_wait_cnt++;
+    }
+}
+
+/**
+ * @brief Run the communication thread until xchg_comm_stop() is called and
+ *        all messages are sent.
+ *
+ * The thread has to be the only one calling MPI on behalf of the senders and
+ * it should be the main thread of the process (for MPI_THREAD_FUNNELED). The
+ * popped messages are sent and their sends are completed by MPI_Testsome(),
+ * the popped calls are made, the waiting between idle iterations backs off as
+ * in the receiving. The
+ * messages without an available credit are kept in a pending list and the
+ * credit is received by a nonblocking receive polled in the same loop, so
+ * the other messages (e.g., progress reports) are not delayed.
+ */
+void
+xchg_comm_run(void)
+{
+    assert(comm_thread);
+
+    struct comm_state cs = {
+        .inflight_cap = XCHG_RING_SIZE_MAX,
+        .credit_request = MPI_REQUEST_NULL,
+    };
+    cs.requests = malloc(cs.inflight_cap * sizeof (*cs.requests));
+    cs.msgs = malloc(cs.inflight_cap * sizeof (*cs.msgs));
+    cs.done_idxs = malloc(cs.inflight_cap * sizeof (*cs.done_idxs));
+    ABORT_IF(!cs.requests || !cs.msgs || !cs.done_idxs, E_MEM,
+             "communication thread allocation failed");
+
+    long poll_interval = 0;
+    DEBUG("xchg_comm: communication thread started");
+    while (true) {
+        // must be read before the queue, a message pushed before the stop
+        // would be missed otherwise
+        const bool stopping = atomic_load(&comm_stopping);
+
+        // move all queued messages to the pending ones
+        bool busy = false;
+        struct xchg_comm_msg *msg;
+        while ((msg = comm_pop())) {
+            msg->pending_next = NULL;
+            if (cs.pending_tail) {
+                cs.pending_tail->pending_next = msg;
+            } else {
+                cs.pending_head = msg;
+            }
+            cs.pending_tail = msg;
+            busy = true;
+        }
+
+        // receive a credit if waiting for one
+        if (cs.credit_request != MPI_REQUEST_NULL) {
+            int received;
+            MPI_Test(&cs.credit_request, &received, MPI_STATUS_IGNORE);
+            if (received) {
+                comm_credit_done(&cs);
+                busy = true;
+            }
+        }
+
+        // send what can be sent
+        if (busy && cs.pending_head) {
+            comm_send_pending(&cs);
+        }
+
+        // complete the finished sends, keep the others at the beginning
+        if (cs.inflight_cnt) {
+            int done_cnt;
+            MPI_Testsome(cs.inflight_cnt, cs.requests, &done_cnt,
+                         cs.done_idxs, MPI_STATUSES_IGNORE);
+            for (int i = 0; i < done_cnt; ++i) {
+                atomic_store_explicit(&cs.msgs[cs.done_idxs[i]]->sent, true,
+                                      memory_order_release);
+            }
+            size_t kept = 0;
+            for (size_t i = 0; i < cs.inflight_cnt; ++i) {
+                if (cs.requests[i] != MPI_REQUEST_NULL) {
+                    cs.requests[kept] = cs.requests[i];
+                    cs.msgs[kept++] = cs.msgs[i];
+                }
+            }
+            busy = busy || done_cnt > 0;
+            cs.inflight_cnt = kept;
+        } else if (stopping && !busy && !cs.pending_head) {
+            break;  // nothing queued, pending nor in flight
+        }
+
+        if (busy) {
+            poll_interval = 0;
+        } else {  // nothing happened, wait a little longer
+            poll_interval = MIN(MAX(2 * poll_interval, XCHG_POLL_INTERVAL_MIN),
+                                XCHG_POLL_INTERVAL_MAX);
+            const struct timespec ts = { 0, poll_interval };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    // a credit is outstanding while its receive is posted, it will arrive
+    if (cs.credit_request != MPI_REQUEST_NULL) {
+        MPI_Wait(&cs.credit_request, MPI_STATUS_IGNORE);
+        comm_credit_done(&cs);
+    }
+
+    free(cs.done_idxs);
+    free(cs.msgs);
+    free(cs.requests);
+    DEBUG("xchg_comm: communication thread sent %" PRIu64 " message(s)",
+          cs.msg_cnt);
+}
+
+/**
+ * @brief Let the communication thread finish after sending the queued
+ *        messages.
+ *
+ * Has to be called after the last message of all threads was pushed.
+ */
+void
+xchg_comm_stop(void)
+{
+    atomic_store(&comm_stopping, true);
+}
+/**
+ * @}
+ */  // xchg_comm
+
+
+/**
+ * @defgroup xchg_shm Exchange through the shared memory of a node.
+ *
+ * Processes on the same node (e.g., the master and the slaves of a fat node)
+ * would otherwise exchange the messages through the shared memory transport
+ * of MPI, which copies each message into and out of a shared buffer. With the
+ * shared memory exchange enabled, each process allocates its send buffers in
+ * a shared window (MPI_Win_allocate_shared()) of all processes of the node.
+ * The sender writes the message into such a slot and sends only a short
+ * descriptor (XCHG_MSG_SHM with the slot index, and the message size). The
+ * receiver on the same node processes the message in place and frees the
+ * slot. Messages to the processes on other nodes are sent from the slots as
+ * usual.
+ *
+ * Each slot begins with a state word (free or full). The sender stores the
+ * full state with the release semantics before sending the descriptor, the
+ * receiver stores the free state with the release semantics after
+ * processing the message. The shared window has to be in the unified memory
+ * model, otherwise the shared memory exchange is disabled.
+ *
+ * @{
+ */
+#define XCHG_SHM_SLOT_HDR 64  // the state word padded to a cache line
+
+enum {  // state of a slot
+    SHM_SLOT_FREE,
+    SHM_SLOT_FULL,
+};
+
+// a process of mpi_comm_main as seen from this process
+struct shm_peer {
+    bool local;  // is the process on this node?
+    uint8_t *base;  // segment of the process, NULL if it has no slots
+    size_t slot_cnt;  // number of slots of the process
+};
+
+static MPI_Comm shm_comm = MPI_COMM_NULL;  // processes of this node
+static MPI_Win shm_win = MPI_WIN_NULL;
+static struct shm_peer *shm_peers;  // indexed by rank, NULL if disabled
+static size_t shm_slot_size;  // size of a slot including the header
+static size_t shm_slot_cnt;  // number of slots of this process
+static atomic_size_t shm_slot_next;  // first slot not given to a ring yet
+static int shm_rank;  // rank of this process in mpi_comm_main
+
+
+/**
+ * @brief Return the state word of the slot of the process.
+ */
+static atomic_uint *
+shm_slot_state(const int rank, const size_t slot)
+{
+    assert(shm_peers && shm_peers[rank].base
+           && slot < shm_peers[rank].slot_cnt);
+    return (atomic_uint *)(shm_peers[rank].base + slot * shm_slot_size);
+}
+
+/**
+ * @brief Return the data of the slot of the process.
+ */
+static uint8_t *
+shm_slot_data(const int rank, const size_t slot)
+{
+    assert(shm_peers && shm_peers[rank].base
+           && slot < shm_peers[rank].slot_cnt);
+    return shm_peers[rank].base + slot * shm_slot_size + XCHG_SHM_SLOT_HDR;
+}
+
+/**
+ * @brief Return true if the process shares the node with this process.
+ */
+static bool
+shm_colocated(const int rank)
+{
+    return shm_peers && shm_peers[rank].local;
+}
+
+/**
+ * @brief Take consecutive slots for a ring.
+ *
+ * @return Index of the first slot, SIZE_MAX if there are not enough slots.
+ */
+static size_t
+shm_slots_take(const size_t cnt)
+{
+    if (!shm_peers) {
+        return SIZE_MAX;
+    }
+    const size_t first = atomic_fetch_add(&shm_slot_next, cnt);
+    return (first + cnt <= shm_slot_cnt) ? first : SIZE_MAX;
+}
+
+/**
+ * @brief Resolve the descriptor of a message in a slot of the source.
+ *
+ * @param[in] source Rank of the source process in mpi_comm_main.
+ * @param[in] msg The received message.
+ * @param[in,out] msg_size Size of the received message, replaced by the size
+ *                         of the message in the slot.
+ *
+ * @return The state word of the slot, NULL if the message is not a
+ *         descriptor.
+ */
+static atomic_uint *
+shm_resolve(const int source, uint8_t **const msg, size_t *const msg_size)
+{
+    xchg_rec_size_t desc[2];
+    if (!shm_peers || *msg_size != sizeof (desc)) {
+        return NULL;
+    }
+    memcpy(desc, *msg, sizeof (desc));
+    if (!(desc[0] & XCHG_MSG_SHM)) {
+        return NULL;
+    }
+
+    const size_t slot = desc[0] & ~XCHG_MSG_SHM;
+    ABORT_IF(!shm_colocated(source) || slot >= shm_peers[source].slot_cnt
+             || desc[1] > xchg_buff_size, E_INTERNAL,
+             "invalid shared memory descriptor");
+    atomic_uint *const state = shm_slot_state(source, slot);
+    assert(atomic_load_explicit(state, memory_order_acquire) == SHM_SLOT_FULL);
+    *msg = shm_slot_data(source, slot);
+    *msg_size = desc[1];
+
+    return state;
+}
+
+
+/**
+ * @brief Allocate the shared window of the processes of each node.
+ *
+ * Collective over mpi_comm_main. If the window is not in the unified memory
+ * model, a warning is printed and the exchange stays two-sided.
+ *
+ * @param[in] slot_cnt Number of the send slots of this process (0 for a
+ *                     process not sending through a ring).
+ */
+void
+xchg_shm_init(const size_t slot_cnt)
+{
+    assert(slot_cnt <= XCHG_SHM_SLOTS_MAX && !shm_peers);
+
+    MPI_Comm_split_type(mpi_comm_main, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                        &shm_comm);
+
+    shm_slot_size = XCHG_SHM_SLOT_HDR + xchg_buff_size;
+    shm_slot_cnt = slot_cnt;
+    uint8_t *segment;
+    MPI_Win_allocate_shared(slot_cnt * shm_slot_size, 1, MPI_INFO_NULL,
+                            shm_comm, &segment, &shm_win);
+    for (size_t i = 0; i < slot_cnt; ++i) {
+        atomic_init((atomic_uint *)(segment + i * shm_slot_size),
+                    SHM_SLOT_FREE);
+    }
+    atomic_init(&shm_slot_next, 0);
+    MPI_Comm_rank(mpi_comm_main, &shm_rank);
+
+    int *model;
+    int flag;
+    MPI_Win_get_attr(shm_win, MPI_WIN_MODEL, &model, &flag);
+    const bool unified = flag && *model == MPI_WIN_UNIFIED;
+    if (!unified) {
+        WARNING(E_MPI, "shared window is not in the unified memory model, exchanging through shared memory disabled");
+    }
+
+    // the other processes have to initialize their slots
+    MPI_Barrier(shm_comm);
+    if (!unified) {
+        return;
+    }
+
+    // find the segments of the processes on this node
+    int world_size;
+    MPI_Comm_size(mpi_comm_main, &world_size);
+    int node_size;
+    MPI_Comm_size(shm_comm, &node_size);
+    MPI_Group main_group;
+    MPI_Group node_group;
+    MPI_Comm_group(mpi_comm_main, &main_group);
+    MPI_Comm_group(shm_comm, &node_group);
+
+    shm_peers = calloc(world_size, sizeof (*shm_peers));
+    ABORT_IF(!shm_peers, E_MEM, "shared segments allocation failed");
+    for (int node_rank = 0; node_rank < node_size; ++node_rank) {
+        int main_rank;
+        MPI_Group_translate_ranks(node_group, 1, &node_rank, main_group,
+                                  &main_rank);
+        MPI_Aint size;
+        int disp_unit;
+        uint8_t *base;
+        MPI_Win_shared_query(shm_win, node_rank, &size, &disp_unit, &base);
+        shm_peers[main_rank] = (struct shm_peer){
+            .local = true,
+            .base = (size > 0) ? base : NULL,
+            .slot_cnt = size / shm_slot_size,
+        };
+    }
+    MPI_Group_free(&node_group);
+    MPI_Group_free(&main_group);
+
+    DEBUG("xchg_shm: %d process(es) on this node, %zu slot(s) of this process",
+          node_size, slot_cnt);
+}
+
+/**
+ * @brief Free the shared window.
+ *
+ * Collective over mpi_comm_main, has to be called after all exchanges.
+ */
+void
+xchg_shm_free(void)
+{
+    if (shm_comm == MPI_COMM_NULL) {
+        return;
+    }
+
+    free(shm_peers);
+    shm_peers = NULL;
+    MPI_Win_free(&shm_win);
+    MPI_Comm_free(&shm_comm);
+}
+/**
+ * @}
+ */  // xchg_shm
+
+
+/**
+ * @defgroup xchg_ring Ring of the send buffers.
+ *
+ * The sender fills one buffer of the ring while the previously filled buffers
+ * are being sent. Only if all other buffers are still in flight (e.g., the
+ * receiver is temporarily slow), the sender has to wait for the oldest send to
+ * complete. Such stalls and the time spent in them are counted and reported
+ * when the ring is freed.
+ *
+ * Each buffer has its companion buffer for the compressed message (see @ref
+ * xchg_compress), allocated only if the compression is enabled.
+ *
+ * If the exchange through the shared memory is enabled (see @ref xchg_shm),
+ * the buffers are slots of the shared window. A message for a process on the
+ * same node is then passed as a descriptor and the buffer is free once the
+ * receiver frees the slot. Such messages are not compressed, messages for the
+ * processes on other nodes are compressed as usual.
+ *
+ * @{
+ */
+/**
+ * @brief Return the message to send, compressed if it pays off.
+ *
+ * The compressed message is stored in the companion buffer of the current
+ * buffer, so it stays valid while the current buffer is being sent.
+ */
+static const uint8_t *
+ring_pack(struct xchg_ring *const ring, size_t *const msg_size)
+{
+    const uint8_t *const msg = ring->buff[ring->idx];
+
+#ifdef ENABLE_LZ4
+    if (!ring->packed) {
+        return msg;  // compression is disabled
+    }
+    if (ring->skip) {
+        ring->skip--;
+        return msg;
+    }
+
+    uint8_t *const dst = ring->packed[ring->idx];
+    const size_t packed_size = msg_compress(msg, *msg_size, dst,
+                                            ring->buff_size);
+    if (packed_size == 0) {  // does not pay off
+        ring->skip = ring->skip_next;
+        ring->skip_next = MIN(2 * ring->skip_next, XCHG_COMPRESS_SKIP_MAX);
+        return msg;
+    }
+    ring->skip_next = 1;
+
+    ring->plain_bytes += *msg_size;
+    ring->packed_bytes += packed_size;
+    *msg_size = packed_size;
+    return dst;
+#else
+    (void)msg_size;
+    return msg;
+#endif  // ENABLE_LZ4
+}
+
+
+/**
+ * @brief Return the state word of the buffer, NULL if it is not a slot.
+ */
+static atomic_uint *
+ring_slot_state(const struct xchg_ring *const ring, const size_t idx)
+{
+    if (ring->shm_slot == SIZE_MAX) {
+        return NULL;
+    }
+    return shm_slot_state(shm_rank, ring->shm_slot + idx);
+}
+
+/**
+ * @brief Return true if the buffer may be filled (it is sent and, if it is a
+ *        slot, freed by the receiver).
+ */
+static bool
+ring_buff_free(struct xchg_ring *const ring, const size_t idx)
+{
+    const atomic_uint *const state = ring_slot_state(ring, idx);
+    return xchg_comm_test(&ring->msgs[idx]) && (!state
+        || atomic_load_explicit(state, memory_order_acquire) == SHM_SLOT_FREE);
+}
+
+/**
+ * @brief Wait until the buffer may be filled.
+ */
+static void
+ring_buff_wait(struct xchg_ring *const ring, const size_t idx)
+{
+    xchg_comm_wait(&ring->msgs[idx]);
+
+    const atomic_uint *const state = ring_slot_state(ring, idx);
+    long poll_interval = 0;
+    while (state && atomic_load_explicit(state, memory_order_acquire)
+           != SHM_SLOT_FREE) {
+        poll_interval = MIN(MAX(2 * poll_interval, XCHG_POLL_INTERVAL_MIN),
+                            XCHG_POLL_INTERVAL_MAX);
+        const struct timespec ts = { 0, poll_interval };
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+/**
+ * @brief Allocate the ring of the send buffers.
+ *
+ * The buffers are of the message size (see xchg_get_buff_size()).
+ *
+ * @param[out] ring The ring to initialize.
+ * @param[in] buff_cnt Number of the buffers, at least two.
+ */
+void
+xchg_ring_init(struct xchg_ring *const ring, const size_t buff_cnt)
+{
+    assert(ring && buff_cnt >= XCHG_RING_SIZE_MIN
+           && buff_cnt <= XCHG_RING_SIZE_MAX);
+
+    *ring = (struct xchg_ring){
+        .buff_cnt = buff_cnt,
+        .buff_size = xchg_buff_size,
+        .skip_next = 1,
+    };
+
+    ring->buff = calloc(buff_cnt, sizeof (*ring->buff));
+    ring->msgs = malloc(buff_cnt * sizeof (*ring->msgs));
+    ABORT_IF(!ring->buff || !ring->msgs, E_MEM, "send ring allocation failed");
+    for (size_t i = 0; i < buff_cnt; ++i) {
+        xchg_comm_msg_init(&ring->msgs[i]);
+    }
+
+    ring->shm_slot = shm_slots_take(buff_cnt);
+    if (ring->shm_slot != SIZE_MAX) {  // the buffers are in the shared window
+        ring->shm_descs = malloc(buff_cnt * sizeof (*ring->shm_descs));
+        ABORT_IF(!ring->shm_descs, E_MEM, "send ring allocation failed");
+        for (size_t i = 0; i < buff_cnt; ++i) {
+            ring->buff[i] = shm_slot_data(shm_rank, ring->shm_slot + i);
+        }
+    } else {
+        for (size_t i = 0; i < buff_cnt; ++i) {
+            ring->buff[i] = malloc(ring->buff_size);
+            ABORT_IF(!ring->buff[i], E_MEM, "send buffer allocation failed");
+        }
+    }
+
+    // also for the slots, the messages for other nodes are sent as usual
+    if (xchg_compress) {
+        ring->packed = calloc(buff_cnt, sizeof (*ring->packed));
+        ABORT_IF(!ring->packed, E_MEM, "send ring allocation failed");
+        for (size_t i = 0; i < buff_cnt; ++i) {
+            ring->packed[i] = malloc(ring->buff_size);
+            ABORT_IF(!ring->packed[i], E_MEM,
+                     "compression buffer allocation failed");
+        }
+    }
+}
+
+/**
+ * @brief Wait for all sends to complete and free the ring.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ *
+ * @param[in,out] ring The ring, may be zero-initialized and not used.
+ */
+void
+xchg_ring_free(struct xchg_ring *const ring)
+{
+    assert(ring);
+
+    if (!ring->buff) {
+        return;
+    }
+    for (size_t i = 0; i < ring->buff_cnt; ++i) {
+        xchg_comm_wait(&ring->msgs[i]);
+    }
+
+    DEBUG("xchg_ring: sent %" PRIu64 " message(s), stalled %" PRIu64
+          " time(s) for %f s in total", ring->msg_cnt, ring->stall_cnt,
+          ring->stall_time);
+    if (ring->plain_bytes) {
+        DEBUG("xchg_ring: compressed %" PRIu64 " B into %" PRIu64 " B",
+              ring->plain_bytes, ring->packed_bytes);
+    }
+
+    for (size_t i = 0; i < ring->buff_cnt; ++i) {
+        if (ring->shm_slot == SIZE_MAX) {
+            free(ring->buff[i]);  // the slots are freed with the window
+        }
+        if (ring->packed) {
+            free(ring->packed[i]);
+        }
+    }
+    free(ring->shm_descs);
+    free(ring->packed);
+    free(ring->msgs);
+    free(ring->buff);
+    *ring = (struct xchg_ring){ 0 };
+}
+
+/**
+ * @brief Return the current buffer (the one being filled).
+ *
+ * @param[in] ring The ring.
+ *
+ * @return Pointer to the buffer of ring->buff_size bytes.
+ */
+uint8_t *
+xchg_ring_buff(const struct xchg_ring *const ring)
+{
+    assert(ring && ring->buff);
+
+    return ring->buff[ring->idx];
+}
+
+/**
+ * @brief Send the current buffer and move to the next one.
+ *
+ * The message is compressed if the compression is enabled and it pays off.
+ * If the flow control is enabled, a credit is taken first (see @ref
+ * xchg_credits). The message is sent by the communication thread if it is
+ * enabled (see @ref xchg_comm). If the next buffer is still being sent, wait
+ * for it (a stall).
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ *
+ * @param[in,out] ring The ring.
+ * @param[in] msg_size Size of the message in the current buffer.
+ * @param[in] dest Rank of the destination process in mpi_comm_main.
+ * @param[in] mpi_tag Tag of the stream.
+ */
+void
+xchg_ring_send(struct xchg_ring *const ring, size_t msg_size, const int dest,
+               const int mpi_tag)
+{
+    assert(ring && ring->buff && msg_size > 0 && msg_size <= ring->buff_size);
+
+    if (ring->shm_slot != SIZE_MAX && shm_colocated(dest)) {
+        // the receiver reads the message from the slot
+        const size_t slot = ring->shm_slot + ring->idx;
+        xchg_rec_size_t *const desc = ring->shm_descs[ring->idx];
+        desc[0] = XCHG_MSG_SHM | slot;
+        desc[1] = msg_size;
+        atomic_store_explicit(shm_slot_state(shm_rank, slot), SHM_SLOT_FULL,
+                              memory_order_release);
+        xchg_comm_send(&ring->msgs[ring->idx], desc,
+                       sizeof (ring->shm_descs[0]), dest, mpi_tag,
+                       mpi_comm_main, credit_window > 0);
+    } else {
+        const uint8_t *const msg = ring_pack(ring, &msg_size);
+        xchg_comm_send(&ring->msgs[ring->idx], msg, msg_size, dest, mpi_tag,
+                       mpi_comm_main, credit_window > 0);
+    }
+    ring->msg_cnt++;
+
+    // move to the next buffer, it has to be sent already
+    ring->idx = (ring->idx + 1) % ring->buff_cnt;
+    if (!ring_buff_free(ring, ring->idx)) {
+        const double stall_start = monotonic_time();
+        ring_buff_wait(ring, ring->idx);
+        ring->stall_time += monotonic_time() - stall_start;
+        ring->stall_cnt++;
+    }
+}
+/**
+ * @}
+ */  // xchg_ring
+
+
+/**
+ * @defgroup xchg_send Sending side of the record exchange.
+ * @{
+ */
+/**
+ * @brief Send the terminator (an empty message) to the destination.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ *
+ * @param[in] dest Rank of the destination process in mpi_comm_main.
+ * @param[in] mpi_tag Tag of the terminated stream.
+ */
+void
+xchg_send_terminator(int dest, int mpi_tag)
+{
+    struct xchg_comm_msg msg;
+    xchg_comm_msg_init(&msg);
+    xchg_comm_send(&msg, NULL, 0, dest, mpi_tag, mpi_comm_main, false);
+    xchg_comm_wait(&msg);
+}
+
+/**
+ * @brief Send records from the libnf memory in the libnf raw format, without
+ *        the terminator.
+ *
+ * Records are read using the libnf memory cursor, so they are sent in the
+ * order given by the memory (sorted, if sorting was requested). The buffers of
+ * the ring are used in turn to overlap reading from the memory and
+ * communication. Terminator is not included, so records of multiple memories
+ * may be sent as one stream. The last messages may still be in flight after
+ * return, the ring keeps them until they are sent.
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ *
+ * @param[in] lnf_mem The libnf memory. Will not be modified.
+ * @param[in] rec_limit Send at most rec_limit records, 0 means send all.
+ * @param[in] dest Rank of the destination process in mpi_comm_main.
+ * @param[in] mpi_tag Tag of the stream.
+ * @param[in,out] ring The ring of the send buffers.
+ */
+void
+xchg_send_raw_recs(lnf_mem_t *const lnf_mem, size_t rec_limit, int dest,
+                   int mpi_tag, struct xchg_ring *const ring)
+{
+    assert(lnf_mem && ring && ring->buff
+           && ring->buff_size >= sizeof (xchg_rec_size_t) + LNF_MAX_RAW_LEN);
+
+    // zero record limit means send all records
+    if (rec_limit == 0) {
+        rec_limit = SIZE_MAX;
+    }
+
+    // initialize the cursor to point to the first record in the memory
+    lnf_mem_cursor_t *cursor;
+    int lnf_ret = lnf_mem_first_c(lnf_mem, &cursor);
+
+    // loop throught all records
+    const size_t buff_size = ring->buff_size;
+    uint8_t *buff = xchg_ring_buff(ring);  // currently used data buffer
+    size_t buff_off = 0;      // data buffer offset
+    size_t buff_rec_cntr = 0; // number of records in current buffer
+    size_t rec_cntr = 0;
+    uint8_t rec[LNF_MAX_RAW_LEN];
+    // the raw records are opaque, so the fixed-width layout uses the rows
+    struct xchg_fixed fx_storage;
+    struct xchg_fixed *const fx =
+        (xchg_layout == XCHG_LAYOUT_PREFIXED) ? NULL : &fx_storage;
+    if (fx) {
+        xchg_fixed_init(fx, buff, buff_size, 0, NULL);
+    }
+    while (cursor && rec_limit > rec_cntr) {
+        // read another record and write it into the buffer
+        int rec_len;
+        lnf_ret = lnf_mem_read_raw_c(lnf_mem, cursor, (char *)rec, &rec_len,
+                                     sizeof (rec));
+        assert(lnf_ret == LNF_OK);
+        size_t written = fx ? xchg_fixed_put(fx, rec, rec_len)
+            : xchg_rec_put(buff + buff_off, buff_size - buff_off, rec, rec_len);
+
+        // was in the buffer enough space for the record?
+        if (written == 0) {  // no, send the full buffer
+            if (fx) {
+                buff_off = xchg_fixed_finish(fx);
+            }
+            xchg_ring_send(ring, buff_off, dest, mpi_tag);
+
+            // clear the buffer context variables and move to the next buffer
+            buff = xchg_ring_buff(ring);
+            buff_off = 0;
+            buff_rec_cntr = 0;
+
+            if (fx) {
+                xchg_fixed_init(fx, buff, buff_size, 0, NULL);
+                written = xchg_fixed_put(fx, rec, rec_len);
+            } else {
+                written = xchg_rec_put(buff, buff_size, rec, rec_len);
+            }
+            assert(written != 0);
+        }
+        buff_off += written;
+        buff_rec_cntr++;
+        rec_cntr++;
+
+        // move the cursor to the next record
+        lnf_ret = lnf_mem_next_c(lnf_mem, &cursor);
+    }
+    ABORT_IF(rec_limit == SIZE_MAX && lnf_ret != LNF_EOF, E_LNF,
+             "lnf_mem_next_c() or lnf_mem_first_c() failed");
+
+    // send the remaining records if the record buffer is not empty
+    if (buff_rec_cntr != 0) {
+        if (fx) {
+            buff_off = xchg_fixed_finish(fx);
+        }
+        xchg_ring_send(ring, buff_off, dest, mpi_tag);
+    }
+
+    DEBUG("xchg_send_raw_recs: sent %zu record(s) with tag %d to %d", rec_cntr,
+          mpi_tag, dest);
+}
+
+/**
+ * @brief Send records from the libnf memory in the libnf raw format, including
+ *        the terminator.
+ *
+ * See xchg_send_raw_recs().
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ *
+ * @param[in] lnf_mem The libnf memory. Will not be modified.
+ * @param[in] rec_limit Send at most rec_limit records, 0 means send all.
+ * @param[in] dest Rank of the destination process in mpi_comm_main.
+ * @param[in] mpi_tag Tag of the stream.
+ * @param[in,out] ring The ring of the send buffers.
+ */
+void
+xchg_send_raw_mem(lnf_mem_t *const lnf_mem, size_t rec_limit, int dest,
+                  int mpi_tag, struct xchg_ring *const ring)
+{
+    xchg_send_raw_recs(lnf_mem, rec_limit, dest, mpi_tag, ring);
+    xchg_send_terminator(dest, mpi_tag);
+}
+/**
+ * @}
+ */  // xchg_send
+
+
+/**
+ * @defgroup xchg_recv Receiving side of the record exchange.
+ *
+ * The receiver keeps a pool of receives from any source posted all the time,
+ * so messages of multiple sources are received while a message is being
+ * processed. Completed receives are found by MPI_Testsome() and the waiting
+ * between the unsuccessful tests backs off exponentially from
+ * XCHG_POLL_INTERVAL_MIN to XCHG_POLL_INTERVAL_MAX nanoseconds, so the
+ * receiver neither burns a core nor sleeps long while the messages flow.
+ *
+ * Completed receives are not processed in the order they were matched, so a
+ * terminator may be processed before the last data message of its source. MPI
+ * matches the messages of each source to the receives in the posting order,
+ * therefore all data messages were matched to the receives posted before the
+ * last processed terminator. Those are completed after the last terminator,
+ * the receives posted after it match nothing and are cancelled.
+ *
+ * @{
+ */
+#define XCHG_RECV_POOL_MAX 16  // maximum number of the posted receives
+
+struct recv_ctx {
+    uint64_t rec_limit;  // process at most rec_limit records, 0 is no limit
+    xchg_recv_callback_t recv_callback;
+    void *callback_data;
+
+    uint8_t scratch[XCHG_COMPACT_REC_LEN_MAX];  // for the decoded records
+    uint8_t *msg_scratch;  // for the decompressed messages
+
+    size_t rec_cntr;  // processed records counter
+    size_t msg_cntr;  // received messages counter
+    bool limit_exceeded;
+};
+
+
+/**
+ * @brief Call the callback function for each record of the received message.
+ */
+static void
+recv_process(struct recv_ctx *const rc, uint8_t *const msg,
+             const size_t msg_size)
+{
+    rc->msg_cntr++;
+    if (rc->limit_exceeded) {
+        return;  // do not process further, but continue receiving
+    }
+
+    // rec_ptr is a pointer to record in the (decompressed) message
+    size_t plain_size = msg_size;
+    uint8_t *rec_ptr = xchg_msg_unpack(msg, &plain_size, &rc->msg_scratch);
+    // msg_end is a pointer to the end of the last record
+    const uint8_t *const msg_end = rec_ptr + plain_size;
+
+    // records of the fixed-width messages have no size prefixes
+    struct xchg_fixed fx;
+    if (xchg_fixed_parse(&fx, rec_ptr, plain_size)) {
+        ABORT_IF(fx.col_cnt && fx.rec_size > sizeof (rc->scratch), E_INTERNAL,
+                 "fixed-width record too long");
+        for (size_t i = 0; i < fx.rec_cnt; ++i) {
+            uint8_t *const rec = xchg_fixed_get(&fx, i, rc->scratch);
+            const error_code_t ecode = rc->recv_callback(rec, fx.rec_size,
+                                                         rc->callback_data);
+            ABORT_IF(ecode != E_OK, ecode, "recv_callback() failed");
+
+            if (++rc->rec_cntr == rc->rec_limit) {
+                rc->limit_exceeded = true;
+                return;
+            }
+        }
+        return;
+    }
+
+    /*
+     * Each record is prefixed with a 4 bytes long record size, encoded records
+     * are decoded into the scratch buffer.
+     */
+    while (rec_ptr < msg_end) {
+        // shifts the pointer to the next record
+        xchg_rec_size_t rec_size;
+        uint8_t *const rec = xchg_rec_get(&rec_ptr, rc->scratch, &rec_size);
+
+        const error_code_t ecode = rc->recv_callback(rec, rec_size,
+                                                     rc->callback_data);
+        ABORT_IF(ecode != E_OK, ecode, "recv_callback() failed");
+
+        if (++rc->rec_cntr == rc->rec_limit) {
+            rc->limit_exceeded = true;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Process the received message, free its slot and return its credit.
+ */
+static void
+recv_handle(struct recv_ctx *const rc, struct credit_grants *const credits,
+            uint8_t *msg, size_t msg_size, const int source)
+{
+    // a descriptor is replaced by the message in the slot of the source
+    atomic_uint *const slot_state = shm_resolve(source, &msg, &msg_size);
+    recv_process(rc, msg, msg_size);
+    if (slot_state) {
+        atomic_store_explicit(slot_state, SHM_SLOT_FREE, memory_order_release);
+    }
+
+    if (credits) {
+        credit_grant(credits, source);
+    }
+}
+
+/**
+ * @brief Receive records from multiple sources and pass them to the callback.
+ *
+ * Messages are received from any source until source_cnt terminators are
+ * received. The callback is called for each received record. After rec_limit
+ * records, receiving continues (all sources have to be terminated), but the
+ * records are discarded. If the flow control is enabled, the credit of each
+ * received message is returned to its source (see @ref xchg_credits).
+ *
+ * This function is not thread-safe without MPI_THREAD_MULTIPLE.
+ *
+ * @param[in] source_cnt Number of sources (number of expected terminators).
+ * @param[in] rec_limit Process at most rec_limit records, 0 means no limit.
+ * @param[in] mpi_tag Tag of the stream.
+ * @param[in] recv_callback Function called for each received record.
+ * @param[in] callback_data User data passed to the callback.
+ */
+void
+xchg_recv_loop(const uint64_t source_cnt, const uint64_t rec_limit,
+               const int mpi_tag, const xchg_recv_callback_t recv_callback,
+               void *const callback_data)
+{
+    assert(source_cnt > 0 && recv_callback);
+
+    struct recv_ctx rc = {
+        .rec_limit = rec_limit,
+        .recv_callback = recv_callback,
+        .callback_data = callback_data,
+    };
+    struct credit_grants *const credits = credit_grants_init();
+
+    // allocate the pool and post a receive into each of its buffers
+    const size_t pool_size = MIN(source_cnt + 1, XCHG_RECV_POOL_MAX);
+    uint8_t *buffs[pool_size];
+    MPI_Request requests[pool_size];
+    uint64_t seqs[pool_size];  // posting order of the receives
+    uint64_t seq_next = 0;
+    for (size_t i = 0; i < pool_size; ++i) {
+        buffs[i] = malloc(xchg_buff_size);
+        ABORT_IF(!buffs[i], E_MEM, "receive buffer allocation failed");
+        MPI_Irecv(buffs[i], xchg_buff_size, MPI_BYTE, MPI_ANY_SOURCE, mpi_tag,
+                  mpi_comm_main, &requests[i]);
+        seqs[i] = seq_next++;
+    }
+
+
+    // receiving loop
+    size_t active_sources = source_cnt;
+    uint64_t last_term_seq = 0;  // posting order of the last terminator
+    long poll_interval = 0;  // no waiting right after a completion
+    DEBUG("xchg_recv_loop: receiving from %zu source(s) into %zu buffer(s)",
+          active_sources, pool_size);
+    while (active_sources) {
+        int done_cnt;
+        int done_idxs[pool_size];
+        MPI_Status statuses[pool_size];
+        MPI_Testsome(pool_size, requests, &done_cnt, done_idxs, statuses);
+        assert(done_cnt != MPI_UNDEFINED);  // some receives are always posted
+        if (credits) {
+            credit_grants_flush(credits);  // previous credit messages sent?
+        }
+
+        if (done_cnt == 0) {  // nothing received, wait a little longer
+            poll_interval = MIN(MAX(2 * poll_interval, XCHG_POLL_INTERVAL_MIN),
+                                XCHG_POLL_INTERVAL_MAX);
+            const struct timespec ts = { 0, poll_interval };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        poll_interval = 0;
+
+        for (int i = 0; i < done_cnt; ++i) {
+            const int idx = done_idxs[i];
+            assert(statuses[i].MPI_TAG == mpi_tag);
+
+            // determine actual size of received message
+            int msg_size;
+            MPI_Get_count(&statuses[i], MPI_BYTE, &msg_size);
+            assert(msg_size >= 0);
+
+            if (msg_size == 0) {  // empty message is a terminator
+                active_sources--;
+                last_term_seq = MAX(last_term_seq, seqs[idx]);
+                DEBUG("xchg_recv_loop: received termination, %zu source(s) remaining",
+                      active_sources);
+            } else {
+                recv_handle(&rc, credits, buffs[idx], msg_size,
+                            statuses[i].MPI_SOURCE);
+            }
+
+            // start receiving next message into the processed buffer
+            if (active_sources) {
+                MPI_Irecv(buffs[idx], xchg_buff_size, MPI_BYTE, MPI_ANY_SOURCE,
+                          mpi_tag, mpi_comm_main, &requests[idx]);
+                seqs[idx] = seq_next++;
+            }
+        }
+    }
+
+    // complete the receives posted before the last terminator, cancel the rest
+    for (size_t i = 0; i < pool_size; ++i) {
+        if (requests[i] == MPI_REQUEST_NULL) {
+            // already completed
+        } else if (seqs[i] < last_term_seq) {
+            MPI_Status status;
+            MPI_Wait(&requests[i], &status);
+            int msg_size;
+            MPI_Get_count(&status, MPI_BYTE, &msg_size);
+            assert(msg_size > 0);  // all terminators were received
+            recv_handle(&rc, credits, buffs[i], msg_size, status.MPI_SOURCE);
+        } else {
+            MPI_Cancel(&requests[i]);
+            MPI_Wait(&requests[i], MPI_STATUS_IGNORE);
+        }
+        free(buffs[i]);
+    }
+
+    if (credits) {
+        credit_grants_return(credits);
+    }
+    free(rc.msg_scratch);
+    DEBUG("xchg_recv_loop: received %zu message(s) with tag %d containing %zu records",
+          rc.msg_cntr, mpi_tag, rc.rec_cntr);
+}
+
+/**
+ * @brief Receive callback writing the raw record into the libnf memory.
+ *
+ * @param[in] data Record in the libnf raw format.
+ * @param[in] data_len Length of the record.
+ * @param[in] user Pointer to the libnf memory (lnf_mem_t).
+ *
+ * @return E_OK on success, E_LNF on failure.
+ */
+error_code_t
+xchg_mem_write_raw_callback(uint8_t *data, xchg_rec_size_t data_len,
+                            void *user)
+{
+    int lnf_ret = lnf_mem_write_raw((lnf_mem_t *)user, (char *)data, data_len);
+    if (lnf_ret != LNF_OK) {
+        ERROR(E_LNF, "lnf_mem_write_raw()");
+        return E_LNF;
+    }
+
+    return E_OK;
+}
+/**
+ * @}
+ */  // xchg_recv
+
+
+/**
+ * @defgroup xchg_tree Topology of the k-ary reduction tree.
+ *
+ * Processes are organized into a complete k-ary tree by their ranks in
+ * mpi_comm_main. The master (rank 0) is the root of the tree, children of the
+ * process with rank r are processes with ranks r * k + 1 to r * k + k (if they
+ * exist).
+ *
+ * @{
+ */
+/**
+ * @brief Return rank of the parent of the process with the given rank.
+ *
+ * @param[in] rank Rank of the process, has to be a slave.
+ * @param[in] fanin Tree fan-in (k), at least 2.
+ *
+ * @return Rank of the parent process.
+ */
+int
+xchg_tree_parent(int rank, uint64_t fanin)
+{
+    assert(rank > 0 && fanin >= 2);
+
+    return (rank - 1) / fanin;
+}
+
+/**
+ * @brief Return number of children of the process with the given rank.
+ *
+ * @param[in] rank Rank of the process.
+ * @param[in] fanin Tree fan-in (k), at least 2.
+ * @param[in] world_size Size of mpi_comm_main.
+ *
+ * @return Number of children, from 0 to fanin.
+ */
+uint64_t
+xchg_tree_children_cnt(int rank, uint64_t fanin, int world_size)
+{
+    assert(rank >= 0 && fanin >= 2 && world_size > rank);
+
+    const uint64_t first_child = (uint64_t)rank * fanin + 1;
+    if (first_child >= (uint64_t)world_size) {
+        return 0;  // leaf
+    }
+    return MIN(fanin, (uint64_t)world_size - first_child);
+}
+/**
+ * @}
+ */  // xchg_tree
@@ -0,0 +1,259 @@
+/**
+ * @brief Exchange of flow records between the processes.
+ */
+
+/*
+ * Copyright 2015-2018 CESNET
+ *
+ * This file is part of Fdistdump.
+ *
+ * Fdistdump is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Fdistdump is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Fdistdump.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <inttypes.h>           // for fixed-width integer types
+#include <stdatomic.h>          // for atomic_bool
+#include <stdbool.h>            // for bool
+#include <stddef.h>             // for size_t
+
+#include <libnf.h>              // for lnf_mem_t
+#include <mpi.h>                // for MPI_Request
+
+#include "common.h"             // for error_code_t, xchg_rec_size_t
+
+
+// flag in the record size prefix marking a record in the compact encoding
+#define XCHG_REC_COMPACT ((xchg_rec_size_t)1 << 31)
+// only records up to this length are encoded
+#define XCHG_COMPACT_REC_LEN_MAX LNF_MAX_RAW_LEN
+// message size of the streams received separately (e.g., sorted streams)
+#define XCHG_STREAM_BUFF_SIZE (64 * 1024)
+// flag in the first word of a message marking a compressed message
+#define XCHG_MSG_COMPRESSED ((xchg_rec_size_t)1 << 30)
+// flag in the first word of a message marking a fixed-width message
+#define XCHG_MSG_FIXED ((xchg_rec_size_t)1 << 29)
+// flag in the first word of a message marking a shared memory descriptor
+#define XCHG_MSG_SHM ((xchg_rec_size_t)1 << 28)
+// maximum number of the shared memory slots of a process
+#define XCHG_SHM_SLOTS_MAX (1 << 16)
+// version of the fixed-width message format
+#define XCHG_FIXED_VERSION 1
+// maximum number of columns of a fixed-width message
+#define XCHG_FIXED_COLS_MAX 64
+// number of the send buffers of each sender
+#define XCHG_RING_SIZE_MIN 2
+#define XCHG_RING_SIZE_DEFAULT 4
+#define XCHG_RING_SIZE_MAX 64
+// number of unprocessed messages of each sending process (flow control)
+#define XCHG_CREDITS_DEFAULT 16
+#define XCHG_CREDITS_MAX 1024
+
+
+// layout of the records in the sent messages
+enum xchg_layout {
+    XCHG_LAYOUT_PREFIXED,  // each record prefixed with its size
+    XCHG_LAYOUT_ROWS,  // fixed-width records one after another
+    XCHG_LAYOUT_COLUMNS,  // fixed-width records split into columns
+};
+
+// a fixed-width message being written or read
+struct xchg_fixed {
+    uint8_t *msg;  // the message, starting with the header
+    size_t msg_size;  // size of the message buffer (writing) or message
+    size_t rec_size;  // size of each record
+    size_t rec_cnt;  // number of records in the message
+    size_t rec_cap;  // maximum number of records in the message (writing)
+    size_t col_cnt;  // number of columns, 0 for the row layout
+    size_t col_sizes[XCHG_FIXED_COLS_MAX];  // size of each column
+    uint8_t *data;  // the records (behind the header)
+};
+
+
+// function called by the communication thread instead of sending a message
+typedef void (*xchg_comm_call_t)(void *arg);
+
+// a message sent directly or by the communication thread
+struct xchg_comm_msg {
+    const void *buff;
+    size_t size;
+    int dest;
+    int tag;
+    MPI_Comm comm;
+    bool credit;  // does the message consume an exchange credit?
+    xchg_comm_call_t call;  // if set, called instead of the send
+    void *arg;  // argument of the call
+
+    MPI_Request request;  // request of the direct send
+    atomic_bool sent;  // set by the communication thread after the send
+    _Atomic(struct xchg_comm_msg *) next;  // next message in the queue
+    struct xchg_comm_msg *pending_next;  // next message not sent yet
+};
+
+// ring of the send buffers of one sender
+struct xchg_ring {
+    size_t buff_cnt;  // number of the buffers
+    size_t buff_size;  // size of each buffer
+    uint8_t **buff;  // the message buffers
+    uint8_t **packed;  // compressed messages, NULL if compression is disabled
+    struct xchg_comm_msg *msgs;  // send of each buffer
+    size_t idx;  // index of the buffer being filled
+    size_t shm_slot;  // first shared memory slot, SIZE_MAX if not shared
+    xchg_rec_size_t (*shm_descs)[2];  // descriptor of each buffer
+
+    uint64_t skip;  // number of the next messages sent uncompressed
+    uint64_t skip_next;  // number of messages to skip after the next failure
+    uint64_t plain_bytes;  // bytes of the packed messages before compression
+    uint64_t packed_bytes;  // bytes of the packed messages after compression
+
+    uint64_t msg_cnt;  // number of the sent messages
+    uint64_t stall_cnt;  // number of waits for a free buffer
+    double stall_time;  // time spent waiting for a free buffer in seconds
+};
+
+
+typedef error_code_t (*xchg_recv_callback_t)(uint8_t *data,
+                                             xchg_rec_size_t data_len,
+                                             void *user);
+
+
+void
+xchg_set_buff_size(const size_t buff_size);
+
+size_t
+xchg_get_buff_size(void);
+
+void
+xchg_set_compact(const bool compact);
+
+void
+xchg_set_layout(const enum xchg_layout layout);
+
+enum xchg_layout
+xchg_get_layout(void);
+
+void
+xchg_fixed_init(struct xchg_fixed *const fx, uint8_t *const msg,
+                const size_t msg_size, const size_t col_cnt,
+                const size_t col_sizes[]);
+
+size_t
+xchg_fixed_put(struct xchg_fixed *const fx, const uint8_t *const rec,
+               const size_t rec_len);
+
+size_t
+xchg_fixed_finish(struct xchg_fixed *const fx);
+
+bool
+xchg_fixed_parse(struct xchg_fixed *const fx, uint8_t *const msg,
+                 const size_t msg_size);
+
+uint8_t *
+xchg_fixed_get(const struct xchg_fixed *const fx, const size_t idx,
+               uint8_t *const scratch);
+
+void
+xchg_set_compress(const bool compress);
+
+uint8_t *
+xchg_msg_unpack(uint8_t *const msg, size_t *const msg_size,
+                uint8_t **const scratch);
+
+void
+xchg_set_credits(const size_t window);
+
+void
+xchg_credits_finish(void);
+
+void
+xchg_set_comm_thread(const bool enable);
+
+void
+xchg_comm_msg_init(struct xchg_comm_msg *const msg);
+
+void
+xchg_comm_send(struct xchg_comm_msg *const msg, const void *const buff,
+               const size_t size, const int dest, const int mpi_tag,
+               const MPI_Comm comm, const bool credit);
+
+void
+xchg_comm_call(struct xchg_comm_msg *const msg, const xchg_comm_call_t call,
+               void *const arg);
+
+bool
+xchg_comm_test(struct xchg_comm_msg *const msg);
+
+void
+xchg_comm_wait(struct xchg_comm_msg *const msg);
+
+void
+xchg_comm_run(void);
+
+void
+xchg_comm_stop(void);
+
+void
+xchg_shm_init(const size_t slot_cnt);
+
+void
+xchg_shm_free(void);
+
+void
+xchg_ring_init(struct xchg_ring *const ring, const size_t buff_cnt);
+
+void
+xchg_ring_free(struct xchg_ring *const ring);
+
+uint8_t *
+xchg_ring_buff(const struct xchg_ring *const ring);
+
+void
+xchg_ring_send(struct xchg_ring *const ring, size_t msg_size, const int dest,
+               const int mpi_tag);
+
+size_t
+xchg_rec_put(uint8_t *const dst, const size_t dst_size,
+             const uint8_t *const rec, const size_t rec_len);
+
+uint8_t *
+xchg_rec_get(uint8_t **const src, uint8_t *const scratch,
+             xchg_rec_size_t *const rec_len);
+
+
+void
+xchg_send_terminator(int dest, int mpi_tag);
+
+void
+xchg_send_raw_recs(lnf_mem_t *const lnf_mem, size_t rec_limit, int dest,
+                   int mpi_tag, struct xchg_ring *const ring);
+
+void
+xchg_send_raw_mem(lnf_mem_t *const lnf_mem, size_t rec_limit, int dest,
+                  int mpi_tag, struct xchg_ring *const ring);
+
+void
+xchg_recv_loop(const uint64_t source_cnt, const uint64_t rec_limit,
+               const int mpi_tag, const xchg_recv_callback_t recv_callback,
+               void *const callback_data);
+
+error_code_t
+xchg_mem_write_raw_callback(uint8_t *data, xchg_rec_size_t data_len,
+                            void *user);
+
+
+int
+xchg_tree_parent(int rank, uint64_t fanin);
+
+uint64_t
+xchg_tree_children_cnt(int rank, uint64_t fanin, int world_size);